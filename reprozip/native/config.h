@@ -1,7 +1,7 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
-#define WORD_SIZE sizeof(int)
+#define WORD_SIZE sizeof(long)
 
 #if !defined(X86) && !defined(X86_64)
 #   if defined(__x86_64__) || defined(__x86_64)
@@ -1,9 +1,23 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* syscall() */
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <sqlite3.h>
 
@@ -32,24 +46,617 @@ static sqlite3_uint64 gettime(void)
     return timestamp;
 }
 
+unsigned long long db_timestamp(void)
+{
+    return gettime();
+}
+
 static sqlite3 *db;
-//static sqlite3_stmt *stmt_last_rowid;
-//static sqlite3_stmt *stmt_insert_process;
-//static sqlite3_stmt *stmt_set_exitcode;
-//static sqlite3_stmt *stmt_insert_file;
-//static sqlite3_stmt *stmt_insert_exec;
-//static sqlite3_stmt *stmt_insert_connection;
+
+/* Prepared once in db_init(), only used by the writer thread */
+static sqlite3_stmt *stmt_insert_process;
+static sqlite3_stmt *stmt_set_exitcode;
+static sqlite3_stmt *stmt_insert_exec;
+static sqlite3_stmt *stmt_insert_environment;
+static sqlite3_stmt *stmt_insert_path;
+static sqlite3_stmt *stmt_insert_connection;
+
+static const struct {
+    sqlite3_stmt **stmt;
+    const char *sql;
+} statements[] = {
+    {&stmt_insert_process,
+     "INSERT INTO processes(id, run_id, parent, timestamp, is_thread) "
+     "VALUES(?, ?, ?, ?, ?)"},
+    {&stmt_set_exitcode,
+     "UPDATE processes SET exitcode=?, exit_timestamp=?, "
+     "        cpu_time=? "
+     "WHERE id=?"},
+    {&stmt_insert_exec,
+     "INSERT INTO executed_files(run_id, name, timestamp, process, "
+     "        argv, envp, workingdir, environment) "
+     "VALUES(?, ?, ?, ?, ?, '', ?, ?)"},
+    {&stmt_insert_environment,
+     "INSERT INTO environments(id, hash, base, data) "
+     "VALUES(?, ?, ?, ?)"},
+    {&stmt_insert_path,
+     "INSERT INTO paths(id, name) VALUES(?, ?)"},
+    {&stmt_insert_connection,
+     "INSERT INTO connections(run_id, timestamp, process, "
+     "        inbound, family, protocol, address) "
+     "VALUES(?, ?, ?, ?, ?, ?, ?)"},
+};
+
+static int batches_prepare(void);
+static void batches_finalize(void);
+static int environments_load(void);
+static void environments_free(void);
+static int paths_load(void);
+static void paths_free(void);
+
+static void finalize_statements(void)
+{
+    size_t i;
+    for(i = 0; i < count(statements); ++i)
+    {
+        /* Finalizing NULL is a no-op */
+        sqlite3_finalize(*statements[i].stmt);
+        *statements[i].stmt = NULL;
+    }
+    batches_finalize();
+    environments_free();
+    paths_free();
+}
 
 static int run_id = -1;
 
+/* Process ids are given out here, the rows are inserted later */
+static unsigned int last_process_id;
+
+static int writer_failed = 0;
+
+static int writer_start(void);
+static void writer_stop(void);
+
+static int log_open(const char *filename);
+static int log_close(int rollback);
+
+#define NEGATIVE_LOOKUPS_SCHEMA \
+            "CREATE TABLE negative_lookups(" \
+            "    id INTEGER NOT NULL PRIMARY KEY," \
+            "    run_id INTEGER NOT NULL," \
+            "    name TEXT NOT NULL," \
+            "    timestamp INTEGER NOT NULL," \
+            "    mode INTEGER NOT NULL," \
+            "    error INTEGER NOT NULL," \
+            "    process INTEGER NOT NULL" \
+            "    );"
+
+/* executed_files.envp is empty when environment is set; it stays so runs can
+ * be appended to older traces */
+#define ENVIRONMENTS_SCHEMA \
+            "CREATE TABLE environments(" \
+            "    id INTEGER NOT NULL PRIMARY KEY," \
+            "    hash BLOB NOT NULL," \
+            "    base INTEGER," \
+            "    data TEXT NOT NULL" \
+            "    );"
+
+/* Each path is stored once in paths, opened_files is a view over file_opens
+ * for the readers */
+#define PATHS_SCHEMA \
+            "CREATE TABLE paths(" \
+            "    id INTEGER NOT NULL PRIMARY KEY," \
+            "    name TEXT NOT NULL" \
+            "    );" \
+            "CREATE TABLE file_opens(" \
+            "    id INTEGER NOT NULL PRIMARY KEY," \
+            "    run_id INTEGER NOT NULL," \
+            "    path INTEGER NOT NULL," \
+            "    timestamp INTEGER NOT NULL," \
+            "    mode INTEGER NOT NULL," \
+            "    is_directory BOOLEAN NOT NULL," \
+            "    process INTEGER NOT NULL" \
+            "    );"
+
+/* One row per run, see db_checkpoint */
+#define RUNS_SCHEMA \
+            "CREATE TABLE runs(" \
+            "    id INTEGER NOT NULL PRIMARY KEY," \
+            "    status TEXT NOT NULL" \
+            "    );"
+
+#define OPENED_FILES_VIEW \
+            "CREATE VIEW opened_files AS " \
+            "SELECT f.id AS id, f.run_id AS run_id, p.name AS name, " \
+            "    f.timestamp AS timestamp, f.mode AS mode, " \
+            "    f.is_directory AS is_directory, f.process AS process " \
+            "FROM file_opens f JOIN paths p ON f.path = p.id;"
+
+static const char *const tables[] = {
+    "CREATE TABLE processes("
+    "    id INTEGER NOT NULL PRIMARY KEY,"
+    "    run_id INTEGER NOT NULL,"
+    "    parent INTEGER,"
+    "    timestamp INTEGER NOT NULL,"
+    "    exit_timestamp INTEGER,"
+    "    cpu_time INTEGER,"
+    "    is_thread BOOLEAN NOT NULL,"
+    "    exitcode INTEGER"
+    "    );",
+    PATHS_SCHEMA,
+    "CREATE TABLE executed_files("
+    "    id INTEGER NOT NULL PRIMARY KEY,"
+    "    name TEXT NOT NULL,"
+    "    run_id INTEGER NOT NULL,"
+    "    timestamp INTEGER NOT NULL,"
+    "    process INTEGER NOT NULL,"
+    "    argv TEXT NOT NULL,"
+    "    envp TEXT NOT NULL,"
+    "    workingdir TEXT NOT NULL,"
+    "    environment INTEGER"
+    "    );",
+    "CREATE TABLE connections("
+    "    id INTEGER NOT NULL PRIMARY KEY,"
+    "    run_id INTEGER NOT NULL,"
+    "    timestamp INTEGER NOT NULL,"
+    "    process INTEGER NOT NULL,"
+    "    inbound INTEGER NOT NULL,"
+    "    family TEXT NULL,"
+    "    protocol TEXT NULL,"
+    "    address TEXT NULL"
+    "    );",
+    NEGATIVE_LOOKUPS_SCHEMA,
+    ENVIRONMENTS_SCHEMA,
+    RUNS_SCHEMA,
+    OPENED_FILES_VIEW,
+};
+
+/* Built by db_close() once the rows are in, rather than updated on every
+ * insert */
+static const struct {
+    const char *name;
+    const char *table;
+    const char *columns;
+} indexes[] = {
+    {"proc_parent_idx", "processes", "parent"},
+    {"open_proc_idx", "file_opens", "process"},
+    {"exec_proc_idx", "executed_files", "process"},
+    {"connections_proc_idx", "connections", "process"},
+};
+
+unsigned int db_reindex_rows = DB_REINDEX_ROWS;
+
+/* Appending a run: drops the indexes of the tables that have fewer than
+ * db_reindex_rows rows, indexes_create() rebuilds them. The bigger ones are
+ * kept, the new rows go at their end and updating them costs less than
+ * sorting all the rows again */
+static int indexes_drop(const char *schema)
+{
+    size_t i;
+    for(i = 0; i < count(indexes); ++i)
+    {
+        char sql[128];
+        sqlite3_stmt *stmt;
+        sqlite3_int64 rows;
+        int ret;
+        /* Ids are rowids, so this is the number of rows without a scan */
+        sprintf(sql, "SELECT max(id) FROM %s.%s;", schema, indexes[i].table);
+        ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+        if(ret != SQLITE_OK)
+            return ret;
+        if((ret = sqlite3_step(stmt)) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt);
+            return ret;
+        }
+        rows = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+        if(rows >= db_reindex_rows)
+            continue;
+        sprintf(sql, "DROP INDEX IF EXISTS %s.%s;", schema, indexes[i].name);
+        ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if(ret != SQLITE_OK)
+            return ret;
+        log_debug(0, "index %s dropped (%s has %lld rows), rebuilt on close",
+                  indexes[i].name, indexes[i].table, (long long)rows);
+    }
+    return SQLITE_OK;
+}
+
+static int indexes_create(const char *schema)
+{
+    size_t i;
+    for(i = 0; i < count(indexes); ++i)
+    {
+        char sql[128];
+        int ret;
+        sprintf(sql, "CREATE INDEX IF NOT EXISTS %s.%s ON %s(%s);",
+                schema, indexes[i].name, indexes[i].table,
+                indexes[i].columns);
+        ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if(ret != SQLITE_OK)
+            return ret;
+    }
+    return SQLITE_OK;
+}
+
+
+/* ********************
+ * Runs and checkpoints
+ *
+ * Each run gets a row in runs, 'running' from db_init() and 'done' once
+ * db_close() commits it. Without db_checkpoint, that is the same transaction
+ * and a run that didn't complete is simply not there.
+ *
+ * With db_checkpoint set, the database is put in WAL mode and the writer
+ * commits every db_checkpoint_events events or db_checkpoint_time
+ * milliseconds, so the WAL file stays small (SQLite checkpoints it into the
+ * database after each commit) and a crash only loses the last interval. The
+ * indexes are kept up to date as the rows go in, building them at the end
+ * would be one big transaction again.
+ *
+ * The next db_init() finds a crashed run still 'running': it marks it
+ * 'crashed' and keeps its rows, or deletes them if db_drop_crashed is set
+ * (along with the runs marked before). A rollback can't undo what was
+ * committed, so db_close() deletes the rows of the run instead.
+ *
+ * Only the tracer writes to the trace while it runs; a concurrent tracer would
+ * take a run in progress for a crashed one.
+ */
+
+int db_checkpoint = 0;
+unsigned int db_checkpoint_events = DB_CHECKPOINT_EVENTS;
+unsigned int db_checkpoint_time = DB_CHECKPOINT_TIME;
+int db_drop_crashed = 0;
+
+/* The WAL file is truncated back to that once checkpointed */
+#define DB_WAL_SIZE_LIMIT (16 * 1024 * 1024)
+
+/* Whether this run is committed as it goes; db_checkpoint doesn't apply to
+ * in-memory captures and binary logs */
+static int checkpointing = 0;
+
+/* Events written since the last commit, and when the first one came */
+static size_t checkpoint_pending = 0;
+static sqlite3_uint64 checkpoint_oldest;
+
+static const char *const run_tables[] = {
+    "processes", "file_opens", "executed_files", "connections",
+    "negative_lookups",
+};
+
+/* Paths and environments are shared between runs, they are kept */
+static int run_delete(int id)
+{
+    size_t i;
+    char sql[128];
+    int ret;
+    for(i = 0; i < count(run_tables); ++i)
+    {
+        sprintf(sql, "DELETE FROM %s WHERE run_id=%d;", run_tables[i], id);
+        ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if(ret != SQLITE_OK)
+            return ret;
+    }
+    sprintf(sql, "DELETE FROM runs WHERE id=%d;", id);
+    return sqlite3_exec(db, sql, NULL, NULL, NULL);
+}
+
+/* Called by db_init() when appending: a run that is still 'running' has
+ * crashed. With db_drop_crashed, the ones marked before are deleted too */
+static int runs_recover(void)
+{
+    sqlite3_stmt *stmt;
+    int *crashed = NULL;
+    size_t nb_crashed = 0, i;
+    int ret;
+    ret = sqlite3_prepare_v2(db, db_drop_crashed?
+                             "SELECT id FROM runs WHERE status!='done';":
+                             "SELECT id FROM runs WHERE status='running';",
+                             -1, &stmt, NULL);
+    if(ret != SQLITE_OK)
+        return ret;
+    /* Read them all first, the rows get deleted */
+    while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        crashed = realloc(crashed, (nb_crashed + 1) * sizeof(*crashed));
+        crashed[nb_crashed++] = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    if(ret != SQLITE_DONE)
+    {
+        free(crashed);
+        return ret;
+    }
+    ret = SQLITE_OK;
+    for(i = 0; i < nb_crashed && ret == SQLITE_OK; ++i)
+    {
+        if(db_drop_crashed)
+        {
+            log_warn(0, "run %d didn't complete, deleting it", crashed[i]);
+            ret = run_delete(crashed[i]);
+        }
+        else
+            log_warn(0, "run %d didn't complete, keeping what was recorded "
+                     "(marked as crashed)", crashed[i]);
+    }
+    free(crashed);
+    if(ret != SQLITE_OK)
+        return ret;
+    return sqlite3_exec(db, "UPDATE runs SET status='crashed' "
+                        "WHERE status='running';", NULL, NULL, NULL);
+}
+
+/* Called by db_init() once the statements can go to db */
+static int run_start(void)
+{
+    char sql[64];
+    int ret;
+    sprintf(sql, "INSERT INTO runs(id, status) VALUES(%d, 'running');",
+            run_id);
+    ret = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if(ret != SQLITE_OK || !checkpointing)
+        return ret;
+    /* The marker is there before any event */
+    checkpoint_pending = 0;
+    return sqlite3_exec(db, "COMMIT; BEGIN IMMEDIATE;", NULL, NULL, NULL);
+}
+
+static int run_done(void)
+{
+    char sql[64];
+    sprintf(sql, "UPDATE runs SET status='done' WHERE id=%d;", run_id);
+    return sqlite3_exec(db, sql, NULL, NULL, NULL);
+}
+
+/* Called by db_close() in place of the ROLLBACK */
+static int run_discard(void)
+{
+    int ret;
+    /* What wasn't committed yet goes away by itself */
+    ret = sqlite3_exec(db, "ROLLBACK; BEGIN IMMEDIATE;", NULL, NULL, NULL);
+    if(ret != SQLITE_OK)
+        return ret;
+    if((ret = run_delete(run_id)) != SQLITE_OK)
+    {
+        /* LCOV_EXCL_START : Disk full or I/O error; the next db_init() sees
+         * it as crashed */
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return ret;
+        /* LCOV_EXCL_END */
+    }
+    return sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+}
+
+
+/* ********************
+ * In-memory capture
+ *
+ * With db_in_memory set, db_init() still sets up the trace file and gets the
+ * run_id from it, but the run is recorded in a database of its own with no
+ * journal, that db_close() writes out at the end: with the backup API if
+ * db_init() just created the tables of the file, else by copying the rows
+ * over. A file with no run left can still have paths and environments that
+ * the capture refers to (see run_delete()).
+ *
+ * That database is SQLite's temporary database (empty filename): it lives in
+ * the page cache, and only spills to a file in the temporary directory once
+ * it outgrows db_memory_budget MiB. With a budget of 0, it is ":memory:" and
+ * never spills.
+ */
+
+int db_in_memory = 0;
+unsigned int db_memory_budget = DB_MEMORY_BUDGET;
+
+/* The trace file, while capturing in memory */
+static char *capture_target = NULL;
+static int capture_merge;
+
+#define MERGE(table, columns) \
+        "INSERT INTO target." table "(" columns ") " \
+        "SELECT " columns " FROM main." table ";"
+
+/* The ids of the other tables are only used in order */
+static const char *const capture_merge_sql[] = {
+    MERGE("processes", "id, run_id, parent, timestamp, exit_timestamp, "
+          "cpu_time, is_thread, exitcode"),
+    MERGE("paths", "id, name"),
+    MERGE("file_opens", "run_id, path, timestamp, mode, is_directory, "
+          "process"),
+    MERGE("executed_files", "name, run_id, timestamp, process, argv, envp, "
+          "workingdir, environment"),
+    MERGE("environments", "id, hash, base, data"),
+    MERGE("connections", "run_id, timestamp, process, inbound, family, "
+          "protocol, address"),
+    MERGE("negative_lookups", "run_id, name, timestamp, mode, error, "
+          "process"),
+    MERGE("runs", "id, status"),
+};
+
+/* Called by db_init() once the trace file is set up, in place of db */
+static int capture_open(const char *filename, int merge)
+{
+    size_t i;
+
+    if(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+        goto sqlerror;
+    check(sqlite3_close(db));
+    capture_target = strdup(filename);
+    capture_merge = merge;
+
+    check(sqlite3_open((db_memory_budget == 0)?":memory:":"", &db));
+    if(db_memory_budget > 0)
+    {
+        char sql[64];
+        /* Negative cache_size is in KiB */
+        sprintf(sql, "PRAGMA cache_size=-%lu;",
+                (unsigned long)db_memory_budget * 1024);
+        check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+    }
+    check(sqlite3_exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; "
+                       "BEGIN;", NULL, NULL, NULL));
+    for(i = 0; i < count(tables); ++i)
+        check(sqlite3_exec(db, tables[i], NULL, NULL, NULL));
+    if(db_memory_budget > 0)
+        log_debug(0, "capturing in memory, spilling to disk past %u MiB",
+                  db_memory_budget);
+    else
+        log_debug(0, "capturing in memory");
+    return 0;
+
+sqlerror:
+    log_critical(0, "sqlite3 error creating in-memory database: %s",
+                 sqlite3_errmsg(db));
+    return -1;
+}
+
+static int capture_backup(void)
+{
+    sqlite3 *target;
+    sqlite3_backup *backup;
+    int ret;
+
+    /* Built once here, the backup copies them over */
+    check(indexes_create("main"));
+
+    if(sqlite3_open(capture_target, &target) != SQLITE_OK)
+    {
+        log_critical(0, "sqlite3 error opening %s: %s", capture_target,
+                     sqlite3_errmsg(target));
+        sqlite3_close(target);
+        return -1;
+    }
+    backup = sqlite3_backup_init(target, "main", db, "main");
+    if(backup == NULL)
+        ret = sqlite3_errcode(target);
+    else
+    {
+        sqlite3_backup_step(backup, -1);
+        ret = sqlite3_backup_finish(backup);
+    }
+    if(ret != SQLITE_OK)
+    {
+        /* LCOV_EXCL_START : Disk full or I/O error */
+        log_critical(0, "sqlite3 error writing %s: %s", capture_target,
+                     sqlite3_errmsg(target));
+        sqlite3_close(target);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    sqlite3_close(target);
+    return 0;
+
+sqlerror:
+    /* LCOV_EXCL_START : Index creation shouldn't fail */
+    log_critical(0, "sqlite3 error creating indexes: %s", sqlite3_errmsg(db));
+    return -1;
+    /* LCOV_EXCL_END */
+}
+
+static int capture_copy(void)
+{
+    sqlite3_stmt *stmt_attach;
+    size_t i;
+
+    check(sqlite3_prepare_v2(db, "ATTACH DATABASE ? AS target;", -1,
+                             &stmt_attach, NULL));
+    sqlite3_bind_text(stmt_attach, 1, capture_target, -1, SQLITE_STATIC);
+    if(sqlite3_step(stmt_attach) != SQLITE_DONE)
+    {
+        sqlite3_finalize(stmt_attach);
+        goto sqlerror;
+    }
+    sqlite3_finalize(stmt_attach);
+
+    check(sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL));
+    if(indexes_drop("target") != SQLITE_OK)
+        goto copyerror;
+    for(i = 0; i < count(capture_merge_sql); ++i)
+    {
+        if(sqlite3_exec(db, capture_merge_sql[i], NULL, NULL, NULL)
+         != SQLITE_OK)
+            goto copyerror;
+    }
+    if(indexes_create("target") != SQLITE_OK)
+        goto copyerror;
+    check(sqlite3_exec(db, "COMMIT; DETACH DATABASE target;",
+                       NULL, NULL, NULL));
+    return 0;
+
+copyerror:
+    /* LCOV_EXCL_START : Insertions shouldn't fail */
+    log_critical(0, "sqlite3 error copying the trace to %s: %s",
+                 capture_target, sqlite3_errmsg(db));
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -1;
+    /* LCOV_EXCL_END */
+
+sqlerror:
+    log_critical(0, "sqlite3 error writing %s: %s", capture_target,
+                 sqlite3_errmsg(db));
+    return -1;
+}
+
+/* Called by db_close() in place of the COMMIT */
+static int capture_close(void)
+{
+    int ret;
+    if(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        /* LCOV_EXCL_START : Nothing to write, it has no journal */
+        log_critical(0, "sqlite3 error on exit: %s", sqlite3_errmsg(db));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    ret = capture_merge?capture_copy():capture_backup();
+    if(ret == 0)
+        log_debug(0, "in-memory capture written to %s (%s)", capture_target,
+                  capture_merge?"appended":"backup");
+    return ret;
+}
+
 int db_init(const char *filename)
 {
 	//printf("I am initing!\n");
     int tables_exist;
+    int negative_lookups_exist = 1;
+    int environments_exist = 1;
+    int paths_exist = 1;
+    int runs_exist = 1;
+
+    if(db_binary_log)
+        return log_open(filename);
 
     check(sqlite3_open(filename, &db));
     log_debug(0, "database file opened: %s", filename);
 
+    checkpointing = db_checkpoint && !db_in_memory;
+    if(checkpointing)
+    {
+        /* Can't be changed inside a transaction */
+        sqlite3_stmt *stmt_journal;
+        char sql[128];
+        sprintf(sql, "PRAGMA synchronous=NORMAL; "
+                "PRAGMA journal_size_limit=%d;", DB_WAL_SIZE_LIMIT);
+        check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+        check(sqlite3_prepare_v2(db, "PRAGMA journal_mode=WAL;", -1,
+                                 &stmt_journal, NULL));
+        if(sqlite3_step(stmt_journal) != SQLITE_ROW)
+        {
+            sqlite3_finalize(stmt_journal);
+            goto sqlerror;
+        }
+        /* Returns the mode in use, WAL needs shared memory */
+        if(strcmp((const char*)sqlite3_column_text(stmt_journal, 0),
+                  "wal") != 0)
+            log_warn(0, "couldn't use WAL mode, committing with a rollback "
+                     "journal");
+        sqlite3_finalize(stmt_journal);
+        log_debug(0, "committing every %u events or %u ms",
+                  db_checkpoint_events, db_checkpoint_time);
+    }
+
     check(sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL));
 
     {
@@ -72,13 +679,34 @@ int db_init(const char *filename)
                 found |= 0x04;
             else if(strcmp("connections", colname) == 0)
                 found |= 0x08;
+            else if(strcmp("negative_lookups", colname) == 0)
+                found |= 0x10;
+            else if(strcmp("environments", colname) == 0)
+                found |= 0x20;
+            else if(strcmp("paths", colname) == 0)
+                found |= 0x40;
+            else if(strcmp("file_opens", colname) == 0)
+                found |= 0x80;
+            else if(strcmp("runs", colname) == 0)
+                found |= 0x100;
             else
                 goto wrongschema;
         }
+        /* opened_files is a table before paths and file_opens exist, and a
+         * view after */
         if(found == 0x00)
             tables_exist = 0;
-        else if(found == 0x0F)
+        else if((found & 0x0D) == 0x0D
+              && ((found & 0xC2) == 0x02 || (found & 0xC2) == 0xC0))
+        {
+            /* Might have been created by an older version, add the new
+             * tables */
             tables_exist = 1;
+            negative_lookups_exist = (found & 0x10) != 0;
+            environments_exist = (found & 0x20) != 0;
+            paths_exist = (found & 0x40) != 0;
+            runs_exist = (found & 0x100) != 0;
+        }
         else
         {
         wrongschema:
@@ -92,74 +720,83 @@ int db_init(const char *filename)
 
     if(!tables_exist)
     {
-        const char *sql[] = {
-            "CREATE TABLE processes("
-            "    id INTEGER NOT NULL PRIMARY KEY,"
-            "    run_id INTEGER NOT NULL,"
-            "    parent INTEGER,"
-            "    timestamp INTEGER NOT NULL,"
-            "    exit_timestamp INTEGER,"
-            "    cpu_time INTEGER,"
-            "    is_thread BOOLEAN NOT NULL,"
-            "    exitcode INTEGER"
-            "    );",
-            "CREATE INDEX proc_parent_idx ON processes(parent);",
-            "CREATE TABLE opened_files("
-            "    id INTEGER NOT NULL PRIMARY KEY,"
-            "    run_id INTEGER NOT NULL,"
-            "    name TEXT NOT NULL,"
-            "    timestamp INTEGER NOT NULL,"
-            "    mode INTEGER NOT NULL,"
-            "    is_directory BOOLEAN NOT NULL,"
-            "    process INTEGER NOT NULL"
-            "    );",
-            "CREATE INDEX open_proc_idx ON opened_files(process);",
-            "CREATE TABLE executed_files("
-            "    id INTEGER NOT NULL PRIMARY KEY,"
-            "    name TEXT NOT NULL,"
-            "    run_id INTEGER NOT NULL,"
-            "    timestamp INTEGER NOT NULL,"
-            "    process INTEGER NOT NULL,"
-            "    argv TEXT NOT NULL,"
-            "    envp TEXT NOT NULL,"
-            "    workingdir TEXT NOT NULL"
-            "    );",
-            "CREATE INDEX exec_proc_idx ON executed_files(process);",
-            "CREATE TABLE connections("
-            "    id INTEGER NOT NULL PRIMARY KEY,"
-            "    run_id INTEGER NOT NULL,"
-            "    timestamp INTEGER NOT NULL,"
-            "    process INTEGER NOT NULL,"
-            "    inbound INTEGER NOT NULL,"
-            "    family TEXT NULL,"
-            "    protocol TEXT NULL,"
-            "    address TEXT NULL"
-            "    );",
-            "CREATE INDEX connections_proc_idx ON connections(process);",
-        };
         size_t i;
 
         //time_t exec_start_time = clock();
 
-        for(i = 0; i < count(sql); ++i)
-            check(sqlite3_exec(db, sql[i], NULL, NULL, NULL));
+        /* No indexes yet, db_close() creates them */
+        for(i = 0; i < count(tables); ++i)
+            check(sqlite3_exec(db, tables[i], NULL, NULL, NULL));
 
         //time_t exec_end_time = clock();
         //printf("\t\t-> the exec time in database is : %f\n", (double)(exec_end_time - exec_start_time)/CLOCKS_PER_SEC);
 
     }
 
-    /* Get the first unused run_id */
+    else
+    {
+        if(!negative_lookups_exist)
+        {
+            const char *sql = NEGATIVE_LOOKUPS_SCHEMA;
+            check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+        }
+        if(!environments_exist)
+        {
+            const char *sql = ENVIRONMENTS_SCHEMA
+                    "ALTER TABLE executed_files "
+                    "ADD COLUMN environment INTEGER;";
+            check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+        }
+        if(!paths_exist)
+        {
+            /* Moves the rows over, the join gets an automatic index */
+            const char *sql = PATHS_SCHEMA
+                    "INSERT INTO paths(name) "
+                    "SELECT DISTINCT name FROM opened_files;"
+                    "INSERT INTO file_opens(id, run_id, path, timestamp, "
+                    "        mode, is_directory, process) "
+                    "SELECT o.id, o.run_id, p.id, o.timestamp, "
+                    "        o.mode, o.is_directory, o.process "
+                    "FROM opened_files o JOIN paths p ON o.name = p.name;"
+                    "DROP TABLE opened_files;"
+                    OPENED_FILES_VIEW;
+            check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+            log_debug(0, "moved opened_files to paths and file_opens");
+        }
+        if(!runs_exist)
+        {
+            const char *sql = RUNS_SCHEMA;
+            check(sqlite3_exec(db, sql, NULL, NULL, NULL));
+        }
+        else
+            check(runs_recover());
+        /* An in-memory capture does that when it is copied over */
+        if(!db_in_memory && !checkpointing)
+            check(indexes_drop("main"));
+    }
+
+    /* Updated as the rows go in, see db_checkpoint */
+    if(checkpointing)
+        check(indexes_create("main"));
+
+    /* Get the first unused run_id and process id */
     {
         sqlite3_stmt *stmt_get_run_id;
-        const char *sql = "SELECT max(run_id) + 1 FROM processes;";
+        /* A crashed run might have no process */
+        const char *sql = ""
+                "SELECT max((SELECT coalesce(max(run_id), -1) "
+                "            FROM processes),"
+                "           (SELECT coalesce(max(id), -1) FROM runs)) + 1, "
+                "       (SELECT max(id) FROM processes);";
         check(sqlite3_prepare_v2(db, sql, -1, &stmt_get_run_id, NULL));
         if(sqlite3_step(stmt_get_run_id) != SQLITE_ROW)
         {
             sqlite3_finalize(stmt_get_run_id);
             goto sqlerror;
         }
+        /* The process id is NULL, read as 0, if the table is empty */
         run_id = sqlite3_column_int(stmt_get_run_id, 0);
+        last_process_id = sqlite3_column_int(stmt_get_run_id, 1);
         if(sqlite3_step(stmt_get_run_id) != SQLITE_DONE)
         {
             sqlite3_finalize(stmt_get_run_id);
@@ -169,98 +806,101 @@ int db_init(const char *filename)
     }
     log_debug(0, "This is run %d", run_id);
 
-    {
-        //const char *sql = ""
-        //        "SELECT last_insert_rowid()";
-        //check(sqlite3_prepare_v2(db, sql, -1, &stmt_last_rowid, NULL));
-    }
-
-    {
-        //const char *sql = ""
-        //        "INSERT INTO processes(run_id, parent, timestamp, is_thread) "
-        //        "VALUES(?, ?, ?, ?)";
-
-        //time_t prepare_start_time = clock();
-
-        //check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_process, NULL));
-
-        //time_t prepare_end_time = clock();
-        //printf("\t\t-> the prepare time(insert process) in database is : %f\n", (double)(prepare_end_time - prepare_start_time)/CLOCKS_PER_SEC);
-
-    }
+    check(environments_load());
+    check(paths_load());
 
+    if(db_in_memory && capture_open(filename, tables_exist) != 0)
     {
-    //    const char *sql = ""
-    //            "UPDATE processes SET exitcode=?, exit_timestamp=?, "
-    //            "        cpu_time=? "
-    //            "WHERE id=?";
-    //    check(sqlite3_prepare_v2(db, sql, -1, &stmt_set_exitcode, NULL));
+        free(capture_target);
+        capture_target = NULL;
+        return -1;
     }
 
-    {
-    //    const char *sql = ""
-    //            "INSERT INTO opened_files(run_id, name, timestamp, "
-    //            "        mode, is_directory, process) "
-    //            "VALUES(?, ?, ?, ?, ?, ?)";
-
-        //time_t prepare_start_time = clock();
-
-    //    check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_file, NULL));
-    
-        //time_t prepare_end_time = clock();
-        //printf("\t\t-> the prepare time(insert open_files) in database is : %f\n", (double)(prepare_end_time - prepare_start_time)/CLOCKS_PER_SEC);
-	}
+    check(run_start());
 
     {
-        //const char *sql = ""
-        //        "INSERT INTO executed_files(run_id, name, timestamp, process, "
-        //        "        argv, envp, workingdir) "
-        //        "VALUES(?, ?, ?, ?, ?, ?, ?)";
-
-        //time_t prepare_start_time = clock();
-
-        //check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_exec, NULL));
-    
-        //time_t prepare_end_time = clock();
-        //printf("\t\t-> the prepare time(insert exec_files) in database is : %f\n", (double)(prepare_end_time - prepare_start_time)/CLOCKS_PER_SEC);
-}
+        size_t i;
+        for(i = 0; i < count(statements); ++i)
+            check(sqlite3_prepare_v2(db, statements[i].sql, -1,
+                                     statements[i].stmt, NULL));
+        check(batches_prepare());
+    }
 
+    if(writer_start() != 0)
     {
-    //    const char *sql = ""
-    //            "INSERT INTO connections(run_id, timestamp, process, "
-    //            "        inbound, family, protocol, address) "
-    //            "VALUES(?, ?, ?, ?, ?, ?, ?)";
-    //    check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_connection, NULL));
+        /* LCOV_EXCL_START : Only fails on resource exhaustion */
+        finalize_statements();
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        sqlite3_close(db);
+        free(capture_target);
+        capture_target = NULL;
+        return -1;
+        /* LCOV_EXCL_END */
     }
 
     return 0;
 
 sqlerror:
     log_critical(0, "sqlite3 error creating database: %s", sqlite3_errmsg(db));
+    finalize_statements();
+    checkpointing = 0;
     return -1;
 }
 
 int db_close(int rollback)
 {
 	//printf("I am closing!\n");
+    int ret = 0;
+
+    if(db_binary_log)
+        return log_close(rollback);
+
+    /* Everything that was queued gets written first */
+    writer_stop();
+    if(!rollback && writer_failed)
+    {
+        log_critical(0, "couldn't write the trace, rolling back");
+        rollback = 1;
+        ret = -1;
+    }
+
     if(rollback)
     {
-        check(sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL));
+        /* An in-memory capture is just dropped, it has no journal */
+        if(checkpointing)
+            check(run_discard());
+        else if(capture_target == NULL)
+            check(sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL));
     }
     else
     {
-        check(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
+        check(run_done());
+        if(capture_target != NULL)
+        {
+            if(capture_close() != 0)
+                ret = -1;
+        }
+        else
+        {
+            check(indexes_create("main"));
+            check(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL));
+        }
+    }
+    if(checkpointing)
+    {
+        /* Readers of a database in WAL mode need to be able to create the
+         * shared memory file next to it; this also removes the WAL file */
+        check(sqlite3_exec(db, "PRAGMA journal_mode=DELETE;",
+                           NULL, NULL, NULL));
+        checkpointing = 0;
     }
     log_debug(0, "database file closed%s", rollback?" (rolled back)":"");
-    //check(sqlite3_finalize(stmt_last_rowid));
-    //check(sqlite3_finalize(stmt_insert_process));
-    //check(sqlite3_finalize(stmt_set_exitcode));
-    //check(sqlite3_finalize(stmt_insert_file));
-    //check(sqlite3_finalize(stmt_insert_exec));
-    //check(sqlite3_finalize(stmt_insert_connection));
+    finalize_statements();
+    free(capture_target);
+    capture_target = NULL;
     check(sqlite3_close(db));
     run_id = -1;
-    return 0;
+    return ret;
 
 sqlerror:
     log_critical(0, "sqlite3 error on exit: %s", sqlite3_errmsg(db));
@@ -269,91 +909,47 @@ sqlerror:
 
 #define DB_NO_PARENT ((unsigned int)-2)
 
-int db_add_process(unsigned int *id, unsigned int parent_id,
-                   const char *working_dir, int is_thread)
+static int write_process(unsigned int id, unsigned int parent_id,
+                         int is_thread, sqlite3_uint64 timestamp)
 {
-	//printf("I am adding process!\n");
-    char sql_insert_process[1024];
-    sql_insert_process[0] = '\0';
-    if(parent_id == DB_NO_PARENT)
-    {
-        sprintf(sql_insert_process, "INSERT INTO processes(run_id, parent, timestamp, is_thread) VALUES(%d, null, %lld, %d)", run_id, gettime(), is_thread?1:0);
-    }
-    else
-    {
-        sprintf(sql_insert_process, "INSERT INTO processes(run_id, parent, timestamp, is_thread) VALUES(%d, %d, %lld, %d)", run_id, parent_id, gettime(), is_thread?1:0);
-    }
-
-
-
-/*
-    check(sqlite3_bind_int(stmt_insert_process, 1, run_id));
+    check(sqlite3_bind_int(stmt_insert_process, 1, id));
+    check(sqlite3_bind_int(stmt_insert_process, 2, run_id));
     if(parent_id == DB_NO_PARENT)
     {
-        check(sqlite3_bind_null(stmt_insert_process, 2));
+        check(sqlite3_bind_null(stmt_insert_process, 3));
     }
     else
     {
-        check(sqlite3_bind_int(stmt_insert_process, 2, parent_id));
+        check(sqlite3_bind_int(stmt_insert_process, 3, parent_id));
     }
-    // This assumes that we won't go over 2^32 seconds (~135 years) 
-    check(sqlite3_bind_int64(stmt_insert_process, 3, gettime()));
-    check(sqlite3_bind_int(stmt_insert_process, 4, is_thread?1:0));
-*/
-    //time_t step_start_time = clock();
-
-    check(sqlite3_exec(db, sql_insert_process, NULL, NULL, NULL));
-    //if(sqlite3_step(stmt_insert_process) != SQLITE_DONE)
-    //    goto sqlerror;
-
-    ////time_t step_end_time = clock();
-    ////printf("\t\t-> the step time(insert process) in database is : %f\n", (double)(step_end_time - step_start_time)/CLOCKS_PER_SEC);
-
-    //sqlite3_reset(stmt_insert_process);
+    /* This assumes that we won't go over 2^32 seconds (~135 years) */
+    check(sqlite3_bind_int64(stmt_insert_process, 4, timestamp));
+    check(sqlite3_bind_int(stmt_insert_process, 5, is_thread?1:0));
 
-    /* Get id */
-    sqlite3_stmt *stmt_last_rowid;
-	{
-        const char *sql = ""
-                "SELECT last_insert_rowid()";
-        check(sqlite3_prepare_v2(db, sql, -1, &stmt_last_rowid, NULL));
-    }
-    if(sqlite3_step(stmt_last_rowid) != SQLITE_ROW)
-        goto sqlerror;
-    *id = sqlite3_column_int(stmt_last_rowid, 0);
-    if(sqlite3_step(stmt_last_rowid) != SQLITE_DONE)
+    if(sqlite3_step(stmt_insert_process) != SQLITE_DONE)
         goto sqlerror;
-    sqlite3_finalize(stmt_last_rowid);
+    sqlite3_reset(stmt_insert_process);
 
-    return db_add_file_open(*id, working_dir, FILE_WDIR, 1);
+    return 0;
 
 sqlerror:
-    printf("sqlite3 error inserting process: %s\n", sqlite3_errmsg(db));
     /* LCOV_EXCL_START : Insertions shouldn't fail */
     log_critical(0, "sqlite3 error inserting process: %s", sqlite3_errmsg(db));
     return -1;
     /* LCOV_EXCL_END */
 }
 
-int db_add_first_process(unsigned int *id, const char *working_dir)
-{
-    return db_add_process(id, DB_NO_PARENT, working_dir, 0);
-}
-
-int db_add_exit(unsigned int id, int exitcode, int cpu_time)
+static int write_exit(unsigned int id, int exitcode, int cpu_time,
+                      sqlite3_uint64 timestamp)
 {
-	char sql_set_exitcode[1024];
-	sql_set_exitcode[0] = '\0';
-	sprintf(sql_set_exitcode, "UPDATE processes SET exitcode=%d, exit_timestamp=%lld, cpu_time=%d WHERE id=%d", exitcode, gettime(), cpu_time, id);
-	check(sqlite3_exec(db, sql_set_exitcode, NULL, NULL, NULL));
-    //check(sqlite3_bind_int(stmt_set_exitcode, 1, exitcode));
-    //check(sqlite3_bind_int64(stmt_set_exitcode, 2, gettime()));
-    //check(sqlite3_bind_int(stmt_set_exitcode, 3, cpu_time));
-    //check(sqlite3_bind_int(stmt_set_exitcode, 4, id));
+    check(sqlite3_bind_int(stmt_set_exitcode, 1, exitcode));
+    check(sqlite3_bind_int64(stmt_set_exitcode, 2, timestamp));
+    check(sqlite3_bind_int(stmt_set_exitcode, 3, cpu_time));
+    check(sqlite3_bind_int(stmt_set_exitcode, 4, id));
 
-    //if(sqlite3_step(stmt_set_exitcode) != SQLITE_DONE)
-    //    goto sqlerror;
-    //sqlite3_reset(stmt_set_exitcode);
+    if(sqlite3_step(stmt_set_exitcode) != SQLITE_DONE)
+        goto sqlerror;
+    sqlite3_reset(stmt_set_exitcode);
 
     return 0;
 
@@ -364,41 +960,6 @@ sqlerror:
     /* LCOV_EXCL_END */
 }
 
-int db_add_file_open(unsigned int process, const char *name,
-                     unsigned int mode, int is_dir)
-{
-	//printf("I am adding open_files!\n");
-	char sql_insert_file[1024];
-	sql_insert_file[0] = '\0';
-    //printf("name = [%s]\n", name);
-	sprintf(sql_insert_file, "INSERT INTO opened_files(run_id, name, timestamp, mode, is_directory, process) VALUES(%d, '%s', %lld, %d, %d, %d)", run_id, name, gettime(), mode, is_dir, process);
-	check(sqlite3_exec(db, sql_insert_file, NULL, NULL, NULL));
-
-    //check(sqlite3_bind_int(stmt_insert_file, 1, run_id));
-    //check(sqlite3_bind_text(stmt_insert_file, 2, name, -1, SQLITE_TRANSIENT));
-    ///* This assumes that we won't go over 2^32 seconds (~135 years) */
-    //check(sqlite3_bind_int64(stmt_insert_file, 3, gettime()));
-    //check(sqlite3_bind_int(stmt_insert_file, 4, mode));
-    //check(sqlite3_bind_int(stmt_insert_file, 5, is_dir));
-    //check(sqlite3_bind_int(stmt_insert_file, 6, process));
-
-    ////time_t step_start_time = clock();
-    //if(sqlite3_step(stmt_insert_file) != SQLITE_DONE)
-    //    goto sqlerror;
-
-    //time_t step_end_time = clock();
-    //printf("\t\t-> the step time(insert open_files) in database is : %f\n", (double)(step_end_time - step_start_time)/CLOCKS_PER_SEC);
-
-    //sqlite3_reset(stmt_insert_file);
-    return 0;
-
-sqlerror:
-    /* LCOV_EXCL_START : Insertions shouldn't fail */
-    log_critical(0, "sqlite3 error inserting file: %s", sqlite3_errmsg(db));
-    return -1;
-    /* LCOV_EXCL_END */
-}
-
 static char *strarray2nulsep(const char *const *array, size_t *plen)
 {
     char *list;
@@ -428,67 +989,24 @@ static char *strarray2nulsep(const char *const *array, size_t *plen)
     return list;
 }
 
-int db_add_exec(unsigned int process, const char *binary,
-                const char *const *argv, const char *const *envp,
-                const char *workingdir)
+static int write_exec(unsigned int process, const char *binary,
+                      const char *argv, size_t argv_len,
+                      unsigned int environment,
+                      const char *workingdir, sqlite3_uint64 timestamp)
 {
-    //printf("I am adding exec_files!\n");
-	sqlite3_stmt *stmt_insert_exec;
-
-	const char *sql = ""
-            "INSERT INTO executed_files(run_id, name, timestamp, process, "
-            "        argv, envp, workingdir) "
-            "VALUES(?, ?, ?, ?, ?, ?, ?)";
-    check(sqlite3_prepare_v2(db, sql, -1, &stmt_insert_exec, NULL));
- 
-	check(sqlite3_bind_int(stmt_insert_exec, 1, run_id));
-    check(sqlite3_bind_text(stmt_insert_exec, 2, binary,
-                            -1, SQLITE_TRANSIENT));
-    /* This assumes that we won't go over 2^32 seconds (~135 years) */
-    check(sqlite3_bind_int64(stmt_insert_exec, 3, gettime()));
+    check(sqlite3_bind_int(stmt_insert_exec, 1, run_id));
+    check(sqlite3_bind_text(stmt_insert_exec, 2, binary, -1, SQLITE_STATIC));
+    check(sqlite3_bind_int64(stmt_insert_exec, 3, timestamp));
     check(sqlite3_bind_int(stmt_insert_exec, 4, process));
-    {
-        size_t len;
-        char *arglist = strarray2nulsep(argv, &len);
-        check(sqlite3_bind_text(stmt_insert_exec, 5, arglist, len,
-                                SQLITE_TRANSIENT));
-        free(arglist);
-    }
-    {
-        size_t len;
-        char *envlist = strarray2nulsep(envp, &len);
-        check(sqlite3_bind_text(stmt_insert_exec, 6, envlist, len,
-                                SQLITE_TRANSIENT));
-        free(envlist);
-    }
-    check(sqlite3_bind_text(stmt_insert_exec, 7, workingdir,
-                            -1, SQLITE_TRANSIENT));
-
-    //time_t step_start_time = clock();
+    check(sqlite3_bind_text(stmt_insert_exec, 5, argv, argv_len,
+                            SQLITE_STATIC));
+    check(sqlite3_bind_text(stmt_insert_exec, 6, workingdir,
+                            -1, SQLITE_STATIC));
+    check(sqlite3_bind_int(stmt_insert_exec, 7, environment));
 
     if(sqlite3_step(stmt_insert_exec) != SQLITE_DONE)
         goto sqlerror;
-	sqlite3_finalize(stmt_insert_exec);
-
-    //time_t step_end_time = clock();
-    //printf("\t\t-> the step time(insert exec_files) in database is : %f\n", (double)(step_end_time - step_start_time)/CLOCKS_PER_SEC);
-
-	//
-	//char sql_insert_exec[100000];
-	//sql_insert_exec[0] = '\0';
-
-    //size_t len1;
-    //char *arglist = strarray2nulsep(argv, &len1);
-    //size_t len2;
-    //char *envlist = strarray2nulsep(envp, &len2);
-    //printf("%.*s\n", (int)len2, envlist);
-	//sprintf(sql_insert_exec, "INSERT INTO executed_files(run_id, name, timestamp, process, argv, envp, workingdir) VALUES(%d, '%s', %lld, %d, '%.*s', '%.*s', '%s')" , run_id, binary, gettime(), process, (int)len1, arglist, (int)len2, envlist, workingdir);
-    //free(arglist);
-    //free(envlist);
-	//check(sqlite3_exec(db, sql_insert_exec, NULL, NULL, NULL));
-
-    
-    //sqlite3_reset(stmt_insert_exec);
+    sqlite3_reset(stmt_insert_exec);
     return 0;
 
 sqlerror:
@@ -498,98 +1016,25 @@ sqlerror:
     /* LCOV_EXCL_END */
 }
 
-int db_add_connection(unsigned int process, int inbound, const char *family,
-                      const char *protocol, const char *address)
-{
-	//printf("I am adding connections!\n");
-	char sql_insert_connection[1024];
-	sql_insert_connection[0] = '\0';
-
-	if(family == NULL)
-	{
-		if(protocol == NULL)
-		{
-			if(address == NULL)
-			{
-				// all null
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, null, null, null)" , run_id, gettime(), process, inbound?1:0);
-			}
-			else 
-			{
-				// f null, p null, a %s
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, null, null, '%s')'" , run_id, gettime(), process, inbound?1:0, address);
-			}
-		}
-		else
-		{
-			if(address == NULL)
-			{
-				//f null, p %s, a null
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, null, '%s', null)" , run_id, gettime(), process, inbound?1:0, protocol);
-			}
-			else 
-			{
-				//f null, p %s, a %s
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, null, '%s', '%s')" , run_id, gettime(), process, inbound?1:0, protocol, address);
-			}
-		}
-	}
-    else
-    {
-    	if(protocol == NULL)
-		{
-			if(address == NULL)
-			{
-				//f %s, p null, a null
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, '%s', null, null)" , run_id, gettime(), process, inbound?1:0, family);
-			}
-			else 
-			{
-				//f %s. p null, a %s
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, '%s', null, '%s')" , run_id, gettime(), process, inbound?1:0, family, address);
-			}
-		}
-		else
-		{
-			if(address == NULL)
-			{
-				//f %s, p %s, a null
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, '%s', '%s', null)" , run_id, gettime(), process, inbound?1:0, family, protocol);
-			}
-			else 
-			{
-				//f %s, p %s, a %s
-				sprintf(sql_insert_connection, "INSERT INTO connections(run_id, timestamp, process, inbound, family, protocol, address) VALUES(%d, %lld, %d, %d, '%s', '%s', '%s')" , run_id, gettime(), process, inbound?1:0, family, protocol, address);
-			}
-		}
-    }
-
-	check(sqlite3_exec(db, sql_insert_connection, NULL, NULL, NULL));
-
-/*
+static int write_connection(unsigned int process, int inbound,
+                            const char *family, const char *protocol,
+                            const char *address, sqlite3_uint64 timestamp)
+{
     check(sqlite3_bind_int(stmt_insert_connection, 1, run_id));
-    check(sqlite3_bind_int64(stmt_insert_connection, 2, gettime()));
+    check(sqlite3_bind_int64(stmt_insert_connection, 2, timestamp));
     check(sqlite3_bind_int(stmt_insert_connection, 3, process));
     check(sqlite3_bind_int(stmt_insert_connection, 4, inbound?1:0));
-    if(family == NULL)
-        check(sqlite3_bind_null(stmt_insert_connection, 5));
-    else
-        check(sqlite3_bind_text(stmt_insert_connection, 5, family,
-                                -1, SQLITE_TRANSIENT));
-    if(protocol == NULL)
-        check(sqlite3_bind_null(stmt_insert_connection, 6));
-    else
-        check(sqlite3_bind_text(stmt_insert_connection, 6, protocol,
-                                -1, SQLITE_TRANSIENT));
-    if(address == NULL)
-        check(sqlite3_bind_null(stmt_insert_connection, 7));
-    else
-        check(sqlite3_bind_text(stmt_insert_connection, 7, address,
-                                -1, SQLITE_TRANSIENT));
-*/
-    //if(sqlite3_step(stmt_insert_connection) != SQLITE_DONE)
-    //    goto sqlerror;
-    //sqlite3_reset(stmt_insert_connection);
+    /* Binding NULL text stores NULL */
+    check(sqlite3_bind_text(stmt_insert_connection, 5, family,
+                            -1, SQLITE_STATIC));
+    check(sqlite3_bind_text(stmt_insert_connection, 6, protocol,
+                            -1, SQLITE_STATIC));
+    check(sqlite3_bind_text(stmt_insert_connection, 7, address,
+                            -1, SQLITE_STATIC));
+
+    if(sqlite3_step(stmt_insert_connection) != SQLITE_DONE)
+        goto sqlerror;
+    sqlite3_reset(stmt_insert_connection);
     return 0;
 
 sqlerror:
@@ -599,3 +1044,1731 @@ sqlerror:
     return -1;
     /* LCOV_EXCL_END */
 }
+
+
+/* ********************
+ * Environments
+ *
+ * Most programs run with the environment they inherited, so it is stored
+ * once in environments, found by a 128-bit hash of the NUL-separated envp,
+ * and referenced by executed_files.environment. A new environment is stored
+ * as a delta against the one the process had before execve() (usually its
+ * parent's) when that is smaller. A delta is a list of NUL-terminated items:
+ * "=N" copies the next N entries of the base, "-N" skips N of them, "+ENTRY"
+ * adds an entry, and what is left of the base is dropped.
+ *
+ * Only the writer thread uses this. It knows the hashes of every environment
+ * in the database, and keeps the content of the ones that are the current
+ * environment of a live process, to compute deltas against.
+ */
+
+struct Environment {
+    unsigned char hash[16];
+    unsigned int id;
+    unsigned int refs;      /* processes using it */
+    size_t size;
+    char data[];
+};
+
+struct EnvironmentSlot {
+    unsigned char hash[16];
+    unsigned int id;        /* 0 if the slot is free */
+    struct Environment *live;
+};
+
+/* Open addressing, the size is a power of 2 */
+static struct EnvironmentSlot *env_slots = NULL;
+static size_t env_slots_size = 0;
+static size_t env_slots_used = 0;
+static unsigned int last_environment_id;
+
+/* Current environment of each process, by id from env_first_process */
+static struct Environment **process_envs = NULL;
+static size_t process_envs_size = 0;
+static unsigned int env_first_process;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* MurmurHash3 x64 128, in host byte order */
+static void hash128(const char *data, size_t len, unsigned char *out)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t i, nblocks = len / 16, rest = len & 15;
+    const unsigned char *tail = p + nblocks * 16;
+
+    for(i = 0; i < nblocks; ++i)
+    {
+        memcpy(&k1, p + i * 16, 8);
+        memcpy(&k2, p + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+    for(i = rest; i > 8; --i)
+        k2 ^= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    if(rest > 8)
+    {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for(i = (rest < 8)?rest:8; i > 0; --i)
+        k1 ^= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    if(rest > 0)
+    {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    memcpy(out, &h1, 8);
+    memcpy(out + 8, &h2, 8);
+}
+
+/* Returns the slot with that hash, or the free slot where it would go */
+static struct EnvironmentSlot *env_slot(const unsigned char *hash)
+{
+    uint64_t h;
+    size_t i;
+    memcpy(&h, hash, 8);
+    i = h & (env_slots_size - 1);
+    while(env_slots[i].id != 0
+        && memcmp(env_slots[i].hash, hash, sizeof(env_slots[i].hash)) != 0)
+        i = (i + 1) & (env_slots_size - 1);
+    return &env_slots[i];
+}
+
+static struct EnvironmentSlot *env_slot_add(const unsigned char *hash,
+                                            unsigned int id)
+{
+    struct EnvironmentSlot *slot;
+    /* Keep the load factor under 1/2 */
+    if((env_slots_used + 1) * 2 > env_slots_size)
+    {
+        struct EnvironmentSlot *old = env_slots;
+        size_t i, old_size = env_slots_size;
+        env_slots_size = old_size * 2;
+        env_slots = calloc(env_slots_size, sizeof(*env_slots));
+        for(i = 0; i < old_size; ++i)
+            if(old[i].id != 0)
+                *env_slot(old[i].hash) = old[i];
+        free(old);
+    }
+    slot = env_slot(hash);
+    memcpy(slot->hash, hash, sizeof(slot->hash));
+    slot->id = id;
+    slot->live = NULL;
+    ++env_slots_used;
+    return slot;
+}
+
+static struct Environment *env_new(struct EnvironmentSlot *slot,
+                                   const char *envp, size_t size)
+{
+    struct Environment *env = malloc(sizeof(*env) + size);
+    memcpy(env->hash, slot->hash, sizeof(env->hash));
+    env->id = slot->id;
+    env->refs = 0;
+    env->size = size;
+    memcpy(env->data, envp, size);
+    slot->live = env;
+    return env;
+}
+
+static void env_release(struct Environment *env)
+{
+    if(env != NULL && --env->refs == 0)
+    {
+        env_slot(env->hash)->live = NULL;
+        free(env);
+    }
+}
+
+/* Returns NULL for processes from previous runs */
+static struct Environment **process_env(unsigned int process)
+{
+    size_t i;
+    if(process < env_first_process)
+        return NULL;
+    i = process - env_first_process;
+    if(i >= process_envs_size)
+    {
+        size_t new_size = (process_envs_size == 0)?1024:process_envs_size;
+        while(new_size <= i)
+            new_size *= 2;
+        process_envs = realloc(process_envs,
+                               new_size * sizeof(*process_envs));
+        memset(process_envs + process_envs_size, 0,
+               (new_size - process_envs_size) * sizeof(*process_envs));
+        process_envs_size = new_size;
+    }
+    return &process_envs[i];
+}
+
+static size_t env_split(const char *data, size_t size,
+                        const char ***entries, size_t **lengths)
+{
+    size_t i, start = 0, n = 0;
+    for(i = 0; i < size; ++i)
+        if(data[i] == '\0')
+            ++n;
+    *entries = malloc((n + 1) * sizeof(**entries));
+    *lengths = malloc((n + 1) * sizeof(**lengths));
+    n = 0;
+    for(i = 0; i < size; ++i)
+    {
+        if(data[i] == '\0')
+        {
+            (*entries)[n] = data + start;
+            (*lengths)[n] = i - start;
+            ++n;
+            start = i + 1;
+        }
+    }
+    return n;
+}
+
+struct Delta {
+    char *data;
+    size_t size;
+    size_t limit;           /* gives up once it gets that big */
+    size_t copy, skip;      /* pending runs, only one at a time */
+};
+
+static int delta_item(struct Delta *delta, char op,
+                      const char *str, size_t len)
+{
+    if(delta->size + len + 2 >= delta->limit)
+        return -1;
+    delta->data[delta->size++] = op;
+    memcpy(delta->data + delta->size, str, len);
+    delta->size += len;
+    delta->data[delta->size++] = '\0';
+    return 0;
+}
+
+static int delta_flush(struct Delta *delta)
+{
+    char num[24];
+    if(delta->copy > 0)
+    {
+        sprintf(num, "%lu", (unsigned long)delta->copy);
+        delta->copy = 0;
+        return delta_item(delta, '=', num, strlen(num));
+    }
+    else if(delta->skip > 0)
+    {
+        sprintf(num, "%lu", (unsigned long)delta->skip);
+        delta->skip = 0;
+        return delta_item(delta, '-', num, strlen(num));
+    }
+    return 0;
+}
+
+static int delta_copy(struct Delta *delta)
+{
+    if(delta->skip > 0 && delta_flush(delta) != 0)
+        return -1;
+    delta->copy++;
+    return 0;
+}
+
+static int delta_skip(struct Delta *delta)
+{
+    if(delta->copy > 0 && delta_flush(delta) != 0)
+        return -1;
+    delta->skip++;
+    return 0;
+}
+
+static int delta_add(struct Delta *delta, const char *entry, size_t len)
+{
+    if(delta_flush(delta) != 0)
+        return -1;
+    return delta_item(delta, '+', entry, len);
+}
+
+/* Returns the delta from base to envp, or NULL if it isn't smaller. Single
+ * insertions, removals and changes are found, anything else is a change */
+static char *env_delta(const struct Environment *base,
+                       const char *envp, size_t size, size_t *delta_size)
+{
+    const char **old, **new;
+    size_t *old_len, *new_len;
+    size_t nb_old, nb_new, i = 0, j = 0;
+    struct Delta delta;
+    int ret = 0;
+
+    nb_old = env_split(base->data, base->size, &old, &old_len);
+    nb_new = env_split(envp, size, &new, &new_len);
+    delta.data = malloc(size + 1);
+    delta.size = 0;
+    delta.limit = size;
+    delta.copy = delta.skip = 0;
+
+#define SAME(a, b) (old_len[(a)] == new_len[(b)] \
+                    && memcmp(old[(a)], new[(b)], old_len[(a)]) == 0)
+    while(ret == 0 && i < nb_old && j < nb_new)
+    {
+        if(SAME(i, j))
+        {
+            ret = delta_copy(&delta);
+            ++i, ++j;
+        }
+        else if(i + 1 < nb_old && SAME(i + 1, j))
+        {
+            ret = delta_skip(&delta);
+            ++i;
+        }
+        else if(j + 1 < nb_new && SAME(i, j + 1))
+        {
+            ret = delta_add(&delta, new[j], new_len[j]);
+            ++j;
+        }
+        else
+        {
+            ret = delta_skip(&delta);
+            if(ret == 0)
+                ret = delta_add(&delta, new[j], new_len[j]);
+            ++i, ++j;
+        }
+    }
+#undef SAME
+    while(ret == 0 && j < nb_new)
+    {
+        ret = delta_add(&delta, new[j], new_len[j]);
+        ++j;
+    }
+    /* The rest of the base is dropped anyway */
+    delta.skip = 0;
+    if(ret == 0)
+        ret = delta_flush(&delta);
+
+    free(old);
+    free(old_len);
+    free(new);
+    free(new_len);
+    if(ret != 0)
+    {
+        free(delta.data);
+        return NULL;
+    }
+    *delta_size = delta.size;
+    return delta.data;
+}
+
+static int write_environment(unsigned int id, const unsigned char *hash,
+                             unsigned int base, const char *data,
+                             size_t size)
+{
+    check(sqlite3_bind_int(stmt_insert_environment, 1, id));
+    check(sqlite3_bind_blob(stmt_insert_environment, 2, hash, 16,
+                            SQLITE_STATIC));
+    if(base == 0)
+    {
+        check(sqlite3_bind_null(stmt_insert_environment, 3));
+    }
+    else
+    {
+        check(sqlite3_bind_int(stmt_insert_environment, 3, base));
+    }
+    check(sqlite3_bind_text(stmt_insert_environment, 4, data, size,
+                            SQLITE_STATIC));
+
+    if(sqlite3_step(stmt_insert_environment) != SQLITE_DONE)
+        goto sqlerror;
+    sqlite3_reset(stmt_insert_environment);
+    return 0;
+
+sqlerror:
+    /* LCOV_EXCL_START : Insertions shouldn't fail */
+    log_critical(0, "sqlite3 error inserting environment: %s",
+                 sqlite3_errmsg(db));
+    return -1;
+    /* LCOV_EXCL_END */
+}
+
+/* Finds the environment of the process after execve(), inserting it if it
+ * is new */
+static int environment_store(unsigned int process, const char *envp,
+                             size_t size, unsigned int *id)
+{
+    unsigned char hash[16];
+    struct Environment **current = process_env(process);
+    struct EnvironmentSlot *slot;
+    struct Environment *env;
+
+    hash128(envp, size, hash);
+    slot = env_slot(hash);
+    if(slot->id != 0)
+    {
+        env = slot->live;
+        /* Its content is needed again, for the deltas of its children */
+        if(env == NULL)
+            env = env_new(slot, envp, size);
+    }
+    else
+    {
+        struct Environment *base = (current != NULL)?*current:NULL;
+        char *delta = NULL;
+        size_t delta_size;
+        unsigned int new_id = ++last_environment_id;
+        int ret;
+        if(base != NULL)
+            delta = env_delta(base, envp, size, &delta_size);
+        if(delta != NULL)
+            ret = write_environment(new_id, hash, base->id,
+                                    delta, delta_size);
+        else
+            ret = write_environment(new_id, hash, 0, envp, size);
+        free(delta);
+        if(ret != 0)
+            return -1;
+        env = env_new(env_slot_add(hash, new_id), envp, size);
+    }
+    *id = env->id;
+
+    env->refs++;
+    if(current != NULL)
+    {
+        env_release(*current);
+        *current = env;
+    }
+    else
+        env_release(env);
+    return 0;
+}
+
+static void environment_inherit(unsigned int process, unsigned int parent)
+{
+    struct Environment **env = process_env(process);
+    struct Environment **parent_env;
+    if(env == NULL || parent == DB_NO_PARENT)
+        return;
+    /* Might move the array */
+    parent_env = process_env(parent);
+    env = process_env(process);
+    if(parent_env != NULL && *parent_env != NULL)
+    {
+        *env = *parent_env;
+        (*env)->refs++;
+    }
+}
+
+static void environment_exit(unsigned int process)
+{
+    struct Environment **env = process_env(process);
+    if(env != NULL)
+    {
+        env_release(*env);
+        *env = NULL;
+    }
+}
+
+/* Called by db_init(), reads the hashes already in the database */
+static int environments_load(void)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+    env_first_process = last_process_id + 1;
+    last_environment_id = 0;
+    env_slots_size = 256;
+    env_slots = calloc(env_slots_size, sizeof(*env_slots));
+    ret = sqlite3_prepare_v2(db, "SELECT id, hash FROM environments;", -1,
+                             &stmt, NULL);
+    if(ret != SQLITE_OK)
+        return ret;
+    while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        unsigned int id = sqlite3_column_int(stmt, 0);
+        if(sqlite3_column_bytes(stmt, 1) == 16)
+            env_slot_add(sqlite3_column_blob(stmt, 1), id);
+        if(id > last_environment_id)
+            last_environment_id = id;
+    }
+    sqlite3_finalize(stmt);
+    return (ret == SQLITE_DONE)?SQLITE_OK:ret;
+}
+
+static void environments_free(void)
+{
+    size_t i;
+    for(i = 0; i < env_slots_size; ++i)
+        free(env_slots[i].live);
+    free(env_slots);
+    env_slots = NULL;
+    env_slots_size = env_slots_used = 0;
+    free(process_envs);
+    process_envs = NULL;
+    process_envs_size = 0;
+}
+
+
+/* ********************
+ * Paths
+ *
+ * The same few thousand paths get opened over and over, so file_opens refers
+ * to them by id. The writer thread interns them in a hash map, loaded from
+ * the paths already in the database. The new ones are inserted
+ * PATHS_BATCH_ROWS at a time, along with the other batches.
+ */
+
+#define PATHS_BATCH_ROWS 256
+
+struct PathSlot {
+    uint64_t hash;
+    unsigned int id;        /* 0 if the slot is free */
+    char *name;
+};
+
+/* Open addressing, the size is a power of 2 */
+static struct PathSlot *path_slots = NULL;
+static size_t path_slots_size = 0;
+static size_t path_slots_used = 0;
+static unsigned int last_path_id;
+
+/* Not inserted yet, the ids follow each other up to last_path_id; the names
+ * belong to the map */
+static const char **paths_pending = NULL;
+static size_t paths_pending_count = 0;
+static size_t paths_pending_capacity = 0;
+static sqlite3_stmt *stmt_insert_paths = NULL;
+
+/* FNV-1a */
+static uint64_t path_hash(const char *name, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for(i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Returns the slot with that path, or the free slot where it would go */
+static struct PathSlot *path_slot(const char *name, uint64_t hash)
+{
+    size_t i = hash & (path_slots_size - 1);
+    while(path_slots[i].id != 0
+        && (path_slots[i].hash != hash || strcmp(path_slots[i].name, name)))
+        i = (i + 1) & (path_slots_size - 1);
+    return &path_slots[i];
+}
+
+static const char *path_add(const char *name, size_t len, uint64_t hash,
+                            unsigned int id)
+{
+    struct PathSlot *slot;
+    /* Keep the load factor under 1/2 */
+    if((path_slots_used + 1) * 2 > path_slots_size)
+    {
+        struct PathSlot *old = path_slots;
+        size_t i, old_size = path_slots_size;
+        path_slots_size = old_size * 2;
+        path_slots = calloc(path_slots_size, sizeof(*path_slots));
+        for(i = 0; i < old_size; ++i)
+            if(old[i].id != 0)
+                *path_slot(old[i].name, old[i].hash) = old[i];
+        free(old);
+    }
+    slot = path_slot(name, hash);
+    slot->hash = hash;
+    slot->id = id;
+    slot->name = malloc(len + 1);
+    memcpy(slot->name, name, len + 1);
+    ++path_slots_used;
+    return slot->name;
+}
+
+static unsigned int path_intern(const char *name)
+{
+    size_t len = strlen(name);
+    uint64_t hash = path_hash(name, len);
+    struct PathSlot *slot = path_slot(name, hash);
+    if(slot->id != 0)
+        return slot->id;
+
+    if(paths_pending_count == paths_pending_capacity)
+    {
+        paths_pending_capacity = (paths_pending_capacity == 0)?
+                PATHS_BATCH_ROWS:paths_pending_capacity * 2;
+        paths_pending = realloc(paths_pending, paths_pending_capacity *
+                                               sizeof(*paths_pending));
+    }
+    paths_pending[paths_pending_count++] = path_add(name, len, hash,
+                                                    ++last_path_id);
+    return last_path_id;
+}
+
+/* Called by batches_prepare() */
+static int paths_prepare(void)
+{
+    char *sql = malloc(40 + PATHS_BATCH_ROWS * 6);
+    char *p = sql;
+    size_t i;
+    int ret;
+    p += sprintf(p, "INSERT INTO paths(id, name) VALUES");
+    for(i = 0; i < PATHS_BATCH_ROWS; ++i)
+        p += sprintf(p, "%s(?,?)", (i == 0)?" ":",");
+    ret = sqlite3_prepare_v2(db, sql, -1, &stmt_insert_paths, NULL);
+    free(sql);
+    paths_pending_count = 0;
+    return ret;
+}
+
+static int paths_flush(void)
+{
+    unsigned int id = last_path_id - paths_pending_count + 1;
+    size_t done = 0;
+    while(done < paths_pending_count)
+    {
+        sqlite3_stmt *stmt;
+        size_t rows, i;
+        if(paths_pending_count - done >= PATHS_BATCH_ROWS)
+        {
+            stmt = stmt_insert_paths;
+            rows = PATHS_BATCH_ROWS;
+        }
+        else
+        {
+            stmt = stmt_insert_path;
+            rows = 1;
+        }
+        for(i = 0; i < rows; ++i)
+        {
+            check(sqlite3_bind_int(stmt, i * 2 + 1, id++));
+            check(sqlite3_bind_text(stmt, i * 2 + 2, paths_pending[done + i],
+                                    -1, SQLITE_STATIC));
+        }
+        if(sqlite3_step(stmt) != SQLITE_DONE)
+            goto sqlerror;
+        sqlite3_reset(stmt);
+        done += rows;
+    }
+    paths_pending_count = 0;
+    return 0;
+
+sqlerror:
+    /* LCOV_EXCL_START : Insertions shouldn't fail */
+    log_critical(0, "sqlite3 error inserting paths: %s", sqlite3_errmsg(db));
+    paths_pending_count = 0;
+    return -1;
+    /* LCOV_EXCL_END */
+}
+
+/* Called by db_init(), reads the paths already in the database */
+static int paths_load(void)
+{
+    sqlite3_stmt *stmt;
+    int ret;
+    last_path_id = 0;
+    path_slots_size = 4096;
+    path_slots = calloc(path_slots_size, sizeof(*path_slots));
+    ret = sqlite3_prepare_v2(db, "SELECT id, name FROM paths;", -1,
+                             &stmt, NULL);
+    if(ret != SQLITE_OK)
+        return ret;
+    while((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        unsigned int id = sqlite3_column_int(stmt, 0);
+        const char *name = (const char*)sqlite3_column_text(stmt, 1);
+        size_t len = sqlite3_column_bytes(stmt, 1);
+        path_add(name, len, path_hash(name, len), id);
+        if(id > last_path_id)
+            last_path_id = id;
+    }
+    sqlite3_finalize(stmt);
+    return (ret == SQLITE_DONE)?SQLITE_OK:ret;
+}
+
+static void paths_free(void)
+{
+    size_t i;
+    sqlite3_finalize(stmt_insert_paths);
+    stmt_insert_paths = NULL;
+    free(paths_pending);
+    paths_pending = NULL;
+    paths_pending_count = paths_pending_capacity = 0;
+    for(i = 0; i < path_slots_size; ++i)
+        free(path_slots[i].name);
+    free(path_slots);
+    path_slots = NULL;
+    path_slots_size = path_slots_used = 0;
+}
+
+
+/* ********************
+ * Writer thread
+ *
+ * Only the writer thread uses the connection. db_add_*() pack the event in a
+ * single allocation and push it on a bounded lock-free queue (Vyukov's, with
+ * many producers and this one consumer), and the writer does the inserts in
+ * the order the events were queued. A producer only waits when the queue is
+ * full; process ids are allocated up front (see last_process_id), so even
+ * db_add_process() doesn't wait for the writer.
+ *
+ * Errors are reported late: once an insert failed, the following db_add_*()
+ * calls and db_close() return -1.
+ */
+
+/* Must be a power of 2 */
+#define DB_QUEUE_SIZE 4096
+
+#define DB_EVENT_STOP           0
+#define DB_EVENT_PROCESS        1
+#define DB_EVENT_EXIT           2
+#define DB_EVENT_FILE_OPEN      3
+#define DB_EVENT_NEGATIVE       4
+#define DB_EVENT_EXEC           5
+#define DB_EVENT_CONNECTION     6
+
+#define DB_EVENT_STRINGS 4
+#define DB_NULL_STRING ((unsigned int)-1)
+
+struct DbEvent {
+    int type;
+    unsigned int process;
+    sqlite3_uint64 timestamp;
+    int a, b;
+    unsigned int parent;    /* for DB_EVENT_PROCESS */
+    unsigned int lengths[DB_EVENT_STRINGS];
+    char data[];            /* the strings, each followed by a NUL */
+};
+
+struct QueueCell {
+    unsigned int sequence;
+    struct DbEvent *event;
+};
+
+static struct {
+    struct QueueCell cells[DB_QUEUE_SIZE];
+    unsigned int enqueue_pos;
+    char pad1[64 - sizeof(unsigned int)];
+    unsigned int dequeue_pos;
+    char pad2[64 - sizeof(unsigned int)];
+    int writer_waiting;
+    unsigned int writer_wakeups;    /* futex */
+    unsigned int producers_waiting;
+    unsigned int space_wakeups;     /* futex */
+} queue;
+
+static pthread_t writer_thread;
+static int writer_running = 0;
+
+static int futex(unsigned int *addr, int op, unsigned int val,
+                 const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void queue_init(void)
+{
+    unsigned int i;
+    for(i = 0; i < DB_QUEUE_SIZE; ++i)
+        queue.cells[i].sequence = i;
+    queue.enqueue_pos = 0;
+    queue.dequeue_pos = 0;
+    queue.writer_waiting = 0;
+    queue.writer_wakeups = 0;
+    queue.producers_waiting = 0;
+    queue.space_wakeups = 0;
+}
+
+/* Returns 0 if the queue is full */
+static int queue_push(struct DbEvent *event)
+{
+    struct QueueCell *cell;
+    unsigned int pos = __atomic_load_n(&queue.enqueue_pos, __ATOMIC_RELAXED);
+    for(;;)
+    {
+        int diff;
+        cell = &queue.cells[pos & (DB_QUEUE_SIZE - 1)];
+        diff = (int)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0)
+        {
+            if(__atomic_compare_exchange_n(&queue.enqueue_pos, &pos, pos + 1,
+                                           1, __ATOMIC_RELAXED,
+                                           __ATOMIC_RELAXED))
+                break;
+        }
+        else if(diff < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&queue.enqueue_pos, __ATOMIC_RELAXED);
+    }
+    cell->event = event;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Writer side; returns NULL if the queue is empty */
+static struct DbEvent *queue_pop(void)
+{
+    unsigned int pos = queue.dequeue_pos;
+    struct QueueCell *cell = &queue.cells[pos & (DB_QUEUE_SIZE - 1)];
+    struct DbEvent *event;
+    if(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+        return NULL;
+    event = cell->event;
+    __atomic_store_n(&cell->sequence, pos + DB_QUEUE_SIZE, __ATOMIC_RELEASE);
+    queue.dequeue_pos = pos + 1;
+    return event;
+}
+
+static void queue_send(struct DbEvent *event)
+{
+    for(;;)
+    {
+        unsigned int seen;
+        if(queue_push(event))
+            break;
+        /* Full, wait for the writer to make room */
+        __atomic_fetch_add(&queue.producers_waiting, 1, __ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&queue.space_wakeups, __ATOMIC_SEQ_CST);
+        if(queue_push(event))
+        {
+            __atomic_fetch_sub(&queue.producers_waiting, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        futex(&queue.space_wakeups, FUTEX_WAIT_PRIVATE, seen, NULL);
+        __atomic_fetch_sub(&queue.producers_waiting, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&queue.writer_waiting, __ATOMIC_RELAXED))
+    {
+        __atomic_fetch_add(&queue.writer_wakeups, 1, __ATOMIC_SEQ_CST);
+        futex(&queue.writer_wakeups, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+/* Waits up to timeout ms (forever if -1); returns NULL if nothing came, or on
+ * a spurious wakeup */
+static struct DbEvent *queue_receive(int timeout)
+{
+    struct DbEvent *event = queue_pop();
+    if(event == NULL)
+    {
+        unsigned int seen;
+        struct timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        __atomic_store_n(&queue.writer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        seen = __atomic_load_n(&queue.writer_wakeups, __ATOMIC_SEQ_CST);
+        if((event = queue_pop()) == NULL)
+        {
+            futex(&queue.writer_wakeups, FUTEX_WAIT_PRIVATE, seen,
+                  (timeout < 0)?NULL:&ts);
+            event = queue_pop();
+        }
+        __atomic_store_n(&queue.writer_waiting, 0, __ATOMIC_RELAXED);
+        if(event == NULL)
+            return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&queue.producers_waiting, __ATOMIC_RELAXED))
+    {
+        __atomic_fetch_add(&queue.space_wakeups, 1, __ATOMIC_SEQ_CST);
+        futex(&queue.space_wakeups, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    }
+    return event;
+}
+
+/* strings can contain NULLs; lengths can be NULL if they are all C strings */
+static struct DbEvent *event_new(int type, unsigned int process,
+                                 const char *const *strings,
+                                 const size_t *lengths, size_t nb)
+{
+    struct DbEvent *event;
+    size_t i, total = 0;
+    size_t lens[DB_EVENT_STRINGS];
+    char *p;
+    for(i = 0; i < nb; ++i)
+    {
+        if(strings[i] != NULL)
+        {
+            lens[i] = lengths?lengths[i]:strlen(strings[i]);
+            total += lens[i] + 1;
+        }
+    }
+    event = malloc(sizeof(*event) + total);
+    event->type = type;
+    event->process = process;
+    event->timestamp = gettime();
+    event->a = event->b = 0;
+    event->parent = 0;
+    p = event->data;
+    for(i = 0; i < DB_EVENT_STRINGS; ++i)
+    {
+        if(i >= nb || strings[i] == NULL)
+            event->lengths[i] = DB_NULL_STRING;
+        else
+        {
+            event->lengths[i] = lens[i];
+            memcpy(p, strings[i], lens[i]);
+            p[lens[i]] = '\0';
+            p += lens[i] + 1;
+        }
+    }
+    return event;
+}
+
+static const char *event_string(const struct DbEvent *event, size_t n)
+{
+    const char *p = event->data;
+    size_t i;
+    if(event->lengths[n] == DB_NULL_STRING)
+        return NULL;
+    for(i = 0; i < n; ++i)
+        if(event->lengths[i] != DB_NULL_STRING)
+            p += event->lengths[i] + 1;
+    return p;
+}
+
+/* ********************
+ * Batched inserts
+ *
+ * opened_files and negative_lookups get most of the rows. The writer keeps
+ * those events and inserts them DB_BATCH_ROWS at a time with a multi-row
+ * INSERT, once db_batch_size of them are waiting, or the oldest one has
+ * waited db_batch_time milliseconds, or db_close() is called. The trace is
+ * still a single transaction, rolled back as a whole on error, unless
+ * db_checkpoint is set.
+ */
+
+/* Rows per INSERT; SQLite accepts up to 999 parameters per statement */
+#define DB_BATCH_ROWS 64
+
+unsigned int db_batch_size = DB_BATCH_SIZE;
+unsigned int db_batch_time = DB_BATCH_TIME;
+
+struct Batch {
+    const char *insert;     /* statement up to VALUES */
+    int columns;
+    int (*bind)(sqlite3_stmt *stmt, int first, const struct DbEvent *event);
+    sqlite3_stmt *stmt_single;
+    sqlite3_stmt *stmt_multi;
+    struct DbEvent **events;
+    size_t count;
+    size_t capacity;
+};
+
+/* Binding only fails on misuse, so errors are OR'd together (SQLITE_OK is 0)
+ */
+static int bind_file_open(sqlite3_stmt *stmt, int first,
+                          const struct DbEvent *event)
+{
+    int ret = sqlite3_bind_int(stmt, first + 1, run_id);
+    ret |= sqlite3_bind_int(stmt, first + 2,
+                            path_intern(event_string(event, 0)));
+    ret |= sqlite3_bind_int64(stmt, first + 3, event->timestamp);
+    ret |= sqlite3_bind_int(stmt, first + 4, event->a);
+    ret |= sqlite3_bind_int(stmt, first + 5, event->b);
+    ret |= sqlite3_bind_int(stmt, first + 6, event->process);
+    return ret;
+}
+
+static int bind_negative_lookup(sqlite3_stmt *stmt, int first,
+                                const struct DbEvent *event)
+{
+    /* The events are kept until the statement is done with them */
+    int ret = sqlite3_bind_int(stmt, first + 1, run_id);
+    ret |= sqlite3_bind_text(stmt, first + 2, event_string(event, 0), -1,
+                             SQLITE_STATIC);
+    ret |= sqlite3_bind_int64(stmt, first + 3, event->timestamp);
+    ret |= sqlite3_bind_int(stmt, first + 4, event->a);
+    ret |= sqlite3_bind_int(stmt, first + 5, event->b);
+    ret |= sqlite3_bind_int(stmt, first + 6, event->process);
+    return ret;
+}
+
+static struct Batch batches[] = {
+    {"INSERT INTO file_opens(run_id, path, timestamp, "
+     "        mode, is_directory, process) "
+     "VALUES",
+     6, bind_file_open},
+    {"INSERT INTO negative_lookups(run_id, name, timestamp, mode, "
+     "        error, process) "
+     "VALUES",
+     6, bind_negative_lookup},
+};
+
+#define BATCH_FILES     (&batches[0])
+#define BATCH_NEGATIVE  (&batches[1])
+
+static size_t batch_pending = 0;
+static sqlite3_uint64 batch_oldest;
+
+static char *batch_sql(const struct Batch *batch, unsigned int rows)
+{
+    size_t len = strlen(batch->insert);
+    size_t row_len = 3 + 3 * batch->columns;
+    char *sql = malloc(len + rows * row_len + 1);
+    char *p = sql + len;
+    unsigned int i;
+    int j;
+    memcpy(sql, batch->insert, len);
+    for(i = 0; i < rows; ++i)
+    {
+        *p++ = (i == 0)?' ':',';
+        *p++ = '(';
+        for(j = 0; j < batch->columns; ++j)
+        {
+            if(j > 0)
+                *p++ = ',';
+            *p++ = '?';
+        }
+        *p++ = ')';
+    }
+    *p = '\0';
+    return sql;
+}
+
+static int batches_prepare(void)
+{
+    size_t i;
+    for(i = 0; i < count(batches); ++i)
+    {
+        struct Batch *batch = &batches[i];
+        char *single = batch_sql(batch, 1);
+        char *multi = batch_sql(batch, DB_BATCH_ROWS);
+        int ret = sqlite3_prepare_v2(db, single, -1, &batch->stmt_single,
+                                     NULL);
+        if(ret == SQLITE_OK)
+            ret = sqlite3_prepare_v2(db, multi, -1, &batch->stmt_multi, NULL);
+        free(single);
+        free(multi);
+        if(ret != SQLITE_OK)
+            return ret;
+        batch->count = 0;
+    }
+    batch_pending = 0;
+    return paths_prepare();
+}
+
+static void batch_discard(struct Batch *batch)
+{
+    size_t i;
+    for(i = 0; i < batch->count; ++i)
+        free(batch->events[i]);
+    batch->count = 0;
+}
+
+static void batches_finalize(void)
+{
+    size_t i;
+    for(i = 0; i < count(batches); ++i)
+    {
+        struct Batch *batch = &batches[i];
+        sqlite3_finalize(batch->stmt_single);
+        sqlite3_finalize(batch->stmt_multi);
+        batch->stmt_single = batch->stmt_multi = NULL;
+        batch_discard(batch);
+        free(batch->events);
+        batch->events = NULL;
+        batch->capacity = 0;
+    }
+    batch_pending = 0;
+}
+
+/* Takes ownership of the event */
+static void batch_add(struct Batch *batch, struct DbEvent *event)
+{
+    if(batch->count == batch->capacity)
+    {
+        batch->capacity = (batch->capacity == 0)?256:batch->capacity * 2;
+        batch->events = realloc(batch->events,
+                                batch->capacity * sizeof(*batch->events));
+    }
+    batch->events[batch->count++] = event;
+    if(batch_pending++ == 0)
+        batch_oldest = gettime();
+}
+
+static int batch_flush(struct Batch *batch)
+{
+    size_t done = 0;
+    while(done < batch->count)
+    {
+        sqlite3_stmt *stmt;
+        size_t rows, i;
+        if(batch->count - done >= DB_BATCH_ROWS)
+        {
+            stmt = batch->stmt_multi;
+            rows = DB_BATCH_ROWS;
+        }
+        else
+        {
+            stmt = batch->stmt_single;
+            rows = 1;
+        }
+        for(i = 0; i < rows; ++i)
+            check(batch->bind(stmt, i * batch->columns,
+                              batch->events[done + i]));
+        if(sqlite3_step(stmt) != SQLITE_DONE)
+            goto sqlerror;
+        sqlite3_reset(stmt);
+        done += rows;
+    }
+    batch_discard(batch);
+    return 0;
+
+sqlerror:
+    /* LCOV_EXCL_START : Insertions shouldn't fail */
+    log_critical(0, "sqlite3 error inserting rows: %s", sqlite3_errmsg(db));
+    batch_discard(batch);
+    return -1;
+    /* LCOV_EXCL_END */
+}
+
+static int batches_flush(void)
+{
+    size_t i;
+    int ret = 0;
+    for(i = 0; i < count(batches); ++i)
+        if(batch_flush(&batches[i]) != 0)
+            ret = -1;
+    /* After the file_opens rows, which intern them */
+    if(paths_flush() != 0)
+        ret = -1;
+    batch_pending = 0;
+    return ret;
+}
+
+/* Returns 1 if the event was kept for later, 0 if it is done */
+static int event_write(struct DbEvent *event)
+{
+    switch(event->type)
+    {
+    case DB_EVENT_PROCESS:
+        if(write_process(event->process, event->parent, event->a,
+                         event->timestamp) != 0)
+            return -1;
+        environment_inherit(event->process, event->parent);
+        {
+            /* Its working directory */
+            const char *wd = event_string(event, 0);
+            struct DbEvent *wd_event = event_new(DB_EVENT_FILE_OPEN,
+                                                 event->process, &wd, NULL, 1);
+            wd_event->timestamp = event->timestamp;
+            wd_event->a = FILE_WDIR;
+            wd_event->b = 1;
+            batch_add(BATCH_FILES, wd_event);
+        }
+        return 0;
+    case DB_EVENT_EXIT:
+        environment_exit(event->process);
+        return write_exit(event->process, event->a, event->b,
+                          event->timestamp);
+    case DB_EVENT_FILE_OPEN:
+        batch_add(BATCH_FILES, event);
+        return 1;
+    case DB_EVENT_NEGATIVE:
+        batch_add(BATCH_NEGATIVE, event);
+        return 1;
+    case DB_EVENT_EXEC:
+        {
+            unsigned int environment;
+            if(environment_store(event->process, event_string(event, 2),
+                                 event->lengths[2], &environment) != 0)
+                return -1;
+            return write_exec(event->process, event_string(event, 0),
+                              event_string(event, 1), event->lengths[1],
+                              environment,
+                              event_string(event, 3), event->timestamp);
+        }
+    case DB_EVENT_CONNECTION:
+        return write_connection(event->process, event->a,
+                                event_string(event, 0),
+                                event_string(event, 1),
+                                event_string(event, 2),
+                                event->timestamp);
+    default:
+        /* LCOV_EXCL_START : internal error */
+        log_critical(0, "unknown database event %d", event->type);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+}
+
+static int log_append(const struct DbEvent *event);
+static int log_flush(void);
+
+/* Writes out what the writer is holding on to */
+static int writer_flush(void)
+{
+    if(db_binary_log)
+        return log_flush();
+    return batches_flush();
+}
+
+/* Writes out the batches and commits, see db_checkpoint */
+static int checkpoint_commit(void)
+{
+    if(batches_flush() != 0)
+        return -1;
+    checkpoint_pending = 0;
+    if(sqlite3_exec(db, "COMMIT; BEGIN IMMEDIATE;", NULL, NULL, NULL)
+     != SQLITE_OK)
+    {
+        /* LCOV_EXCL_START : Disk full or I/O error */
+        log_critical(0, "sqlite3 error committing: %s", sqlite3_errmsg(db));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
+}
+
+static void writer_error(void)
+{
+    size_t i;
+    /* Once an insert failed, the run gets rolled back anyway */
+    __atomic_store_n(&writer_failed, 1, __ATOMIC_RELAXED);
+    for(i = 0; i < count(batches); ++i)
+        batch_discard(&batches[i]);
+    batch_pending = 0;
+    checkpoint_pending = 0;
+}
+
+static void *writer_main(void *arg)
+{
+    for(;;)
+    {
+        struct DbEvent *event;
+        int stop, ret = 0;
+        int timeout = -1;
+
+        if(checkpoint_pending > 0)
+        {
+            sqlite3_uint64 waited = (gettime() - checkpoint_oldest) / 1000000;
+            if(checkpoint_pending >= db_checkpoint_events
+             || waited >= db_checkpoint_time)
+            {
+                if(checkpoint_commit() != 0)
+                    writer_error();
+                continue;
+            }
+            timeout = db_checkpoint_time - waited;
+        }
+
+        if(batch_pending > 0)
+        {
+            sqlite3_uint64 waited = (gettime() - batch_oldest) / 1000000;
+            if(batch_pending >= db_batch_size || waited >= db_batch_time)
+            {
+                if(writer_flush() != 0)
+                    writer_error();
+                continue;
+            }
+            if(timeout < 0 || db_batch_time - waited < (unsigned int)timeout)
+                timeout = db_batch_time - waited;
+        }
+
+        event = queue_receive(timeout);
+        if(event == NULL)
+            continue;
+        stop = event->type == DB_EVENT_STOP;
+        if(stop)
+            ret = writer_flush();
+        else if(!__atomic_load_n(&writer_failed, __ATOMIC_RELAXED))
+        {
+            ret = db_binary_log?log_append(event):event_write(event);
+            if(checkpointing && ret >= 0 && checkpoint_pending++ == 0)
+                checkpoint_oldest = gettime();
+        }
+        if(ret < 0)
+            writer_error();
+        /* Batched events are freed once inserted */
+        if(ret != 1)
+            free(event);
+        if(stop)
+            return NULL;
+    }
+}
+
+static int writer_start(void)
+{
+    queue_init();
+    writer_failed = 0;
+    if((errno = pthread_create(&writer_thread, NULL, writer_main, NULL)) != 0)
+    {
+        /* LCOV_EXCL_START : Only fails on resource exhaustion */
+        log_critical(0, "couldn't start database thread: %s",
+                     strerror(errno));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    writer_running = 1;
+    return 0;
+}
+
+/* Writes everything that was queued and stops the writer */
+static void writer_stop(void)
+{
+    if(!writer_running)
+        return;
+    queue_send(event_new(DB_EVENT_STOP, 0, NULL, NULL, 0));
+    pthread_join(writer_thread, NULL);
+    writer_running = 0;
+}
+
+static int db_send(struct DbEvent *event)
+{
+    if(__atomic_load_n(&writer_failed, __ATOMIC_RELAXED))
+    {
+        free(event);
+        return -1;
+    }
+    queue_send(event);
+    return 0;
+}
+
+int db_add_process(unsigned int *id, unsigned int parent_id,
+                   const char *working_dir, int is_thread)
+{
+    struct DbEvent *event;
+    *id = __atomic_add_fetch(&last_process_id, 1, __ATOMIC_RELAXED);
+    event = event_new(DB_EVENT_PROCESS, *id, &working_dir, NULL, 1);
+    event->parent = parent_id;
+    event->a = is_thread;
+    return db_send(event);
+}
+
+int db_add_first_process(unsigned int *id, const char *working_dir)
+{
+    return db_add_process(id, DB_NO_PARENT, working_dir, 0);
+}
+
+int db_add_exit(unsigned int id, int exitcode, int cpu_time)
+{
+    struct DbEvent *event = event_new(DB_EVENT_EXIT, id, NULL, NULL, 0);
+    event->a = exitcode;
+    event->b = cpu_time;
+    return db_send(event);
+}
+
+int db_add_file_open(unsigned int process, const char *name,
+                     unsigned int mode, int is_dir,
+                     unsigned long long timestamp)
+{
+    struct DbEvent *event = event_new(DB_EVENT_FILE_OPEN, process,
+                                      &name, NULL, 1);
+    event->timestamp = timestamp;
+    event->a = mode;
+    event->b = is_dir;
+    return db_send(event);
+}
+
+int db_add_negative_lookup(unsigned int process, const char *name,
+                           unsigned int mode, int error,
+                           unsigned long long timestamp)
+{
+    struct DbEvent *event = event_new(DB_EVENT_NEGATIVE, process,
+                                      &name, NULL, 1);
+    event->timestamp = timestamp;
+    event->a = mode;
+    event->b = error;
+    return db_send(event);
+}
+
+int db_add_exec(unsigned int process, const char *binary,
+                const char *const *argv, const char *const *envp,
+                const char *workingdir)
+{
+    struct DbEvent *event;
+    const char *strings[4];
+    size_t lengths[4];
+    char *arglist = strarray2nulsep(argv, &lengths[1]);
+    char *envlist = strarray2nulsep(envp, &lengths[2]);
+    strings[0] = binary;
+    lengths[0] = strlen(binary);
+    strings[1] = arglist;
+    strings[2] = envlist;
+    strings[3] = workingdir;
+    lengths[3] = strlen(workingdir);
+    event = event_new(DB_EVENT_EXEC, process, strings, lengths, 4);
+    free(arglist);
+    free(envlist);
+    return db_send(event);
+}
+
+int db_add_connection(unsigned int process, int inbound, const char *family,
+                      const char *protocol, const char *address,
+                      unsigned long long timestamp)
+{
+    struct DbEvent *event;
+    const char *strings[3];
+    strings[0] = family;
+    strings[1] = protocol;
+    strings[2] = address;
+    event = event_new(DB_EVENT_CONNECTION, process, strings, NULL, 3);
+    event->timestamp = timestamp;
+    event->a = inbound;
+    return db_send(event);
+}
+
+
+/* ********************
+ * Binary trace log
+ *
+ * With db_binary_log set, db_init() opens a log file instead of a database,
+ * and the writer thread appends the events to it as they are: each record is
+ * the size of the event followed by the struct DbEvent and its strings, in
+ * the host's layout. The file is only ever appended to. A run starts with a
+ * LogHeader and ends with a DB_EVENT_STOP record, which db_close() only
+ * writes if the trace is kept; a run that was rolled back or didn't finish is
+ * skipped when loading.
+ *
+ * db_convert_log() loads the complete runs of a log into a database, through
+ * the writer thread and the batched inserts, and creates the indexes last.
+ */
+
+#define LOG_MAGIC "RPZLOG\0"        /* 8 bytes with the terminating NUL */
+#define LOG_VERSION 1
+#define LOG_BUFFER_SIZE (1024 * 1024)
+
+struct LogHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int event_size;        /* offsetof(struct DbEvent, data) */
+};
+
+int db_binary_log = 0;
+
+static int log_fd = -1;
+static char *log_buffer;
+static size_t log_used;
+
+static size_t event_size(const struct DbEvent *event)
+{
+    size_t i, size = offsetof(struct DbEvent, data);
+    for(i = 0; i < DB_EVENT_STRINGS; ++i)
+        if(event->lengths[i] != DB_NULL_STRING)
+            size += event->lengths[i] + 1;
+    return size;
+}
+
+static int log_write(const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t ret = write(log_fd, data, len);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            /* LCOV_EXCL_START : Disk full or I/O error */
+            log_critical(0, "couldn't write trace log: %s", strerror(errno));
+            return -1;
+            /* LCOV_EXCL_END */
+        }
+        data += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int log_flush(void)
+{
+    int ret = log_write(log_buffer, log_used);
+    log_used = 0;
+    batch_pending = 0;
+    return ret;
+}
+
+/* The event is copied, the caller still frees it */
+static int log_append(const struct DbEvent *event)
+{
+    unsigned int size = event_size(event);
+    size_t record = sizeof(size) + size;
+    if(log_used + record > LOG_BUFFER_SIZE && log_flush() != 0)
+        return -1;
+    if(record > LOG_BUFFER_SIZE)
+    {
+        /* Huge environment, doesn't go through the buffer */
+        if(log_write((const char*)&size, sizeof(size)) != 0
+         || log_write((const char*)event, size) != 0)
+            return -1;
+        return 0;
+    }
+    memcpy(log_buffer + log_used, &size, sizeof(size));
+    memcpy(log_buffer + log_used + sizeof(size), event, size);
+    log_used += record;
+    /* Written out by the writer like the batches */
+    if(batch_pending++ == 0)
+        batch_oldest = gettime();
+    return 0;
+}
+
+static int log_open(const char *filename)
+{
+    struct LogHeader header;
+
+    log_fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(log_fd < 0)
+    {
+        log_critical(0, "couldn't open trace log %s: %s", filename,
+                     strerror(errno));
+        return -1;
+    }
+    log_debug(0, "trace log opened: %s", filename);
+
+    log_buffer = malloc(LOG_BUFFER_SIZE);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.version = LOG_VERSION;
+    header.event_size = offsetof(struct DbEvent, data);
+    memcpy(log_buffer, &header, sizeof(header));
+    log_used = sizeof(header);
+    batch_pending = 0;
+
+    /* Process ids are shifted when the run is loaded, see log_load_run() */
+    last_process_id = 0;
+
+    if(writer_start() != 0)
+    {
+        /* LCOV_EXCL_START : Only fails on resource exhaustion */
+        free(log_buffer);
+        log_buffer = NULL;
+        close(log_fd);
+        log_fd = -1;
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    return 0;
+}
+
+static int log_close(int rollback)
+{
+    int ret = 0;
+
+    /* Everything that was queued gets written first */
+    writer_stop();
+    if(!rollback && writer_failed)
+    {
+        log_critical(0, "couldn't write the trace log, discarding this run");
+        rollback = 1;
+        ret = -1;
+    }
+
+    /* The run is only loaded if it has its end marker */
+    if(!rollback)
+    {
+        struct DbEvent *end = event_new(DB_EVENT_STOP, 0, NULL, NULL, 0);
+        if(log_append(end) != 0 || log_flush() != 0)
+            ret = -1;
+        free(end);
+    }
+    if(close(log_fd) != 0 && ret == 0)
+    {
+        /* LCOV_EXCL_START : Delayed write error */
+        log_critical(0, "couldn't write trace log: %s", strerror(errno));
+        ret = -1;
+        /* LCOV_EXCL_END */
+    }
+    log_fd = -1;
+    free(log_buffer);
+    log_buffer = NULL;
+    log_debug(0, "trace log closed%s", rollback?" (run discarded)":"");
+    return ret;
+}
+
+/* Checks the run starting at pos. Returns the offset where it ends (the next
+ * run or the end of the file), or 0 if the log is corrupted; *complete is set
+ * if the run has its end marker */
+static size_t log_scan_run(const char *log, size_t size, size_t pos,
+                           int *complete)
+{
+    struct LogHeader header;
+    *complete = 0;
+    if(size - pos < sizeof(header))
+        return 0;
+    memcpy(&header, log + pos, sizeof(header));
+    if(memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0
+     || header.version != LOG_VERSION
+     || header.event_size != offsetof(struct DbEvent, data))
+        return 0;
+    pos += sizeof(header);
+    while(pos < size)
+    {
+        unsigned int len;
+        struct DbEvent event;
+        const char *data;
+        size_t strings = 0, i;
+
+        /* A run that didn't finish, followed by another one */
+        if(size - pos >= sizeof(header.magic)
+         && memcmp(log + pos, LOG_MAGIC, sizeof(header.magic)) == 0)
+            return pos;
+        /* Cut short by a crash */
+        if(size - pos < sizeof(len))
+            return size;
+        memcpy(&len, log + pos, sizeof(len));
+        if(len > size - pos - sizeof(len))
+            return size;
+
+        if(len < header.event_size)
+            return 0;
+        memcpy(&event, log + pos + sizeof(len), header.event_size);
+        if(event.type < DB_EVENT_STOP || event.type > DB_EVENT_CONNECTION)
+            return 0;
+        data = log + pos + sizeof(len) + header.event_size;
+        for(i = 0; i < DB_EVENT_STRINGS; ++i)
+        {
+            if(event.lengths[i] == DB_NULL_STRING)
+                continue;
+            if(event.lengths[i] >= len - header.event_size - strings
+             || data[strings + event.lengths[i]] != '\0')
+                return 0;
+            strings += event.lengths[i] + 1;
+        }
+        if(header.event_size + strings != len)
+            return 0;
+
+        pos += sizeof(len) + len;
+        if(event.type == DB_EVENT_STOP)
+        {
+            *complete = 1;
+            return pos;
+        }
+    }
+    return pos;
+}
+
+/* Loads a complete run, that log_scan_run() checked, as a new run_id */
+static int log_load_run(const char *log, size_t pos, size_t end,
+                        const char *database_path)
+{
+    unsigned int first_id;
+
+    if(db_init(database_path) != 0)
+        return -1;
+    /* Ids in the log start at 1, the ones in the database go on from there */
+    first_id = last_process_id;
+
+    pos += sizeof(struct LogHeader);
+    while(pos < end)
+    {
+        unsigned int len;
+        struct DbEvent *event;
+        memcpy(&len, log + pos, sizeof(len));
+        pos += sizeof(len);
+        /* At least a whole struct DbEvent */
+        event = malloc(sizeof(*event) + len);
+        memcpy(event, log + pos, len);
+        pos += len;
+        if(event->type == DB_EVENT_STOP)
+        {
+            free(event);
+            break;
+        }
+        event->process += first_id;
+        if(event->type == DB_EVENT_PROCESS && event->parent != DB_NO_PARENT)
+            event->parent += first_id;
+        if(db_send(event) != 0)
+            break;
+    }
+
+    /* Rolls back if an insert failed */
+    return db_close(0);
+}
+
+int db_convert_log(const char *log_path, const char *database_path)
+{
+    int fd;
+    struct stat st;
+    const char *log;
+    size_t size, pos = 0;
+    unsigned int runs = 0;
+    int binary_log = db_binary_log;
+    int ret = 0;
+
+    fd = open(log_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        log_critical(0, "couldn't open trace log %s: %s", log_path,
+                     strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    size = st.st_size;
+    if(size == 0)
+    {
+        close(fd);
+        log_critical(0, "trace log %s is empty", log_path);
+        return -1;
+    }
+    log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(log == MAP_FAILED)
+    {
+        /* LCOV_EXCL_START : Only fails on resource exhaustion */
+        log_critical(0, "couldn't map trace log %s: %s", log_path,
+                     strerror(errno));
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+    madvise((void*)log, size, MADV_SEQUENTIAL);
+
+    db_binary_log = 0;
+    while(pos < size)
+    {
+        int complete;
+        size_t end = log_scan_run(log, size, pos, &complete);
+        if(end == 0)
+        {
+            log_critical(0, "trace log %s is corrupted", log_path);
+            ret = -1;
+            break;
+        }
+        if(!complete)
+            log_warn(0, "skipping an incomplete run in trace log %s",
+                     log_path);
+        else if(log_load_run(log, pos, end, database_path) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        else
+            ++runs;
+        pos = end;
+    }
+    db_binary_log = binary_log;
+    munmap((void*)log, size);
+
+    if(ret == 0 && runs == 0)
+    {
+        log_critical(0, "no complete run in trace log %s", log_path);
+        ret = -1;
+    }
+    if(ret == 0)
+        log_debug(0, "loaded %u run%s from trace log %s", runs,
+                  (runs == 1)?"":"s", log_path);
+    return ret;
+}
@@ -7,19 +7,63 @@
 #define FILE_STAT   0x08  /* File is stat()d (only metadata is read) */
 #define FILE_LINK   0x10  /* The link itself is accessed, no dereference */
 
+/* Rows of opened_files and negative_lookups are inserted in batches, once
+ * db_batch_size of them are waiting or after db_batch_time milliseconds */
+#define DB_BATCH_SIZE   1024
+#define DB_BATCH_TIME   1000
+extern unsigned int db_batch_size;
+extern unsigned int db_batch_time;
+
+/* If set, db_init() and db_close() write the events to an append-only binary
+ * log instead of a database; db_convert_log() loads it into one afterwards.
+ * It is written out in batches the same way */
+extern int db_binary_log;
+
+/* If set, the run is recorded in a database in memory, written to the file
+ * by db_close(); past db_memory_budget MiB, SQLite spills it to a temporary
+ * file (0 means no limit) */
+#define DB_MEMORY_BUDGET 256
+extern int db_in_memory;
+extern unsigned int db_memory_budget;
+
+/* Indexes are built by db_close(). When appending a run, those of tables with
+ * fewer than db_reindex_rows rows are dropped by db_init() to be rebuilt,
+ * the others are kept up to date during the run */
+#define DB_REINDEX_ROWS 100000
+extern unsigned int db_reindex_rows;
+
+/* If set, the run is committed every db_checkpoint_events events or
+ * db_checkpoint_time milliseconds, in WAL mode, instead of in one transaction.
+ * The runs table records whether it completed; runs that didn't are marked
+ * 'crashed' by the next db_init(), or deleted if db_drop_crashed is set */
+#define DB_CHECKPOINT_EVENTS 100000
+#define DB_CHECKPOINT_TIME   10000
+extern int db_checkpoint;
+extern unsigned int db_checkpoint_events;
+extern unsigned int db_checkpoint_time;
+extern int db_drop_crashed;
+
+/* Events can be recorded after the fact, with the time they happened */
+unsigned long long db_timestamp(void);
+
 int db_init(const char *filename);
 int db_close(int rollback);
+int db_convert_log(const char *log_path, const char *database_path);
 int db_add_process(unsigned int *id, unsigned int parent_id,
                    const char *working_dir, int is_thread);
 int db_add_exit(unsigned int id, int exitcode, int cpu_time);
 int db_add_first_process(unsigned int *id, const char *working_dir);
 int db_add_file_open(unsigned int process,
                      const char *name, unsigned int mode,
-                     int is_dir);
+                     int is_dir, unsigned long long timestamp);
 int db_add_exec(unsigned int process, const char *binary,
                 const char *const *argv, const char *const *envp,
                 const char *workingdir);
 int db_add_connection(unsigned int process, int inbound, const char *family,
-                      const char *protocol, const char *address);
+                      const char *protocol, const char *address,
+                      unsigned long long timestamp);
+int db_add_negative_lookup(unsigned int process, const char *name,
+                           unsigned int mode, int error,
+                           unsigned long long timestamp);
 
 #endif
@@ -41,15 +41,17 @@ void log_real_(pid_t tid, const char *tag, int lvl, const char *format, ...)
 {
     va_list args;
     char datestr[13]; /* HH:MM:SS.mmm */
-    static char *buffer = NULL;
-    static size_t bufsize = 4096;
+    /* Workers and the database writer log concurrently */
+    static __thread char *buffer = NULL;
+    static __thread size_t bufsize = 4096;
     int length;
     if(buffer == NULL)
         buffer = malloc(bufsize);
     {
         struct timeval tv;
+        struct tm tm;
         gettimeofday(&tv, NULL);
-        strftime(datestr, 13, "%H:%M:%S", localtime(&tv.tv_sec));
+        strftime(datestr, 13, "%H:%M:%S", localtime_r(&tv.tv_sec, &tm));
         sprintf(datestr+8, ".%03u", (unsigned int)(tv.tv_usec / 1000));
     }
     va_start(args, format);
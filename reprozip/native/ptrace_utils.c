@@ -1,56 +1,53 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* process_vm_readv() */
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ptrace.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "log.h"
 #include "ptrace_utils.h"
+#include "rpc.h"
+#include "strscan.h"
 #include "tracer.h"
 
 
-static long tracee_getword(pid_t tid, const void *addr)
+#define verbosity trace_verbosity
+
+
+/* ********************
+ * Requests to the tracer thread
+ *
+ * Only the thread that attached a tracee can use ptrace() on it, so workers
+ * send their requests to the tracer thread over their channel, see rpc.c.
+ */
+
+__thread struct RpcChannel *tracee_channel = NULL;
+
+long tracee_ptrace(int request, pid_t tid, void *addr, void *data)
 {
+    struct RpcMessage msg;
+    msg.request = request;
+    msg.tid = tid;
+    msg.addr = addr;
+    msg.data = data;
+    rpc_call(tracee_channel, &msg);
+    errno = msg.error;
+    return msg.result;
+}
 
-    //printf("twritefd = [%d]\n", twritefd);
-    static int count = 0;
-    count += 1;
-    //printf("\t\tcount = [%d]\n", count);
-    //long res;
-    errno = 0;
-    //printf("Inside tracee_getwork. TID is [%d]\n", tid);
-
-    int request = PTRACE_PEEKDATA;
-    void *data = NULL;
-
-    write(twritefd, &request, sizeof(request));
-    write(twritefd, &tid, sizeof(tid));
-    //printf("I am worker, I just sent tid [%d]\n", tid);
-    write(twritefd, &addr, sizeof(addr));
-    //printf("I am worker. I just sent addr [%p]\n", addr);
-    write(twritefd, &data, sizeof(data));
-    //printf("I am worker. I just sent data [%p]\n", data);
-
-    long res;
-    read(treadfd, &res, sizeof(res));
-
-    //printf("I am worker. I just got ptrace result [%ld]\n", res);
-
-    //res = ptrace(PTRACE_PEEKDATA, tid, addr, NULL);
-    //printf("\t after ptrace, res = %d\n", res);
-    //if(errno)
-    //{
-        /* LCOV_EXCL_START : We only do that on things that went through the
-         * kernel successfully, and so should be valid. The exception is
-         * execve(), which will dup arguments when entering the syscall */
-    //    log_error(tid, "tracee_getword() failed: %s", strerror(errno));
-    //    return 0;
-        /* LCOV_EXCL_END */
-    //}
-    return res;
+static long tracee_getword(pid_t tid, const void *addr)
+{
+    return tracee_ptrace(PTRACE_PEEKDATA, tid, (void*)addr, NULL);
 }
 
 void *tracee_getptr(int mode, pid_t tid, const void *addr)
@@ -99,7 +96,139 @@ size_t tracee_getwordsize(int mode)
         return 8;
 }
 
-size_t tracee_strlen(pid_t tid, const char *str)
+/* ********************
+ * Bulk reads
+ *
+ * Workers are not the tracer, so they can't PTRACE_PEEKDATA themselves; going
+ * through tracee_getword() costs a round-trip to the tracer thread per word.
+ * Instead we read directly from the tracee's address space with
+ * process_vm_readv(), falling back on /proc/<tid>/mem if that is unavailable
+ * (ENOSYS before Linux 3.2). Both only require the same permissions as
+ * ptrace(), which we usually have; a tracee that is not dumpable (e.g.
+ * running a setuid program) can still refuse them, in which case it is read
+ * with PTRACE_PEEKDATA until it is resumed.
+ */
+
+#define TRACEE_READ_VM      0   /* process_vm_readv() */
+#define TRACEE_READ_PROCMEM 1   /* pread() on /proc/<tid>/mem */
+
+/* Only changed when the syscall is missing, which holds for every tracee */
+static int read_method = TRACEE_READ_VM;
+
+/* The tracee whose memory this worker was denied, until it resumes it */
+static __thread pid_t denied_tid = 0;
+
+/* Each worker keeps the last /proc/<tid>/mem it opened */
+static __thread int procmem_fd = -1;
+static __thread pid_t procmem_tid = 0;
+
+size_t tracee_pagesize(void)
+{
+    static size_t pagesize = 0;
+    if(pagesize == 0)
+    {
+        long ret = sysconf(_SC_PAGESIZE);
+        pagesize = (ret > 0)?(size_t)ret:4096;
+    }
+    return pagesize;
+}
+
+static ssize_t tracee_procmem_pread(pid_t tid, void *dst, const void *src,
+                                    size_t size)
+{
+    if(procmem_fd == -1 || procmem_tid != tid)
+    {
+        char path[32];
+        if(procmem_fd != -1)
+            close(procmem_fd);
+        snprintf(path, sizeof(path), "/proc/%d/mem", tid);
+        procmem_fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(procmem_fd == -1)
+            return -1;
+        procmem_tid = tid;
+    }
+    return pread(procmem_fd, dst, size, (off_t)(uintptr_t)src);
+}
+
+/**
+ * Reads memory from the tracee without involving the tracer thread.
+ *
+ * Returns the number of bytes read, which can be less than size if the range
+ * crosses into unmapped memory, or 0 if direct reads are not possible.
+ */
+size_t tracee_readmem(pid_t tid, void *dst, const void *src, size_t size)
+{
+    int method = __atomic_load_n(&read_method, __ATOMIC_RELAXED);
+    size_t done = 0;
+    if(tid == denied_tid)
+        return 0;
+    while(done < size)
+    {
+        ssize_t ret;
+        if(method == TRACEE_READ_VM)
+        {
+            struct iovec local, remote;
+            local.iov_base = (char*)dst + done;
+            local.iov_len = size - done;
+            remote.iov_base = (char*)src + done;
+            remote.iov_len = size - done;
+            ret = process_vm_readv(tid, &local, 1, &remote, 1, 0);
+            if(ret == -1 && errno == ENOSYS)
+            {
+                if(verbosity >= 2)
+                    log_info(tid, "process_vm_readv() unavailable, using "
+                             "/proc/<pid>/mem");
+                __atomic_store_n(&read_method, TRACEE_READ_PROCMEM,
+                                 __ATOMIC_RELAXED);
+                method = TRACEE_READ_PROCMEM;
+                continue;
+            }
+            else if(ret == -1 && errno == EPERM)
+            {
+                /* Just this tracee, try /proc for this read */
+                method = TRACEE_READ_PROCMEM;
+                continue;
+            }
+        }
+        else
+        {
+            ret = tracee_procmem_pread(tid, (char*)dst + done,
+                                       (const char*)src + done, size - done);
+            if(ret == -1 && (errno == EACCES || errno == EPERM))
+            {
+                /* LCOV_EXCL_START : Non-dumpable tracees */
+                if(verbosity >= 2)
+                    log_info(tid, "can't read memory directly (%s), using "
+                             "PTRACE_PEEKDATA", strerror(errno));
+                denied_tid = tid;
+                break;
+                /* LCOV_EXCL_END */
+            }
+        }
+        if(ret <= 0)
+            break;
+        done += ret;
+    }
+    return done;
+}
+
+static void tracee_read_words(pid_t tid, char *dst, const char *src,
+                              size_t size)
+{
+    uintptr_t ptr = (uintptr_t)src;
+    size_t j = ptr % WORD_SIZE;
+    uintptr_t i = ptr - j;
+    uintptr_t end = ptr + size;
+    for(; i < end; i += WORD_SIZE)
+    {
+        unsigned long data = tracee_getword(tid, (const void*)i);
+        for(; j < WORD_SIZE && i + j < end; ++j)
+            *dst++ = data >> (8 * j);
+        j = 0;
+    }
+}
+
+static size_t tracee_strlen_words(pid_t tid, const char *str)
 {
     uintptr_t ptr = (uintptr_t)str;
     size_t j = ptr % WORD_SIZE;
@@ -122,73 +251,392 @@ size_t tracee_strlen(pid_t tid, const char *str)
     return size;
 }
 
+
+/* ********************
+ * Per-stop page cache
+ *
+ * Handlers often read the same memory several times: pointer arrays are read
+ * one element at a time, *at() variants and rename() read neighboring
+ * arguments, etc. The pages fetched are kept until the worker resumes the
+ * tracee, at which point tracee_cache_invalidate() must be called.
+ *
+ * This gives a consistent snapshot of each page for the duration of a stop,
+ * not a frozen address space: other threads of a multithreaded tracee keep
+ * running and can write to it meanwhile. What we record can differ from what
+ * the kernel reads, as with any ptrace-based tracer (time-of-check to
+ * time-of-use).
+ */
+
+#define TRACEE_CACHE_PAGES 16
+
+static __thread char *cache_data = NULL;
+static __thread pid_t cache_tid[TRACEE_CACHE_PAGES];
+static __thread uintptr_t cache_page[TRACEE_CACHE_PAGES];
+static __thread size_t cache_size = 0;  /* number of valid entries */
+static __thread size_t cache_next = 0;  /* next entry to evict, when full */
+
+void tracee_cache_invalidate(void)
+{
+    cache_size = 0;
+    cache_next = 0;
+    /* Might have changed with an execve() */
+    denied_tid = 0;
+}
+
+/**
+ * Gets a whole page of the tracee's memory, from the cache if possible.
+ *
+ * Returns NULL if the page can't be read directly; callers should then fall
+ * back on PTRACE_PEEKDATA.
+ */
+static const char *tracee_cache_get(pid_t tid, uintptr_t page)
+{
+    const size_t pagesize = tracee_pagesize();
+    size_t i;
+    char *data;
+    for(i = 0; i < cache_size; ++i)
+    {
+        if(cache_page[i] == page && cache_tid[i] == tid)
+            return cache_data + i * pagesize;
+    }
+
+    if(tid == denied_tid)
+        return NULL;
+    if(cache_data == NULL)
+        cache_data = malloc(TRACEE_CACHE_PAGES * pagesize);
+
+    if(cache_size < TRACEE_CACHE_PAGES)
+        i = cache_size++;
+    else
+    {
+        i = cache_next;
+        cache_next = (cache_next + 1) % TRACEE_CACHE_PAGES;
+    }
+    data = cache_data + i * pagesize;
+    if(tracee_readmem(tid, data, (const void*)page, pagesize) != pagesize)
+    {
+        /* Don't keep a bogus entry around */
+        cache_tid[i] = 0;
+        cache_page[i] = 0;
+        return NULL;
+    }
+    cache_tid[i] = tid;
+    cache_page[i] = page;
+    return data;
+}
+
+/**
+ * Fetches the given pages that are not cached yet with a single vectored
+ * read.
+ *
+ * At most TRACEE_CACHE_PAGES pages can be requested. Pages that can't be
+ * read are simply not cached, and tracee_cache_get() will try again.
+ */
+static void tracee_cache_prefetch(pid_t tid, const uintptr_t *pages,
+                                  size_t nb_pages)
+{
+    const size_t pagesize = tracee_pagesize();
+    struct iovec local[TRACEE_CACHE_PAGES], remote[TRACEE_CACHE_PAGES];
+    size_t slots[TRACEE_CACHE_PAGES];
+    size_t i, nb = 0;
+    ssize_t ret;
+
+    if(__atomic_load_n(&read_method, __ATOMIC_RELAXED) != TRACEE_READ_VM
+     || tid == denied_tid)
+        return;
+    if(cache_data == NULL)
+        cache_data = malloc(TRACEE_CACHE_PAGES * pagesize);
+
+    for(i = 0; i < nb_pages; ++i)
+    {
+        size_t j;
+        int cached = 0;
+        for(j = 0; j < cache_size; ++j)
+        {
+            if(cache_page[j] == pages[i] && cache_tid[j] == tid)
+            {
+                cached = 1;
+                break;
+            }
+        }
+        if(cached)
+            continue;
+
+        /* Pick a slot, without evicting one we are filling right now */
+        if(cache_size < TRACEE_CACHE_PAGES)
+            j = cache_size++;
+        else
+        {
+            j = cache_next;
+            cache_next = (cache_next + 1) % TRACEE_CACHE_PAGES;
+        }
+        cache_tid[j] = 0;
+        cache_page[j] = 0;
+        slots[nb] = j;
+        local[nb].iov_base = cache_data + j * pagesize;
+        local[nb].iov_len = pagesize;
+        remote[nb].iov_base = (void*)pages[i];
+        remote[nb].iov_len = pagesize;
+        ++nb;
+    }
+    if(nb == 0)
+        return;
+
+    ret = process_vm_readv(tid, local, nb, remote, nb, 0);
+    if(ret <= 0)
+        return;
+    /* The read stops at the first page that fails */
+    for(i = 0; i < (size_t)ret / pagesize; ++i)
+    {
+        cache_tid[slots[i]] = tid;
+        cache_page[slots[i]] = (uintptr_t)remote[i].iov_base;
+    }
+}
+
 void tracee_read(pid_t tid, char *dst, const char *src, size_t size)
 {
+    const size_t pagesize = tracee_pagesize();
     uintptr_t ptr = (uintptr_t)src;
-    size_t j = ptr % WORD_SIZE;
-    uintptr_t i = ptr - j;
-    uintptr_t end = ptr + size;
-    for(; i < end; i += WORD_SIZE)
+    while(size > 0)
     {
-        unsigned long data = tracee_getword(tid, (const void*)i);
-        for(; j < WORD_SIZE && i + j < end; ++j)
-            *dst++ = data >> (8 * j);
-        j = 0;
+        size_t offset = ptr % pagesize;
+        size_t len = pagesize - offset;
+        const char *data = tracee_cache_get(tid, ptr - offset);
+        if(len > size)
+            len = size;
+        if(data != NULL)
+            memcpy(dst, data + offset, len);
+        else
+            /* PTRACE_PEEKDATA can still read what we couldn't, for instance
+             * pages that are not readable by the tracee itself */
+            tracee_read_words(tid, dst, (const char*)ptr, len);
+        dst += len;
+        ptr += len;
+        size -= len;
+    }
+}
+
+size_t tracee_strlen(pid_t tid, const char *str)
+{
+    const size_t pagesize = tracee_pagesize();
+    uintptr_t ptr = (uintptr_t)str;
+    size_t size = 0;
+    for(;;)
+    {
+        size_t offset = ptr % pagesize;
+        const char *data = tracee_cache_get(tid, ptr - offset);
+        size_t len;
+        if(data == NULL)
+        {
+            if(tid == denied_tid)
+                return size + tracee_strlen_words(tid, (const char*)ptr);
+            /* LCOV_EXCL_START : Strings we read went through the kernel */
+            log_error(tid, "couldn't read string at %p", (void*)ptr);
+            return size;
+            /* LCOV_EXCL_END */
+        }
+        len = strscan_nul(data + offset, pagesize - offset);
+        if(len < pagesize - offset)
+            return size + len;
+        size += len;
+        ptr += len;
     }
 }
 
+/**
+ * Appends the string at str to a growable buffer, including its NUL.
+ *
+ * The string is scanned and copied in a single pass over each fetched page.
+ * Returns its length.
+ */
+static size_t tracee_strappend(pid_t tid, const char *str,
+                               char **buffer, size_t *length,
+                               size_t *capacity)
+{
+    const size_t pagesize = tracee_pagesize();
+    uintptr_t ptr = (uintptr_t)str;
+    size_t size = 0;
+    int found = 0;
+    while(!found)
+    {
+        size_t offset = ptr % pagesize;
+        size_t avail = pagesize - offset;
+        const char *data = tracee_cache_get(tid, ptr - offset);
+        size_t len;
+        if(data == NULL && tid == denied_tid)
+            avail = tracee_strlen_words(tid, (const char*)ptr) + 1;
+        if(*length + size + avail > *capacity)
+        {
+            while(*length + size + avail > *capacity)
+                *capacity *= 2;
+            *buffer = realloc(*buffer, *capacity);
+        }
+        if(data != NULL)
+            len = strscan_copy(*buffer + *length + size, data + offset,
+                               avail, &found);
+        else if(tid == denied_tid)
+        {
+            len = avail - 1;
+            tracee_read_words(tid, *buffer + *length + size,
+                              (const char*)ptr, len);
+            (*buffer)[*length + size + len] = '\0';
+            found = 1;
+        }
+        else
+        {
+            /* LCOV_EXCL_START : Strings we read went through the kernel */
+            log_error(tid, "couldn't read string at %p", (void*)ptr);
+            len = 0;
+            (*buffer)[*length + size] = '\0';
+            found = 1;
+            /* LCOV_EXCL_END */
+        }
+        size += len;
+        ptr += len;
+    }
+    *length += size + 1;
+    return size;
+}
+
+/* Scratch space for tracee_strdup(), so it can allocate the exact size */
+static __thread char *strdup_buffer = NULL;
+static __thread size_t strdup_capacity = 0;
+
 char *tracee_strdup(pid_t tid, const char *str)
 {
-    size_t length = tracee_strlen(tid, str);
-    char *res = malloc(length + 1);
-    tracee_read(tid, res, str, length);
-    res[length] = '\0';
+    size_t length = 0;
+    char *res;
+    if(strdup_buffer == NULL)
+    {
+        strdup_capacity = tracee_pagesize();
+        strdup_buffer = malloc(strdup_capacity);
+    }
+    tracee_strappend(tid, str, &strdup_buffer, &length, &strdup_capacity);
+    res = malloc(length);
+    memcpy(res, strdup_buffer, length);
     return res;
 }
 
+/* Pointers read per chunk when walking a pointer array */
+#define STRARRAY_CHUNK 64
+
 char **tracee_strarraydup(int mode, pid_t tid, const char *const *argv)
 {
     /* FIXME : This is probably broken on x32 */
+    const size_t pagesize = tracee_pagesize();
+    const size_t wordsize = tracee_getwordsize(mode);
+    uintptr_t *ptrs;
+    size_t nb_args = 0, capacity = STRARRAY_CHUNK;
+    size_t *offsets;
+    char *strings;
+    size_t strings_len = 0, strings_capacity = pagesize;
     char **array;
-    /* Reads number of pointers in pointer array */
-    size_t nb_args = 0;
+
+    /* Reads the pointer array in one pass, a chunk at a time. Chunks don't
+     * extend past the current page, since the array might end right before
+     * unmapped memory. */
+    ptrs = malloc(capacity * sizeof(*ptrs));
     {
-        const char *const *a = argv;
-        /* xargv = *a */
-        const char *xargv = tracee_getptr(mode, tid, a);
-        while(xargv != NULL)
+        uintptr_t pos = (uintptr_t)argv;
+        int done = 0;
+        while(!done)
         {
-            ++nb_args;
-            ++a;
-            xargv = tracee_getptr(mode, tid, a);
+            unsigned char chunk[STRARRAY_CHUNK * 8];
+            size_t nb = (pagesize - pos % pagesize) / wordsize;
+            size_t i;
+            if(nb == 0)
+                nb = 1; /* Misaligned pointer across pages */
+            else if(nb > STRARRAY_CHUNK)
+                nb = STRARRAY_CHUNK;
+            tracee_read(tid, (char*)chunk, (const char*)pos, nb * wordsize);
+            for(i = 0; i < nb; ++i)
+            {
+                uintptr_t ptr;
+                if(mode == MODE_I386)
+                {
+                    uint32_t ptr32;
+                    memcpy(&ptr32, chunk + i * 4, 4);
+                    ptr = ptr32;
+                }
+                else /* mode == MODE_X86_64 */
+                {
+                    uint64_t ptr64;
+                    memcpy(&ptr64, chunk + i * 8, 8);
+                    ptr = (uintptr_t)ptr64;
+                }
+                if(ptr == 0)
+                {
+                    done = 1;
+                    break;
+                }
+                if(nb_args == capacity)
+                {
+                    capacity *= 2;
+                    ptrs = realloc(ptrs, capacity * sizeof(*ptrs));
+                }
+                ptrs[nb_args++] = ptr;
+            }
+            pos += nb * wordsize;
         }
     }
-    /* Allocs pointer array */
-    array = malloc((nb_args + 1) * sizeof(char*));
-    /* Dups array elements */
+
+    /* Gathers the strings, fetching all the pages they start on with as few
+     * vectored reads as the cache allows. They are packed one after the other
+     * in a single buffer. */
+    offsets = malloc((nb_args + 1) * sizeof(*offsets));
+    strings = malloc(strings_capacity);
     {
-        size_t i = 0;
-        /* xargv = argv[0] */
-        const char *xargv = tracee_getptr(mode, tid, argv);
-        while(xargv != NULL)
+        size_t first = 0;
+        while(first < nb_args)
         {
-            array[i] = tracee_strdup(tid, xargv);
-            ++i;
-            /* xargv = argv[i] */
-            xargv = tracee_getptr(mode, tid, argv + i);
+            uintptr_t pages[TRACEE_CACHE_PAGES];
+            size_t nb_pages = 0;
+            size_t last, i;
+            /* Forms a batch of strings whose first pages fit in the cache */
+            for(last = first; last < nb_args; ++last)
+            {
+                uintptr_t page = ptrs[last] - ptrs[last] % pagesize;
+                size_t j;
+                for(j = 0; j < nb_pages; ++j)
+                    if(pages[j] == page)
+                        break;
+                if(j == nb_pages)
+                {
+                    if(nb_pages == TRACEE_CACHE_PAGES)
+                        break;
+                    pages[nb_pages++] = page;
+                }
+            }
+            tracee_cache_prefetch(tid, pages, nb_pages);
+            for(i = first; i < last; ++i)
+            {
+                offsets[i] = strings_len;
+                tracee_strappend(tid, (const char*)ptrs[i],
+                                 &strings, &strings_len, &strings_capacity);
+            }
+            first = last;
         }
-        array[i] = NULL;
     }
+    free(ptrs);
+
+    /* Allocs pointer array and strings as a single block */
+    array = malloc((nb_args + 1) * sizeof(char*) + strings_len);
+    {
+        char *dest = (char*)(array + nb_args + 1);
+        size_t i;
+        memcpy(dest, strings, strings_len);
+        for(i = 0; i < nb_args; ++i)
+            array[i] = dest + offsets[i];
+        array[nb_args] = NULL;
+    }
+    free(offsets);
+    free(strings);
     return array;
 }
 
 void free_strarray(char **array)
 {
-    char **ptr = array;
-    while(*ptr)
-    {
-        free(*ptr);
-        ++ptr;
-    }
+    /* Strings are allocated in the same block as the array, see
+     * tracee_strarraydup() */
     free(array);
 }
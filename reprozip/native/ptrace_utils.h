@@ -1,20 +1,26 @@
 #ifndef PTRACE_UTILS_H
 #define PTRACE_UTILS_H
 
-extern __thread int treadfd;
-extern __thread int twritefd;
-
+struct RpcChannel;
 
+extern __thread struct RpcChannel *tracee_channel;
 
+long tracee_ptrace(int request, pid_t tid, void *addr, void *data);
 
 void *tracee_getptr(int mode, pid_t tid, const void *addr);
 uint64_t tracee_getlong(int mode, pid_t tid, const void *addr);
 size_t tracee_getwordsize(int mode);
 
+size_t tracee_pagesize(void);
+
+size_t tracee_readmem(pid_t tid, void *dst, const void *src, size_t size);
+
 size_t tracee_strlen(pid_t tid, const char *str);
 
 void tracee_read(pid_t tid, char *dst, const char *src, size_t size);
 
+void tracee_cache_invalidate(void);
+
 char *tracee_strdup(pid_t tid, const char *str);
 
 char **tracee_strarraydup(int mode, pid_t tid, const char *const *argv);
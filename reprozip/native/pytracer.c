@@ -57,22 +57,53 @@ static char *get_string(PyObject *obj)
 }
 
 
-static PyObject *pytracer_execute(PyObject *self, PyObject *args)
+static PyObject *pytracer_execute(PyObject *self, PyObject *args,
+                                  PyObject *kwargs)
 {
     PyObject *ret;
     int exit_status;
 
     /* Reads arguments */
+    static char *kwlist[] = {"binary", "argv", "databasepath", "verbosity",
+                             "negative_lookups", "workers", "shards",
+                             "batch_size", "batch_time", "binary_log",
+                             "in_memory", "memory_budget", "checkpoint",
+                             "checkpoint_events", "checkpoint_time",
+                             "drop_crashed", NULL};
     const char *binary, *databasepath;
     char **argv;
     size_t argv_len;
     int verbosity;
+    int negative_lookups = 0;
+    int workers = 0;
+    int shards = 0;
+    int batch_size = DB_BATCH_SIZE;
+    int batch_time = DB_BATCH_TIME;
+    int binary_log = 0;
+    int in_memory = 0;
+    int memory_budget = DB_MEMORY_BUDGET;
+    int checkpoint = 0;
+    int checkpoint_events = DB_CHECKPOINT_EVENTS;
+    int checkpoint_time = DB_CHECKPOINT_TIME;
+    int drop_crashed = 0;
     PyObject *py_binary, *py_argv, *py_databasepath;
-    if(!PyArg_ParseTuple(args, "OO!Oi",
-                         &py_binary,
-                         &PyList_Type, &py_argv,
-                         &py_databasepath,
-                         &verbosity))
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO!Oi|iiiiiiiiiiii", kwlist,
+                                    &py_binary,
+                                    &PyList_Type, &py_argv,
+                                    &py_databasepath,
+                                    &verbosity,
+                                    &negative_lookups,
+                                    &workers,
+                                    &shards,
+                                    &batch_size,
+                                    &batch_time,
+                                    &binary_log,
+                                    &in_memory,
+                                    &memory_budget,
+                                    &checkpoint,
+                                    &checkpoint_events,
+                                    &checkpoint_time,
+                                    &drop_crashed))
         return NULL;
 
     if(verbosity < 0)
@@ -81,6 +112,51 @@ static PyObject *pytracer_execute(PyObject *self, PyObject *args)
         return NULL;
     }
     trace_verbosity = verbosity;
+    trace_negative_lookups = negative_lookups?1:0;
+
+    if(workers < 0)
+    {
+        PyErr_SetString(Err_Base, "workers should be >= 0");
+        return NULL;
+    }
+    trace_workers = workers;
+
+    if(shards < 0)
+    {
+        PyErr_SetString(Err_Base, "shards should be >= 0");
+        return NULL;
+    }
+    trace_shards = shards;
+
+    if(batch_size < 1 || batch_time < 0)
+    {
+        PyErr_SetString(Err_Base,
+                        "batch_size should be >= 1 and batch_time >= 0");
+        return NULL;
+    }
+    db_batch_size = batch_size;
+    db_batch_time = batch_time;
+    db_binary_log = binary_log?1:0;
+
+    if(memory_budget < 0)
+    {
+        PyErr_SetString(Err_Base, "memory_budget should be >= 0");
+        return NULL;
+    }
+    db_in_memory = in_memory?1:0;
+    db_memory_budget = memory_budget;
+
+    if(checkpoint_events < 1 || checkpoint_time < 0)
+    {
+        PyErr_SetString(Err_Base,
+                        "checkpoint_events should be >= 1 and "
+                        "checkpoint_time >= 0");
+        return NULL;
+    }
+    db_checkpoint = checkpoint?1:0;
+    db_checkpoint_events = checkpoint_events;
+    db_checkpoint_time = checkpoint_time;
+    db_drop_crashed = drop_crashed?1:0;
 
     binary = get_string(py_binary);
     if(binary == NULL)
@@ -136,12 +212,75 @@ static PyObject *pytracer_execute(PyObject *self, PyObject *args)
 }
 
 
+static PyObject *pytracer_convert_log(PyObject *self, PyObject *args)
+{
+    PyObject *py_logpath, *py_databasepath;
+    char *logpath, *databasepath;
+    int ret;
+
+    if(!PyArg_ParseTuple(args, "OO", &py_logpath, &py_databasepath))
+        return NULL;
+    logpath = get_string(py_logpath);
+    if(logpath == NULL)
+        return NULL;
+    databasepath = get_string(py_databasepath);
+    if(databasepath == NULL)
+    {
+        free(logpath);
+        return NULL;
+    }
+
+    ret = db_convert_log(logpath, databasepath);
+    free(logpath);
+    free(databasepath);
+
+    if(ret != 0)
+    {
+        PyErr_SetString(Err_Base, "Error occurred");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
 static PyMethodDef methods[] = {
-    {"execute", pytracer_execute, METH_VARARGS,
-     "execute(binary, argv, databasepath, verbosity)\n"
+    {"execute", (PyCFunction)pytracer_execute, METH_VARARGS | METH_KEYWORDS,
+     "execute(binary, argv, databasepath, verbosity, negative_lookups=False,\n"
+     "        workers=0, shards=0, batch_size=1024, batch_time=1000,\n"
+     "        binary_log=False, in_memory=False, memory_budget=256,\n"
+     "        checkpoint=False, checkpoint_events=100000, "
+     "checkpoint_time=10000,\n"
+     "        drop_crashed=False)\n"
      "\n"
      "Runs the specified binary with the argument list argv under trace and "
-     "writes\nthe captured events to SQLite3 database databasepath."},
+     "writes\nthe captured events to SQLite3 database databasepath.\n"
+     "\n"
+     "If negative_lookups is set, failed open() and stat() calls are "
+     "recorded in\nthe negative_lookups table. workers is the number of threads "
+     "handling the\nsyscalls, 0 for one per CPU. With shards > 1, that many "
+     "tracer threads split\nthe processes (and the workers) between them.\n"
+     "\n"
+     "Opened files are written batch_size rows at a time, or after waiting "
+     "for\nbatch_time milliseconds; batch_size=1 writes each one right "
+     "away.\n"
+     "\n"
+     "With binary_log, databasepath is an append-only binary log instead, "
+     "to be\nloaded with convert_log() after the run.\n"
+     "\n"
+     "With in_memory, the run is recorded in memory and written to the "
+     "database at\nthe end; past memory_budget MiB (0 for no limit), it "
+     "spills to a temporary\nfile.\n"
+     "\n"
+     "With checkpoint, the run is committed every checkpoint_events events "
+     "or\ncheckpoint_time milliseconds, so a crash only loses the last "
+     "ones. Runs that\ndidn't complete are marked as crashed in the runs "
+     "table when the next one\nstarts, or deleted if drop_crashed is "
+     "set."},
+    {"convert_log", pytracer_convert_log, METH_VARARGS,
+     "convert_log(logpath, databasepath)\n"
+     "\n"
+     "Loads the runs recorded in the binary log logpath into the SQLite3 "
+     "database\ndatabasepath, each as a new run_id."},
     { NULL, NULL, 0, NULL }
 };
 
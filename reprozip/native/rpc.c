@@ -0,0 +1,219 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* syscall() */
+#endif
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "rpc.h"
+
+
+/* ********************
+ * Request/reply channels between the workers and the tracer thread
+ *
+ * Each channel is a pair of lock-free single-producer single-consumer rings;
+ * a round-trip costs no syscall as long as the other side is awake. Only a
+ * side that is actually going to sleep gets woken up: the tracer sleeps in
+ * poll() on an eventfd shared by all the channels (so it can also wait on
+ * other things), workers sleep on a futex on the reply ring.
+ *
+ * The sleeping side sets its flag and then checks the ring again, the
+ * producer pushes and then checks the flag; the full barriers in between
+ * guarantee that at least one of them sees the other. The server doesn't look
+ * at every request ring for that: clients count their requests in
+ * server->pending, so checking for work is O(1) whatever the number of
+ * channels, and the server doesn't need a list of them.
+ */
+
+/* How long a worker spins waiting for the tracer before sleeping; there is no
+ * point on a single CPU, the tracer can't run while we spin */
+#define RPC_SPIN 200
+
+static unsigned int rpc_spin = RPC_SPIN;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while(0)
+#endif
+
+static int futex(unsigned int *addr, int op, unsigned int val)
+{
+    return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* The eventfd is non-blocking. EAGAIN on write means the counter is already
+ * set, so a wakeup is pending anyway; on read, that it was already cleared.
+ * Other errors only happen once the fd is closed, and the server's poll()
+ * reports that */
+static void eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+    while(write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        continue;
+}
+
+static void eventfd_clear(int fd)
+{
+    uint64_t count;
+    while(read(fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        continue;
+}
+
+static int ring_push(struct RpcRing *ring, const struct RpcMessage *msg)
+{
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if(tail - head == RPC_RING_SIZE)
+        return 0;
+    ring->slots[tail & (RPC_RING_SIZE - 1)] = *msg;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int ring_pop(struct RpcRing *ring, struct RpcMessage *msg)
+{
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(head == tail)
+        return 0;
+    *msg = ring->slots[head & (RPC_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void ring_init(struct RpcRing *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    ring->waiting = 0;
+}
+
+int rpc_server_init(struct RpcServer *server)
+{
+    server->eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    server->sleeping = 0;
+    server->pending = 0;
+    if(sysconf(_SC_NPROCESSORS_ONLN) <= 1)
+        rpc_spin = 0;
+    return (server->eventfd == -1)?-1:0;
+}
+
+void rpc_server_close(struct RpcServer *server)
+{
+    close(server->eventfd);
+    server->eventfd = -1;
+}
+
+void rpc_channel_init(struct RpcChannel *channel, struct RpcServer *server)
+{
+    ring_init(&channel->requests);
+    ring_init(&channel->replies);
+    channel->server = server;
+}
+
+void rpc_call(struct RpcChannel *channel, struct RpcMessage *msg)
+{
+    struct RpcServer *server = channel->server;
+    struct RpcRing *replies = &channel->replies;
+    unsigned int spins;
+
+    /* Only one request is in flight per channel, this can't be full */
+    ring_push(&channel->requests, msg);
+    /* Counted after the push, so the server finds the request if it sees the
+     * count; it might pop it first and have the count wrap around briefly */
+    __atomic_fetch_add(&server->pending, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&server->sleeping, __ATOMIC_RELAXED))
+        eventfd_signal(server->eventfd);
+
+    for(spins = 0; spins < rpc_spin; ++spins)
+    {
+        if(ring_pop(replies, msg))
+            return;
+        cpu_relax();
+    }
+
+    for(;;)
+    {
+        unsigned int tail;
+        __atomic_store_n(&replies->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&replies->tail, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&replies->head, __ATOMIC_RELAXED) == tail)
+            /* Returns right away if tail changed since we read it */
+            futex(&replies->tail, FUTEX_WAIT_PRIVATE, tail);
+        __atomic_store_n(&replies->waiting, 0, __ATOMIC_RELAXED);
+        if(ring_pop(replies, msg))
+            return;
+    }
+}
+
+int rpc_receive(struct RpcChannel *channel, struct RpcMessage *msg)
+{
+    if(!ring_pop(&channel->requests, msg))
+        return 0;
+    __atomic_fetch_sub(&channel->server->pending, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+int rpc_server_pending(struct RpcServer *server)
+{
+    return __atomic_load_n(&server->pending, __ATOMIC_ACQUIRE) != 0;
+}
+
+void rpc_reply(struct RpcChannel *channel, const struct RpcMessage *msg)
+{
+    struct RpcRing *replies = &channel->replies;
+    ring_push(replies, msg);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&replies->waiting, __ATOMIC_RELAXED))
+        futex(&replies->tail, FUTEX_WAKE_PRIVATE, 1);
+}
+
+void rpc_server_wakeup(struct RpcServer *server)
+{
+    /* Unconditional: the counter stays set until the next wait */
+    eventfd_signal(server->eventfd);
+}
+
+int rpc_server_prepare_wait(struct RpcServer *server)
+{
+    __atomic_store_n(&server->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(rpc_server_pending(server))
+    {
+        __atomic_store_n(&server->sleeping, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+void rpc_server_end_wait(struct RpcServer *server)
+{
+    /* Clear the wakeups, the channels are checked by the caller */
+    eventfd_clear(server->eventfd);
+    __atomic_store_n(&server->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+int rpc_server_wait(struct RpcServer *server, int timeout)
+{
+    struct pollfd pfd;
+    int ret;
+
+    if(!rpc_server_prepare_wait(server))
+        return 0;
+    pfd.fd = server->eventfd;
+    pfd.events = POLLIN;
+    ret = poll(&pfd, 1, timeout);
+    rpc_server_end_wait(server);
+    if(ret == -1 && errno != EINTR)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <sys/types.h>
+
+
+/* Must be a power of 2 */
+#define RPC_RING_SIZE 4
+
+struct RpcMessage {
+    int request;
+    pid_t tid;
+    void *addr;
+    void *data;
+    long result;
+    int error;
+};
+
+/* Single-producer single-consumer ring; head and tail are free-running
+ * counters, on separate cache lines since they are written by different
+ * threads */
+struct RpcRing {
+    unsigned int head;
+    char pad1[64 - sizeof(unsigned int)];
+    unsigned int tail;
+    int waiting;            /* consumer is (about to be) asleep on tail */
+    char pad2[64 - sizeof(unsigned int) - sizeof(int)];
+    struct RpcMessage slots[RPC_RING_SIZE];
+};
+
+struct RpcServer {
+    int eventfd;
+    int sleeping;
+    unsigned int pending;   /* requests sent and not yet received */
+};
+
+struct RpcChannel {
+    struct RpcRing requests;    /* client -> server */
+    struct RpcRing replies;     /* server -> client */
+    struct RpcServer *server;
+};
+
+int rpc_server_init(struct RpcServer *server);
+void rpc_server_close(struct RpcServer *server);
+void rpc_channel_init(struct RpcChannel *channel, struct RpcServer *server);
+
+/**
+ * Sends a request and waits for the reply (client side).
+ *
+ * msg->result and msg->error are filled from the reply.
+ */
+void rpc_call(struct RpcChannel *channel, struct RpcMessage *msg);
+
+/**
+ * Takes the next request from a channel, if any (server side).
+ */
+int rpc_receive(struct RpcChannel *channel, struct RpcMessage *msg);
+
+/**
+ * Whether any channel of the server has a request waiting (server side).
+ */
+int rpc_server_pending(struct RpcServer *server);
+
+/**
+ * Answers the request last received from a channel (server side).
+ */
+void rpc_reply(struct RpcChannel *channel, const struct RpcMessage *msg);
+
+/**
+ * Waits up to timeout ms for a request on any of the channels (server side).
+ *
+ * Returns immediately if one is already pending.
+ */
+int rpc_server_wait(struct RpcServer *server, int timeout);
+
+/**
+ * Starts waiting on server->eventfd (server side), to sleep on it along with
+ * other file descriptors.
+ *
+ * Returns 0 if a request is already pending, in which case the caller
+ * shouldn't sleep (nor call rpc_server_end_wait()).
+ */
+int rpc_server_prepare_wait(struct RpcServer *server);
+
+/**
+ * Done waiting on server->eventfd, after rpc_server_prepare_wait() returned 1.
+ */
+void rpc_server_end_wait(struct RpcServer *server);
+
+/**
+ * Makes the current or next wait on the server return (any thread).
+ */
+void rpc_server_wakeup(struct RpcServer *server);
+
+#endif
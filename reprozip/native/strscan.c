@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "strscan.h"
+
+#ifdef STRSCAN_HAVE_X86
+#include <immintrin.h>
+#endif
+
+
+/* ********************
+ * Portable version, one word at a time
+ */
+
+#define ONES ((uintptr_t)-1 / 0xFF)
+#define HIGHS (ONES * 0x80)
+/* Non-zero if a byte of x is 0 */
+#define HAS_NUL(x) (((x) - ONES) & ~(x) & HIGHS)
+
+size_t strscan_nul_scalar(const char *src, size_t size)
+{
+    size_t i = 0;
+    for(; i + sizeof(uintptr_t) <= size; i += sizeof(uintptr_t))
+    {
+        uintptr_t word;
+        memcpy(&word, src + i, sizeof(word));
+        if(HAS_NUL(word))
+            break;
+    }
+    for(; i < size; ++i)
+        if(src[i] == '\0')
+            return i;
+    return size;
+}
+
+size_t strscan_copy_scalar(char *dst, const char *src, size_t size,
+                           int *found)
+{
+    size_t i = 0;
+    for(; i + sizeof(uintptr_t) <= size; i += sizeof(uintptr_t))
+    {
+        uintptr_t word;
+        memcpy(&word, src + i, sizeof(word));
+        if(HAS_NUL(word))
+            break;
+        memcpy(dst + i, &word, sizeof(word));
+    }
+    for(; i < size; ++i)
+    {
+        dst[i] = src[i];
+        if(src[i] == '\0')
+        {
+            *found = 1;
+            return i;
+        }
+    }
+    *found = 0;
+    return size;
+}
+
+
+/* ********************
+ * SSE2 and AVX2 versions
+ *
+ * Only full vectors inside [src, src + size) are loaded, the tail goes
+ * through the scalar version. Vectors are stored to dst as they are scanned,
+ * so the string is only read once; the one containing the NUL is stored
+ * whole, which can write past the NUL but never past dst + size.
+ */
+
+#ifdef STRSCAN_HAVE_X86
+
+__attribute__((target("sse2")))
+size_t strscan_nul_sse2(const char *src, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + strscan_nul_scalar(src + i, size - i);
+}
+
+__attribute__((target("sse2")))
+size_t strscan_copy_sse2(char *dst, const char *src, size_t size, int *found)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+        if(mask != 0)
+        {
+            *found = 1;
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + strscan_copy_scalar(dst + i, src + i, size - i, found);
+}
+
+__attribute__((target("avx2")))
+size_t strscan_nul_avx2(const char *src, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        if(mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + strscan_nul_sse2(src + i, size - i);
+}
+
+__attribute__((target("avx2")))
+size_t strscan_copy_avx2(char *dst, const char *src, size_t size, int *found)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 32 <= size; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+        if(mask != 0)
+        {
+            *found = 1;
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + strscan_copy_sse2(dst + i, src + i, size - i, found);
+}
+
+#endif
+
+
+/* ********************
+ * Dispatch
+ */
+
+static size_t (*impl_nul)(const char*, size_t) = NULL;
+static size_t (*impl_copy)(char*, const char*, size_t, int*) = NULL;
+
+static void strscan_select(void)
+{
+#ifdef STRSCAN_HAVE_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        impl_copy = strscan_copy_avx2;
+        impl_nul = strscan_nul_avx2;
+        return;
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        impl_copy = strscan_copy_sse2;
+        impl_nul = strscan_nul_sse2;
+        return;
+    }
+#endif
+    impl_copy = strscan_copy_scalar;
+    impl_nul = strscan_nul_scalar;
+}
+
+size_t strscan_nul(const char *src, size_t size)
+{
+    if(impl_nul == NULL)
+        strscan_select();
+    return impl_nul(src, size);
+}
+
+size_t strscan_copy(char *dst, const char *src, size_t size, int *found)
+{
+    if(impl_copy == NULL)
+        strscan_select();
+    return impl_copy(dst, src, size, found);
+}
@@ -0,0 +1,38 @@
+#ifndef STRSCAN_H
+#define STRSCAN_H
+
+#include <stddef.h>
+
+
+/**
+ * Finds the terminating NUL in the first size bytes of src.
+ *
+ * Returns its offset, or size if there is none.
+ */
+size_t strscan_nul(const char *src, size_t size);
+
+/**
+ * Copies a string from src to dst, reading at most size bytes.
+ *
+ * The copy stops after the terminating NUL, which is copied as well. *found is
+ * set if it was seen. Returns the length of the string copied, excluding the
+ * NUL; dst must have room for size bytes, and bytes following the NUL might
+ * be overwritten.
+ */
+size_t strscan_copy(char *dst, const char *src, size_t size, int *found);
+
+
+/* The individual kernels, exposed for benchmarking; the functions above pick
+ * the best one for the current CPU */
+size_t strscan_nul_scalar(const char *src, size_t size);
+size_t strscan_copy_scalar(char *dst, const char *src, size_t size,
+                           int *found);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STRSCAN_HAVE_X86
+size_t strscan_nul_sse2(const char *src, size_t size);
+size_t strscan_copy_sse2(char *dst, const char *src, size_t size, int *found);
+size_t strscan_nul_avx2(const char *src, size_t size);
+size_t strscan_copy_avx2(char *dst, const char *src, size_t size, int *found);
+#endif
+
+#endif
@@ -4,17 +4,21 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sched.h>
+#include <stddef.h>
+#include <sys/prctl.h>
 #include <sys/ptrace.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
-#include <sys/resource.h>
+#include <sys/utsname.h>
 #include <unistd.h>
-#include <pthread.h>
 #include <errno.h>
 
 #include "config.h"
@@ -73,18 +77,132 @@ static char *abs_path_arg(const struct Process *process, size_t arg)
 }
 
 
+/* ********************
+ * Deferred records
+ *
+ * A tracee is stopped for as long as its syscall is being handled, but only
+ * reading its memory needs that. Handlers copy out what they need and queue
+ * a record; syscall_handle() resumes the tracee and only then runs
+ * records_flush(), which does the lstat() and the database insertion.
+ *
+ * Records hold no pointer to the Process, which might be gone (or handled by
+ * another worker) by the time they are written, and they carry the time of
+ * the call so the order of events in the database doesn't change.
+ */
+
+#define RECORD_FILE_OPEN    1
+#define RECORD_NEGATIVE     2
+#define RECORD_CONNECTION   3
+
+/* is_dir value: lstat() the path when writing the record */
+#define RECORD_STAT         -1
+
+struct Record {
+    int type;
+    unsigned int process;
+    unsigned long long timestamp;
+    char *name;             /* path, or address for connections */
+    char *family;
+    const char *stat_path;  /* what RECORD_STAT looks at, if not name */
+    unsigned int mode;      /* mode, or inbound for connections */
+    int value;              /* is_dir, or error for negative lookups */
+};
+
+static __thread struct Record *records = NULL;
+static __thread size_t records_count = 0;
+static __thread size_t records_size = 0;
+
+static struct Record *record_new(const struct Process *process, int type)
+{
+    struct Record *record;
+    if(records_count == records_size)
+    {
+        records_size = (records_size == 0)?8:records_size * 2;
+        records = realloc(records, records_size * sizeof(*records));
+    }
+    record = &records[records_count++];
+    record->type = type;
+    record->process = process->identifier;
+    record->timestamp = db_timestamp();
+    record->name = NULL;
+    record->family = NULL;
+    record->stat_path = NULL;
+    return record;
+}
+
+/* Takes ownership of pathname */
+static struct Record *record_file_open(const struct Process *process,
+                                       char *pathname, unsigned int mode,
+                                       int is_dir)
+{
+    struct Record *record = record_new(process, RECORD_FILE_OPEN);
+    record->name = pathname;
+    record->mode = mode;
+    record->value = is_dir;
+    return record;
+}
+
+/* Takes ownership of pathname */
+static void record_negative(const struct Process *process, char *pathname,
+                            unsigned int mode)
+{
+    struct Record *record = record_new(process, RECORD_NEGATIVE);
+    record->name = pathname;
+    record->mode = mode;
+    record->value = (int)-process->retvalue.i;
+}
+
+static int records_flush(void)
+{
+    size_t i;
+    int ret = 0;
+    for(i = 0; i < records_count && ret == 0; ++i)
+    {
+        struct Record *record = &records[i];
+        if(record->type == RECORD_FILE_OPEN)
+        {
+            int is_dir = record->value;
+            if(is_dir == RECORD_STAT)
+                is_dir = path_is_dir(record->stat_path?record->stat_path:
+                                     record->name);
+            ret = db_add_file_open(record->process, record->name,
+                                   record->mode, is_dir, record->timestamp);
+        }
+        else if(record->type == RECORD_NEGATIVE)
+            ret = db_add_negative_lookup(record->process, record->name,
+                                         record->mode, record->value,
+                                         record->timestamp);
+        else /* record->type == RECORD_CONNECTION */
+            ret = db_add_connection(record->process, record->mode,
+                                    record->family, NULL, record->name,
+                                    record->timestamp);
+    }
+    /* stat_path points into another record, free them all at the end */
+    for(i = 0; i < records_count; ++i)
+    {
+        free(records[i].name);
+        free(records[i].family);
+    }
+    records_count = 0;
+    return (ret == 0)?0:-1;
+}
+
+
 static void record_connection(struct Process *process, int inbound,
                               void *address, socklen_t addrlen)
 {
     char buffer[512];
     const short family = ((struct sockaddr*)address)->sa_family;
+    struct Record *record = record_new(process, RECORD_CONNECTION);
+    record->mode = inbound;
     if(family == AF_INET && addrlen >= sizeof(struct sockaddr_in))
     {
         struct sockaddr_in *address_ = address;
         snprintf(buffer, 512, "%s:%d",
                 inet_ntoa(address_->sin_addr),
                 ntohs(address_->sin_port));
-        db_add_connection(process->identifier, inbound, "INET", NULL, buffer);
+        record->family = strdup("INET");
+        record->name = strdup(buffer);
     }
     else if(family == AF_INET6
           && addrlen >= sizeof(struct sockaddr_in6))
@@ -93,14 +211,14 @@ static void record_connection(struct Process *process, int inbound,
         char buf[50];
         inet_ntop(AF_INET6, &address_->sin6_addr, buf, sizeof(buf));
         snprintf(buffer, 512, "[%s]:%d", buf, ntohs(address_->sin6_port));
-        db_add_connection(process->identifier, inbound, "INET6", NULL, buffer);
+        record->family = strdup("INET6");
+        record->name = strdup(buffer);
     }
     else
     {
         char family_str[32];
         snprintf(family_str, 32, "unknown sa_family=%d", family);
-        db_add_connection(process->identifier, inbound, family_str, NULL,
-                          NULL);
+        record->family = strdup(family_str);
         snprintf(buffer, 512, "<unknown destination, sa_family=%d>", family);
     }
     log_info(process->tid, "process %s %s",
@@ -109,6 +227,25 @@ static void record_connection(struct Process *process, int inbound,
 }
 
 
+/* ********************
+ * Failed lookups
+ *
+ * Failed calls are very common (PATH searches, Python imports, ld.so probing
+ * library directories...) and there is usually nothing to record for them, so
+ * handlers check the return value before reading anything from the tracee.
+ * If trace_negative_lookups is set, the paths are recorded in a separate table
+ * instead, so that the search behavior can be reproduced.
+ */
+
+static int record_negative_lookup(struct Process *process, size_t arg,
+                                  unsigned int mode)
+{
+    if(trace_negative_lookups)
+        record_negative(process, abs_path_arg(process, arg), mode);
+    return 0;
+}
+
+
 /* ********************
  * Other syscalls that might be of interest but that we don't handle yet
  */
@@ -149,8 +286,7 @@ static int syscall_fileopening(const char *name, struct Process *process,
                                unsigned int syscall)
 {
     unsigned int mode;
-    char *pathname = abs_path_arg(process, 0);
-    //printf("pathname = [%s]\n", pathname);
+    char *pathname;
 
     if(syscall == SYSCALL_OPENING_ACCESS)
         mode = FILE_STAT;
@@ -160,6 +296,12 @@ static int syscall_fileopening(const char *name, struct Process *process,
     else /* syscall == SYSCALL_OPENING_OPEN */
         mode = flags2mode(process->params[1].u);
 
+    /* Fast path: don't read the path for failed calls unless we log them */
+    if(process->retvalue.i < 0 && verbosity < 3)
+        return record_negative_lookup(process, 0, mode);
+
+    pathname = abs_path_arg(process, 0);
+
     if(verbosity >= 3)
     {
         /* Converts mode to string s_mode */
@@ -192,17 +334,13 @@ static int syscall_fileopening(const char *name, struct Process *process,
                       (int)process->retvalue.i,
                       (process->retvalue.i >= 0)?"success":"failure");
     }
-    //printf("process.retvalue.i = [%d]\n", process->retvalue.i);
-    if(process->retvalue.i >= 0)
-    {
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            mode,
-                            path_is_dir(pathname)) != 0)
-            return -1;
-    }
 
-    free(pathname);
+    if(process->retvalue.i >= 0)
+        record_file_open(process, pathname, mode, RECORD_STAT);
+    else if(trace_negative_lookups)
+        record_negative(process, pathname, mode);
+    else
+        free(pathname);
     return 0;
 }
 
@@ -211,31 +349,28 @@ static int syscall_fileopening(const char *name, struct Process *process,
  * rename(), link(), symlink()
  */
 
+static void record_link(struct Process *process, size_t read_arg,
+                        size_t written_arg, unsigned int is_symlink)
+{
+    char *written_path = abs_path_arg(process, written_arg);
+    /* symlink doesn't actually read the source */
+    if(!is_symlink)
+    {
+        /* Both are a directory if the new path is, once the call is done */
+        struct Record *source;
+        source = record_file_open(process, abs_path_arg(process, read_arg),
+                                  FILE_READ | FILE_LINK, RECORD_STAT);
+        source->stat_path = written_path;
+    }
+    record_file_open(process, written_path, FILE_WRITE | FILE_LINK,
+                     RECORD_STAT);
+}
+
 static int syscall_filecreating(const char *name, struct Process *process,
                                 unsigned int is_symlink)
 {
     if(process->retvalue.i >= 0)
-    {
-        char *written_path = abs_path_arg(process, 1);
-        int is_dir = path_is_dir(written_path);
-        /* symlink doesn't actually read the source */
-        if(!is_symlink)
-        {
-            char *read_path = abs_path_arg(process, 0);
-            if(db_add_file_open(process->identifier,
-                                read_path,
-                                FILE_READ | FILE_LINK,
-                                is_dir) != 0)
-                return -1;
-            free(read_path);
-        }
-        if(db_add_file_open(process->identifier,
-                            written_path,
-                            FILE_WRITE | FILE_LINK,
-                            is_dir) != 0)
-            return -1;
-        free(written_path);
-    }
+        record_link(process, 0, 1, is_symlink);
     return 0;
 }
 
@@ -244,29 +379,9 @@ static int syscall_filecreating_at(const char *name, struct Process *process,
 {
     if(process->retvalue.i >= 0)
     {
-        if( (process->params[0].i == AT_FDCWD)
-         && (process->params[2].i == AT_FDCWD) )
-        {
-            char *written_path = abs_path_arg(process, 3);
-            int is_dir = path_is_dir(written_path);
-            /* symlink doesn't actually read the source */
-            if(!is_symlink)
-            {
-                char *read_path = abs_path_arg(process, 1);
-                if(db_add_file_open(process->identifier,
-                                    read_path,
-                                    FILE_READ | FILE_LINK,
-                                    is_dir) != 0)
-                    return -1;
-                free(read_path);
-            }
-            if(db_add_file_open(process->identifier,
-                                written_path,
-                                FILE_WRITE | FILE_LINK,
-                                is_dir) != 0)
-                return -1;
-            free(written_path);
-        }
+        if( ((int)process->params[0].i == AT_FDCWD)
+         && ((int)process->params[2].i == AT_FDCWD) )
+            record_link(process, 1, 3, is_symlink);
         else
             return syscall_unhandled_other(name, process, 0);
     }
@@ -283,14 +398,12 @@ static int syscall_filestat(const char *name, struct Process *process,
 {
     if(process->retvalue.i >= 0)
     {
-        char *pathname = abs_path_arg(process, 0);
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_STAT | (no_deref?FILE_LINK:0),
-                            path_is_dir(pathname)) != 0)
-            return -1;
-        free(pathname);
+        record_file_open(process, abs_path_arg(process, 0),
+                         FILE_STAT | (no_deref?FILE_LINK:0), RECORD_STAT);
     }
+    else
+        return record_negative_lookup(process, 0,
+                                      FILE_STAT | (no_deref?FILE_LINK:0));
     return 0;
 }
 
@@ -304,13 +417,8 @@ static int syscall_readlink(const char *name, struct Process *process,
 {
     if(process->retvalue.i >= 0)
     {
-        char *pathname = abs_path_arg(process, 0);
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_STAT | FILE_LINK,
-                            0) != 0)
-            return -1;
-        free(pathname);
+        record_file_open(process, abs_path_arg(process, 0),
+                         FILE_STAT | FILE_LINK, 0);
     }
     return 0;
 }
@@ -327,12 +435,7 @@ static int syscall_mkdir(const char *name, struct Process *process,
     {
         char *pathname = abs_path_arg(process, 0);
         log_debug(process->tid, "mkdir(\"%s\")", pathname);
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_WRITE,
-                            1) != 0)
-            return -1;
-        free(pathname);
+        record_file_open(process, pathname, FILE_WRITE, 1);
     }
     return 0;
 }
@@ -350,11 +453,7 @@ static int syscall_chdir(const char *name, struct Process *process,
         char *pathname = abs_path_arg(process, 0);
         free(process->threadgroup->wd);
         process->threadgroup->wd = pathname;
-        if(db_add_file_open(process->identifier,
-                            pathname,
-                            FILE_WDIR,
-                            1) != 0)
-            return -1;
+        record_file_open(process, strdup(pathname), FILE_WDIR, 1);
     }
     return 0;
 }
@@ -416,7 +515,7 @@ static int record_shebangs(struct Process *process, const char *exec_target)
                 if(db_add_file_open(process->identifier,
                                     pathname,
                                     FILE_READ,
-                                    0) != 0)
+                                    0, db_timestamp()) != 0)
                     return -1;
                 free(pathname);
             }
@@ -424,7 +523,7 @@ static int record_shebangs(struct Process *process, const char *exec_target)
                 if(db_add_file_open(process->identifier,
                                     start,
                                     FILE_READ,
-                                    0) != 0)
+                                    0, db_timestamp()) != 0)
                     return -1;
             exec_target = strcpy(target_buffer, start);
         }
@@ -502,15 +601,15 @@ int syscall_execve_event(struct Process *process)
          * So we start by finding the one which called execve.
          * No possible confusion here since all other threads will have been
          * terminated by the kernel. */
-        size_t i;
-        for(i = 0; i < processes_size; ++i)
+        struct Process *member;
+        for(member = process->threadgroup->members; member != NULL;
+            member = member->tg_next)
         {
-            if(processes[i]->status == PROCSTAT_ATTACHED
-             && processes[i]->threadgroup == process->threadgroup
-             && processes[i]->in_syscall
-             && processes[i]->execve_info != NULL)
+            if(member->status == PROCSTAT_ATTACHED
+             && member->in_syscall
+             && member->execve_info != NULL)
             {
-                exec_process = processes[i];
+                exec_process = member;
                 break;
             }
         }
@@ -538,6 +637,9 @@ int syscall_execve_event(struct Process *process)
         exec_process->execve_info = NULL;
 
     process->flags = PROCFLAG_EXECD;
+    /* The thread leader might not have been in a syscall, but it is coming
+     * out of execve() now */
+    process->in_syscall = 1;
 
     /* Note: execi->argv needs a cast to suppress a bogus warning
      * While conversion from char** to const char** is invalid, conversion from
@@ -572,6 +674,10 @@ static int syscall_execve_out(const char *name, struct Process *process,
     log_debug(process->tid, "execve() failed");
     if(process->execve_info != NULL)
     {
+        /* The path was read on entry, so this costs nothing more */
+        if(trace_negative_lookups)
+            record_negative(process, strdup(process->execve_info->binary),
+                            FILE_READ);
         free_execve_info(process->execve_info);
         process->execve_info = NULL;
     }
@@ -647,39 +753,30 @@ int syscall_fork_event(struct Process *process, unsigned int event)
             return -1;
             /* LCOV_EXCL_END */
         }
-        new_process->status = PROCSTAT_ATTACHED;
-        ptrace(PTRACE_SYSCALL, new_process->tid, NULL, NULL);
-        if(verbosity >= 2)
-        {
-            unsigned int nproc, unknown;
-            trace_count_processes(&nproc, &unknown);
-            log_info(0, "%d processes (inc. %d unattached)",
-                     nproc, unknown);
-        }
+        /* Resumed below, once it is set up */
     }
     else
     {
-        /* Process hasn't been seen before (event happened first) */
-        new_process = trace_get_empty_process();
-        new_process->status = PROCSTAT_ALLOCATED;
-        new_process->flags = 0;
-        /* New process gets a SIGSTOP, but we resume on attach */
-        new_process->tid = new_tid;
-        new_process->in_syscall = 0;
+        /* Process hasn't been seen before (event happened first)
+         * New process gets a SIGSTOP, but we resume on attach */
+        new_process = trace_get_empty_process(new_tid, PROCSTAT_ALLOCATED);
     }
 
+    /* New processes might go to another tracer thread, threads can't */
+    if(!is_thread && trace_shards > 1)
+        new_process->flags |= PROCFLAG_MIGRATE;
+
     if(is_thread)
     {
-        new_process->threadgroup = process->threadgroup;
-        process->threadgroup->refs++;
+        trace_join_threadgroup(new_process, process->threadgroup);
         if(verbosity >= 3)
             log_debug(process->threadgroup->tgid, "threadgroup refs=%d",
                       process->threadgroup->refs);
     }
     else
-        new_process->threadgroup = trace_new_threadgroup(
+        trace_join_threadgroup(new_process, trace_new_threadgroup(
                 new_process->tid,
-                strdup(process->threadgroup->wd));
+                strdup(process->threadgroup->wd)));
 
     /* Parent will also get a SIGTRAP with PTRACE_EVENT_FORK */
 
@@ -688,6 +785,18 @@ int syscall_fork_event(struct Process *process, unsigned int event)
                       process->threadgroup->wd, is_thread) != 0)
         return -1;
 
+    if(new_process->status == PROCSTAT_UNKNOWN)
+    {
+        trace_start_process(new_process);
+        if(verbosity >= 2)
+        {
+            unsigned int nproc, unknown;
+            trace_count_processes(&nproc, &unknown);
+            log_info(0, "%d processes (inc. %d unattached)",
+                     nproc, unknown);
+        }
+    }
+
     return 0;
 }
 
@@ -778,7 +887,8 @@ static int syscall_xxx_at(const char *name, struct Process *process,
 {
     /* Argument 0 is a file descriptor, we assume that the rest of them match
      * the non-at variant of the syscall */
-    if(process->params[0].i == AT_FDCWD)
+    /* dirfd is an int, the upper half of the register is undefined */
+    if((int)process->params[0].i == AT_FDCWD)
     {
         struct syscall_table_entry *entry = NULL;
         struct syscall_table *tbl;
@@ -813,7 +923,7 @@ static int syscall_xxx_at(const char *name, struct Process *process,
             return ret;
         }
     }
-    else
+    else if(process->retvalue.i >= 0)
     {
         char *pathname = tracee_strdup(process->tid, process->params[1].p);
         log_info(process->tid,
@@ -822,6 +932,8 @@ static int syscall_xxx_at(const char *name, struct Process *process,
         free(pathname);
         return 0;
     }
+    else
+        return 0;
 }
 
 
@@ -1114,168 +1226,238 @@ void syscall_build_table(void)
         process_table(&syscall_tables[SYSCALL_X86_64_x32], list);
     }
 #endif
+
+    syscall_build_filter();
 }
 
 
 /* ********************
- * Handle a syscall via the table
+ * seccomp filter
+ *
+ * Only the syscalls that are in the tables need to stop the tracee. The filter
+ * returns SECCOMP_RET_TRACE for those, which stops the tracee on entry with
+ * PTRACE_EVENT_SECCOMP; it is then resumed with PTRACE_SYSCALL to get the
+ * exit stop, and with PTRACE_CONT after that (see trace_resume_request()).
+ *
+ * Most handlers only look at the exit. For those, the data of the RET_TRACE is
+ * SYSCALL_FILTER_EXIT_ONLY and the tracer resumes the entry stop right away,
+ * without fetching the registers or waking up a worker.
+ *
+ * Before Linux 4.8, the seccomp stop came before the syscall-entry stop
+ * instead of replacing it; the filter is not used there.
  */
-__thread int twritefd;
-__thread int treadfd;
 
-//int syscall_handle(struct Process *process)
-void *syscall_handle(void *arg)
+static struct sock_filter *syscall_filter = NULL;
+static size_t syscall_filter_len = 0;
+
+static void filter_emit(unsigned short code, unsigned char jt,
+                        unsigned char jf, unsigned int k)
 {
-    int worker_pipe[4];
-    worker_arg *argument = (worker_arg *)arg;
-    for (int i = 0; i < 4; i++) {
-        worker_pipe[i] = argument->fd[i];
-        //printf("I am worker. worker_pipe[%d] = %d\n", i, worker_pipe[i]);
+    struct sock_filter *insn = &syscall_filter[syscall_filter_len++];
+    insn->code = code;
+    insn->jt = jt;
+    insn->jf = jf;
+    insn->k = k;
+}
+
+static size_t filter_table_size(const struct syscall_table *table)
+{
+    size_t i, nb = 0;
+    for(i = 0; i < table->length; ++i)
+        if(table->entries[i].proc_entry || table->entries[i].proc_exit)
+            ++nb;
+    return nb;
+}
+
+/* Returns TRACE if the syscall number in the accumulator is in the table,
+ * ALLOW otherwise */
+static void filter_emit_table(const struct syscall_table *table,
+                              unsigned int bit)
+{
+    size_t i, nb = filter_table_size(table), done = 0;
+    for(i = 0; i < table->length; ++i)
+    {
+        const struct syscall_table_entry *entry = &table->entries[i];
+        if(!entry->proc_entry && !entry->proc_exit)
+            continue;
+        /* Skips the remaining checks and the RET_ALLOW, and the exit-only
+         * RET_TRACE if needed */
+        filter_emit(BPF_JMP | BPF_JEQ | BPF_K,
+                    nb - done + (entry->proc_entry?1:0), 0, i | bit);
+        ++done;
     }
-    twritefd = worker_pipe[1];
-    treadfd = worker_pipe[2];
+    filter_emit(BPF_RET | BPF_K, 0, 0, SECCOMP_RET_ALLOW);
+    filter_emit(BPF_RET | BPF_K, 0, 0,
+                SECCOMP_RET_TRACE | SYSCALL_FILTER_EXIT_ONLY);
+    filter_emit(BPF_RET | BPF_K, 0, 0,
+                SECCOMP_RET_TRACE | SYSCALL_FILTER_ENTRY);
+}
+
+static int filter_kernel_ok(void)
+{
+    struct utsname name;
+    int major, minor;
+    if(uname(&name) != 0
+     || sscanf(name.release, "%d.%d", &major, &minor) != 2)
+        return 0; /* LCOV_EXCL_LINE */
+    return major > 4 || (major == 4 && minor >= 8);
+}
+
+void syscall_build_filter(void)
+{
+    size_t i, size = 16;
+#ifdef X86_64
+    size_t jump_i386, jump_x32;
+#endif
+
+    if(syscall_filter != NULL || !filter_kernel_ok())
+        return;
 
-    struct rlimit rl;
-    int result;
-    result = getrlimit(RLIMIT_STACK, &rl);
-    if(result == 0)
+#if defined(I386)
+    for(i = 0; i < 1; ++i)
+#else
+    for(i = 0; i < 3; ++i)
+#endif
     {
-        //printf("\tget stack size, result = %d\n", (int)rl.rlim_cur);
+        /* Jump offsets are 8 bits */
+        if(filter_table_size(&syscall_tables[i]) >= 254)
+            return; /* LCOV_EXCL_LINE */
+        size += filter_table_size(&syscall_tables[i]) + 3;
     }
-    else if (result == -1)
+    syscall_filter = malloc(size * sizeof(*syscall_filter));
+    syscall_filter_len = 0;
+
+    filter_emit(BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                offsetof(struct seccomp_data, arch));
+#if defined(X86_64)
+    filter_emit(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, AUDIT_ARCH_X86_64);
+    jump_i386 = syscall_filter_len;
+    filter_emit(BPF_JMP | BPF_JA, 0, 0, 0);
+    filter_emit(BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                offsetof(struct seccomp_data, nr));
+    filter_emit(BPF_JMP | BPF_JGE | BPF_K, 0, 1, __X32_SYSCALL_BIT);
+    jump_x32 = syscall_filter_len;
+    filter_emit(BPF_JMP | BPF_JA, 0, 0, 0);
+    filter_emit_table(&syscall_tables[SYSCALL_X86_64], 0);
+    syscall_filter[jump_x32].k = syscall_filter_len - jump_x32 - 1;
+    filter_emit_table(&syscall_tables[SYSCALL_X86_64_x32], __X32_SYSCALL_BIT);
+    /* x64 kernel running an i386 binary */
+    syscall_filter[jump_i386].k = syscall_filter_len - jump_i386 - 1;
+#endif
+    filter_emit(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, AUDIT_ARCH_I386);
+    filter_emit(BPF_RET | BPF_K, 0, 0, SECCOMP_RET_ALLOW);
+    filter_emit(BPF_LD | BPF_W | BPF_ABS, 0, 0,
+                offsetof(struct seccomp_data, nr));
+    filter_emit_table(&syscall_tables[SYSCALL_I386], 0);
+}
+
+int syscall_filter_available(void)
+{
+    return syscall_filter != NULL;
+}
+
+int syscall_install_filter(void)
+{
+    struct sock_fprog prog;
+    if(syscall_filter == NULL)
+        return -1;
+    prog.len = (unsigned short)syscall_filter_len;
+    prog.filter = syscall_filter;
+    if(prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0) == 0)
+        return 0;
+    /* Unprivileged processes need no_new_privs; setuid binaries don't get
+     * their privileges under an unprivileged tracer anyway */
+    if(errno != EACCES || prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+        return -1;
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog, 0, 0);
+}
+
+
+/* ********************
+ * Handle a syscall via the table
+ */
+int syscall_handle(struct Process *process)
+{
+    pid_t tid = process->tid;
+    const int syscall = process->current_syscall & ~__X32_SYSCALL_BIT;
+    size_t syscall_type;
+    const char *inout = process->in_syscall?"out":"in";
+    if(process->mode == MODE_I386)
     {
-        //perror("get stack size");
+        syscall_type = SYSCALL_I386;
+        if(verbosity >= 4)
+            log_debug(process->tid, "syscall %d (i386) (%s)", syscall, inout);
     }
-    rl.rlim_cur = 16*1024*1024;
-    result = setrlimit(RLIMIT_STACK, &rl);
-    
-    struct rlimit rl2;
-    int result2;
-    result2 = getrlimit(RLIMIT_STACK, &rl2);
-    if(result2 == 0)
+    else if(process->current_syscall & __X32_SYSCALL_BIT)
     {
-        //printf("\t2get stack size, result = %d\n", (int)rl2.rlim_cur);
+        /* LCOV_EXCL_START : x32 is not supported right now */
+        syscall_type = SYSCALL_X86_64_x32;
+        if(verbosity >= 4)
+            log_debug(process->tid, "syscall %d (x32) (%s)", syscall, inout);
+        /* LCOV_EXCL_END */
     }
-    else if (result2 == -1)
+    else
     {
-        perror("2get stack size");
+        syscall_type = SYSCALL_X86_64;
+        if(verbosity >= 4)
+            log_debug(process->tid, "syscall %d (x64) (%s)", syscall, inout);
     }
 
-    while (1) {
-        //printf("I am worker. New iteration begins.\n");
-        struct Process *process;
-        ssize_t len = read(worker_pipe[2], &process, sizeof(struct Process *));
-
-
-        //struct Process *process = (struct Process *)malloc(sizeof(struct Process));
-        //printf("I am worker. I am reading from fd [%d]\n", worker_pipe[2]);
-        //ssize_t len = read(worker_pipe[2], process, sizeof(struct Process));
-        //if (len != sizeof(struct Process)) {
-        //    printf("Worker read failed\n");
-        //    perror("read");
-        //    pthread_exit(NULL);
-        //}
-        //printf("I have finished reading [%d] bytes\n", (int)len);
-
-
-        pid_t tid = process->tid;
-        const int syscall = process->current_syscall & ~__X32_SYSCALL_BIT;
-        size_t syscall_type;
-        const char *inout = process->in_syscall?"out":"in";
-        if(process->mode == MODE_I386)
-        {
-            syscall_type = SYSCALL_I386;
-            if(verbosity >= 4)
-                log_debug(process->tid, "syscall %d (i386) (%s)", syscall, inout);
-        }
-        else if(process->current_syscall & __X32_SYSCALL_BIT)
-        {
-            /* LCOV_EXCL_START : x32 is not supported right now */
-            syscall_type = SYSCALL_X86_64_x32;
-            if(verbosity >= 4)
-                log_debug(process->tid, "syscall %d (x32) (%s)", syscall, inout);
-            /* LCOV_EXCL_END */
-        }
-        else
-        {
-            syscall_type = SYSCALL_X86_64;
-            if(verbosity >= 4)
-                log_debug(process->tid, "syscall %d (x64) (%s)", syscall, inout);
-        }
-
-        if(process->flags & PROCFLAG_EXECD)
+    if(process->flags & PROCFLAG_EXECD)
+    {
+        if(verbosity >= 4)
+            log_debug(process->tid,
+                      "ignoring, EXEC'D is set -- just post-exec syscall-"
+                      "return stop");
+        process->flags &= ~PROCFLAG_EXECD;
+        if(process->execve_info != NULL)
         {
-            if(verbosity >= 4)
-                log_debug(process->tid,
-                          "ignoring, EXEC'D is set -- just post-exec syscall-"
-                          "return stop");
-            process->flags &= ~PROCFLAG_EXECD;
-            if(process->execve_info != NULL)
-            {
-                free_execve_info(process->execve_info);
-                process->execve_info = NULL;
-            }
-            process->in_syscall = 1; /* set to 0 before function returns */
+            free_execve_info(process->execve_info);
+            process->execve_info = NULL;
         }
-        else
+        process->in_syscall = 1; /* set to 0 before function returns */
+    }
+    else
+    {
+        struct syscall_table_entry *entry = NULL;
+        struct syscall_table *tbl = &syscall_tables[syscall_type];
+        if(syscall < 0 || syscall >= 2000)
+            log_error(process->tid, "INVALID SYSCALL %d", syscall);
+        if(entry == NULL && syscall >= 0 && (size_t)syscall < tbl->length)
+            entry = &tbl->entries[syscall];
+        if(entry != NULL)
         {
-            //printf("I am worker. Handling syscall [%d]\n", syscall);
-            struct syscall_table_entry *entry = NULL;
-            struct syscall_table *tbl = &syscall_tables[syscall_type];
-            if(syscall < 0 || syscall >= 2000)
-                log_error(process->tid, "INVALID SYSCALL %d", syscall);
-            if(entry == NULL && syscall >= 0 && (size_t)syscall < tbl->length)
-                entry = &tbl->entries[syscall];
-            if(entry != NULL)
-            {
-                int ret = 0;
-                if(entry->name && verbosity >= 3)
-                    log_debug(process->tid, "%s()", entry->name);
-                if(!process->in_syscall && entry->proc_entry)
-                    ret = entry->proc_entry(entry->name, process, entry->udata);
-                else if(process->in_syscall && entry->proc_exit)
-                    ret = entry->proc_exit(entry->name, process, entry->udata);
-                if(ret != 0)
-                    //return -1;
-                    pthread_exit(NULL);
-            }
+            int ret = 0;
+            if(entry->name && verbosity >= 3)
+                log_debug(process->tid, "%s()", entry->name);
+            if(!process->in_syscall && entry->proc_entry)
+                ret = entry->proc_entry(entry->name, process, entry->udata);
+            else if(process->in_syscall && entry->proc_exit)
+                ret = entry->proc_exit(entry->name, process, entry->udata);
+            if(ret != 0)
+                return -1;
         }
+    }
 
-        /* Run to next syscall */
-        if(process->in_syscall)
+    /* Run to next syscall */
+    if(process->in_syscall)
+    {
+        process->in_syscall = 0;
+        if(process->execve_info != NULL)
         {
-            process->in_syscall = 0;
-            if(process->execve_info != NULL)
-            {
-                log_error(process->tid, "out of syscall with execve_info != NULL");
-                //return -1;
-                pthread_exit(NULL);
-            }
-            process->current_syscall = -1;
+            log_error(process->tid, "out of syscall with execve_info != NULL");
+            return -1;
         }
-        else
-            process->in_syscall = 1;
-
-
-        int request = PTRACE_SYSCALL;
-        void *addr = NULL;
-        void *data = NULL;
+        process->current_syscall = -1;
+    }
+    else
+        process->in_syscall = 1;
 
-        write(worker_pipe[1], &request, sizeof(request));
-        //printf("I am worker. I just sent request [%d]\n", request);
-        write(worker_pipe[1], &tid, sizeof(tid));
-        //printf("I am worker, I just sent tid [%d]\n", tid);
-        write(worker_pipe[1], &addr, sizeof(addr));
-        //printf("I am worker. I just sent addr [%p]\n", addr);
-        write(worker_pipe[1], &data, sizeof(data));
-        //printf("I am worker. I just sent data [%p]\n", data);
+    /* Memory will change once the tracee runs */
+    tracee_cache_invalidate();
 
-        long res;
-        read(worker_pipe[2], &res, sizeof(res));
-        (void)res;
+    tracee_ptrace(trace_resume_request(process), tid, NULL, NULL);
 
-        //printf("I am worker. This iteration has finished.\n");
-    }
-
-    return 0;
+    /* Don't use process past this point, see records_flush() */
+    return records_flush();
 }
@@ -5,8 +5,27 @@
 
 void syscall_build_table(void);
 
-//int syscall_handle(struct Process *process);
-void *syscall_handle(void *arg);
+/**
+ * Builds the seccomp filter that only stops the tracee on the syscalls we
+ * handle (called by syscall_build_table()).
+ *
+ * It is not built if the kernel is older than 4.8.
+ */
+void syscall_build_filter(void);
+int syscall_filter_available(void);
+
+/* SECCOMP_RET_DATA of the filter: whether the syscall entry has to be
+ * handled, or only its exit (the handler has no proc_entry) */
+#define SYSCALL_FILTER_EXIT_ONLY    0
+#define SYSCALL_FILTER_ENTRY        1
+
+/**
+ * Installs the filter in the calling process, which must be traced with
+ * PTRACE_O_TRACESECCOMP already (or the syscalls would fail with ENOSYS).
+ */
+int syscall_install_filter(void);
+
+int syscall_handle(struct Process *process);
 
 int syscall_execve_event(struct Process *process);
 int syscall_fork_event(struct Process *process, unsigned int event);
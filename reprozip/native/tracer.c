@@ -1,22 +1,24 @@
 #include <errno.h>
+#include <linux/audit.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/epoll.h>
 #include <sys/ptrace.h>
 #include <sys/reg.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/wait.h>
-#include <sys/ioctl.h>
 #include <unistd.h>
-#include <poll.h>
-#include <pthread.h>
 
 #include "config.h"
 #include "database.h"
@@ -25,7 +27,7 @@
 #include "syscalls.h"
 #include "tracer.h"
 #include "utils.h"
-#include "vector.h"
+#include "workers.h"
 
 
 #ifndef NT_PRSTATUS
@@ -103,6 +105,19 @@ static void get_x86_64_reg(register_type *reg, uint64_t value)
 int trace_verbosity = 0;
 #define verbosity trace_verbosity
 
+/* Whether to record failed open() and stat() calls, see syscalls.c */
+int trace_negative_lookups = 0;
+
+/* Set once a tracee stops with PTRACE_EVENT_SECCOMP, i.e. the filter got
+ * installed; before any other thread deals with tracees */
+static int trace_seccomp = 0;
+
+/* Number of threads handling syscalls, 0 for one per CPU */
+unsigned int trace_workers = 0;
+
+/* Number of tracer threads, 0 or 1 for a single one, see struct Shard */
+unsigned int trace_shards = 0;
+
 
 void free_execve_info(struct ExecveInfo *execi)
 {
@@ -113,59 +128,220 @@ void free_execve_info(struct ExecveInfo *execi)
 }
 
 
-struct Process **processes = NULL;
-size_t processes_size;
+/* ********************
+ * Shards
+ *
+ * ptrace() requests can only be made by the thread that is the tracer, so a
+ * single tracer thread doesn't scale with the number of traced processes. In
+ * sharded mode, several tracer threads each own part of the process tree, with
+ * their own process table, worker pool and tracees (waited for with
+ * __WNOTHREAD). The thread calling fork_and_trace() is shard 0.
+ */
+
+struct Handoff;
+
+/* Processes of a shard, indexed by tid
+ *
+ * Slots are allocated in chunks and never move; the free ones are chained
+ * through next_free. The index is an open-addressing hash table with linear
+ * probing, at most half full.
+ */
+struct ProcessTable {
+    struct Process **slots;         /* all the slots, for cleanup() */
+    size_t size;
+    struct Process *free_list;
+    struct Process **index;
+    size_t index_size;              /* power of 2 */
+    unsigned int count;             /* processes in the table */
+    unsigned int unknown;           /* of which PROCSTAT_UNKNOWN */
+};
 
-struct Process *trace_find_process(pid_t tid)
+struct Shard {
+    unsigned int index;
+    pthread_t thread;
+    struct WorkerPool *pool;
+    unsigned int load;              /* processes owned (atomic) */
+
+    /* Only used by that thread, and by cleanup() once it's gone */
+    struct ProcessTable table;
+
+    /* Processes handed over by other shards, not yet attached */
+    pthread_mutex_t inbox_lock;
+    struct Handoff **inbox;
+    size_t inbox_count;
+    size_t inbox_capacity;
+    int stopped;
+};
+
+static struct Shard *shards = NULL;
+static unsigned int shards_count = 0;
+static unsigned int shards_started = 0;
+static __thread struct Shard *shard_self = NULL;
+
+/* Processes traced by all the shards (atomic); tracing is over at 0 */
+static unsigned int trace_live = 0;
+
+static int shards_done = 0;
+static int shards_failed = 0;
+
+/* Multiplicative hashing; tids are mostly sequential anyway */
+#define TID_HASH(tid) ((uint32_t)(tid) * 2654435769u)
+
+static void table_grow(struct ProcessTable *table)
 {
-    size_t i;
-    for(i = 0; i < processes_size; ++i)
+    size_t i, prev_size = table->size;
+    struct Process *chunk;
+    table->size = (prev_size == 0)?16:prev_size * 2;
+    chunk = malloc((table->size - prev_size) * sizeof(*chunk));
+    table->slots = realloc(table->slots, table->size * sizeof(*table->slots));
+    /* Pushed in reverse, so that the lowest slots get used first */
+    for(i = table->size; i-- > prev_size; )
     {
-        if(processes[i]->status != PROCSTAT_FREE && processes[i]->tid == tid)
-            return processes[i];
+        struct Process *process = &chunk[i - prev_size];
+        table->slots[i] = process;
+        process->status = PROCSTAT_FREE;
+        process->threadgroup = NULL;
+        process->execve_info = NULL;
+        process->next_free = table->free_list;
+        table->free_list = process;
     }
-    return NULL;
 }
 
-struct Process *trace_get_empty_process(void)
+static void table_init(struct ProcessTable *table)
 {
+    table->slots = NULL;
+    table->size = 0;
+    table->free_list = NULL;
+    table->index_size = 32;
+    table->index = calloc(table->index_size, sizeof(*table->index));
+    table->count = 0;
+    table->unknown = 0;
+    table_grow(table);
+}
+
+static void table_free(struct ProcessTable *table)
+{
+    /* Slots are allocated in chunks, starting at 0, 16, 32, 64, ... */
     size_t i;
-    for(i = 0; i < processes_size; ++i)
+    if(table->slots == NULL)
+        return;
+    free(table->slots[0]);
+    for(i = 16; i < table->size; i *= 2)
+        free(table->slots[i]);
+    free(table->slots);
+    free(table->index);
+    table->slots = NULL;
+    table->index = NULL;
+}
+
+static void index_insert(struct Process **index, size_t mask,
+                         struct Process *process)
+{
+    size_t i = TID_HASH(process->tid) & mask;
+    while(index[i] != NULL)
+        i = (i + 1) & mask;
+    index[i] = process;
+}
+
+static void table_add(struct ProcessTable *table, struct Process *process)
+{
+    /* Keep the index at most half full */
+    if((table->count + 1) * 2 > table->index_size)
     {
-        if(processes[i]->status == PROCSTAT_FREE)
-            return processes[i];
+        size_t i, prev_size = table->index_size;
+        struct Process **prev = table->index;
+        table->index_size *= 2;
+        table->index = calloc(table->index_size, sizeof(*table->index));
+        for(i = 0; i < prev_size; ++i)
+            if(prev[i] != NULL)
+                index_insert(table->index, table->index_size - 1, prev[i]);
+        free(prev);
     }
+    index_insert(table->index, table->index_size - 1, process);
+    table->count++;
+    if(process->status == PROCSTAT_UNKNOWN)
+        table->unknown++;
+}
 
-    /* Count unknown processes */
-    if(verbosity >= 3)
+static void table_remove(struct ProcessTable *table, struct Process *process)
+{
+    size_t mask = table->index_size - 1;
+    size_t i = TID_HASH(process->tid) & mask, j;
+    while(table->index[i] != process)
+        i = (i + 1) & mask;
+    /* No tombstones: move back the following entries of the cluster that
+     * can't be found past the hole anymore */
+    j = i;
+    for(;;)
     {
-        size_t unknown = 0;
-        for(i = 0; i < processes_size; ++i)
-            if(processes[i]->status == PROCSTAT_UNKNOWN)
-                ++unknown;
-        log_debug(0, "there are %u/%u UNKNOWN processes",
-                  (unsigned int)unknown, (unsigned int)processes_size);
+        size_t home;
+        j = (j + 1) & mask;
+        if(table->index[j] == NULL)
+            break;
+        home = TID_HASH(table->index[j]->tid) & mask;
+        if( (i < j)?(home > i && home <= j):(home > i || home <= j) )
+            continue;
+        table->index[i] = table->index[j];
+        i = j;
     }
+    table->index[i] = NULL;
 
-    /* Allocate more! */
-    if(verbosity >= 3)
-        log_debug(0, "process table full (%d), reallocating",
-                  (int)processes_size);
-    {
-        struct Process *pool;
-        size_t prev_size = processes_size;
-        processes_size *= 2;
-        pool = malloc((processes_size - prev_size) * sizeof(*pool));
-        processes = realloc(processes, processes_size * sizeof(*processes));
-        for(; i < processes_size; ++i)
+    table->count--;
+    if(process->status == PROCSTAT_UNKNOWN)
+        table->unknown--;
+    process->status = PROCSTAT_FREE;
+    process->next_free = table->free_list;
+    table->free_list = process;
+}
+
+struct Process *trace_find_process(pid_t tid)
+{
+    struct ProcessTable *table = &shard_self->table;
+    size_t mask = table->index_size - 1;
+    size_t i = TID_HASH(tid) & mask;
+    while(table->index[i] != NULL)
+    {
+        if(table->index[i]->tid == tid)
+            return table->index[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static struct Process *table_get_slot(struct ProcessTable *table)
+{
+    struct Process *process;
+    if(table->free_list == NULL)
+    {
+        if(verbosity >= 3)
         {
-            processes[i] = pool++;
-            processes[i]->status = PROCSTAT_FREE;
-            processes[i]->threadgroup = NULL;
-            processes[i]->execve_info = NULL;
+            log_debug(0, "there are %u/%u UNKNOWN processes",
+                      table->unknown, (unsigned int)table->size);
+            log_debug(0, "process table full (%d), reallocating",
+                      (int)table->size);
         }
-        return processes[prev_size];
+        table_grow(table);
     }
+    process = table->free_list;
+    table->free_list = process->next_free;
+    return process;
+}
+
+struct Process *trace_get_empty_process(pid_t tid, int status)
+{
+    struct ProcessTable *table = &shard_self->table;
+    struct Process *process;
+    __atomic_add_fetch(&shard_self->load, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trace_live, 1, __ATOMIC_RELAXED);
+    process = table_get_slot(table);
+    process->tid = tid;
+    process->status = status;
+    process->flags = 0;
+    process->threadgroup = NULL;
+    process->tg_prev = process->tg_next = NULL;
+    process->in_syscall = 0;
+    table_add(table, process);
+    return process;
 }
 
 struct ThreadGroup *trace_new_threadgroup(pid_t tgid, char *wd)
@@ -173,17 +349,54 @@ struct ThreadGroup *trace_new_threadgroup(pid_t tgid, char *wd)
     struct ThreadGroup *threadgroup = malloc(sizeof(struct ThreadGroup));
     threadgroup->tgid = tgid;
     threadgroup->wd = wd;
-    threadgroup->refs = 1;
+    threadgroup->refs = 0;
+    threadgroup->members = NULL;
     if(verbosity >= 3)
         log_debug(tgid, "threadgroup (= process) created");
     return threadgroup;
 }
 
-void trace_free_process(struct Process *process)
+static void threadgroup_link(struct Process *process)
+{
+    struct ThreadGroup *threadgroup = process->threadgroup;
+    process->tg_prev = NULL;
+    process->tg_next = threadgroup->members;
+    if(threadgroup->members != NULL)
+        threadgroup->members->tg_prev = process;
+    threadgroup->members = process;
+}
+
+static void threadgroup_unlink(struct Process *process)
+{
+    struct ThreadGroup *threadgroup = process->threadgroup;
+    if(process->tg_prev != NULL)
+        process->tg_prev->tg_next = process->tg_next;
+    else if(threadgroup->members == process)
+        threadgroup->members = process->tg_next;
+    if(process->tg_next != NULL)
+        process->tg_next->tg_prev = process->tg_prev;
+    process->tg_prev = process->tg_next = NULL;
+}
+
+void trace_join_threadgroup(struct Process *process,
+                            struct ThreadGroup *threadgroup)
+{
+    process->threadgroup = threadgroup;
+    threadgroup->refs++;
+    threadgroup_link(process);
+}
+
+/* Frees what a process holds, it must not be in a table anymore (or the table
+ * is going away) */
+static void process_release(struct Shard *owner, struct Process *process)
 {
     process->status = PROCSTAT_FREE;
+    if(owner != NULL)
+        __atomic_sub_fetch(&owner->load, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&trace_live, 1, __ATOMIC_RELEASE);
     if(process->threadgroup != NULL)
     {
+        threadgroup_unlink(process);
         process->threadgroup->refs--;
         if(verbosity >= 3)
             log_debug(process->tid,
@@ -209,31 +422,21 @@ void trace_free_process(struct Process *process)
     }
 }
 
+void trace_free_process(struct Process *process)
+{
+    table_remove(&shard_self->table, process);
+    process_release(shard_self, process);
+}
+
 void trace_count_processes(unsigned int *p_nproc, unsigned int *p_unknown)
 {
-    unsigned int nproc = 0, unknown = 0;
-    size_t i;
-    for(i = 0; i < processes_size; ++i)
-    {
-        switch(processes[i]->status)
-        {
-        case PROCSTAT_FREE:
-            break;
-        case PROCSTAT_UNKNOWN:
-            /* Exists but no corresponding syscall has returned yet */
-            ++unknown;
-        case PROCSTAT_ALLOCATED:
-            /* Not yet attached but it will show up eventually */
-        case PROCSTAT_ATTACHED:
-            /* Running */
-            ++nproc;
-            break;
-        }
-    }
+    /* UNKNOWN: exists but no corresponding syscall has returned yet
+     * ALLOCATED: not yet attached but it will show up eventually
+     * ATTACHED: running */
     if(p_nproc != NULL)
-        *p_nproc = nproc;
+        *p_nproc = shard_self->table.count;
     if(p_unknown != NULL)
-        *p_unknown = unknown;
+        *p_unknown = shard_self->table.unknown;
 }
 
 int trace_add_files_from_proc(unsigned int process, pid_t tid,
@@ -308,7 +511,8 @@ int trace_add_files_from_proc(unsigned int process, pid_t tid,
                 log_info(tid, "    adding to database");
 #endif
                 if(db_add_file_open(process, pathname,
-                                    FILE_READ, path_is_dir(pathname)) != 0)
+                                    FILE_READ, path_is_dir(pathname),
+                                    db_timestamp()) != 0)
                     return -1;
                 strncpy(previous_path, pathname, 4096);
             }
@@ -318,10 +522,9 @@ int trace_add_files_from_proc(unsigned int process, pid_t tid,
     return 0;
 }
 
-static void trace_set_options(pid_t tid)
+static long trace_options(void)
 {
-    ptrace(PTRACE_SETOPTIONS, tid, 0,
-           PTRACE_O_TRACESYSGOOD |  /* Adds 0x80 bit to SIGTRAP signals
+    return PTRACE_O_TRACESYSGOOD |  /* Adds 0x80 bit to SIGTRAP signals
                                      * if paused because of syscall */
 #ifdef PTRACE_O_EXITKILL
            PTRACE_O_EXITKILL |
@@ -329,448 +532,980 @@ static void trace_set_options(pid_t tid)
            PTRACE_O_TRACECLONE |
            PTRACE_O_TRACEFORK |
            PTRACE_O_TRACEVFORK |
-           PTRACE_O_TRACEEXEC);
+           PTRACE_O_TRACEEXEC |
+           (syscall_filter_available()?PTRACE_O_TRACESECCOMP:0);
 }
 
+int trace_resume_request(const struct Process *process)
+{
+    if(trace_seccomp && !process->in_syscall)
+        return PTRACE_CONT;
+    return PTRACE_SYSCALL;
+}
+
+static void trace_set_options(pid_t tid)
+{
+    ptrace(PTRACE_SETOPTIONS, tid, 0, trace_options());
+}
 
-vector *tid_worker_pipe_list;
 
-static void add_tid_worker_pipe(pid_t tid, int worker_pipe[4]) {
-    tid_worker_pipe cur_tid_worker_pipe;
-    cur_tid_worker_pipe.tid = tid;
-    for (int i = 0; i < 4; i++)
-        cur_tid_worker_pipe.worker_pipe[i] = worker_pipe[i];
-    vector_add(tid_worker_pipe_list, cur_tid_worker_pipe);
+/* ********************
+ * Hand-over between shards
+ *
+ * Threads stay with their thread group. A new process starts out traced by
+ * its parent's shard (the ptrace options are inherited), which then hands it
+ * over to the least loaded shard, before it gets to run.
+ *
+ * It can't just be detached with SIGSTOP: the resulting group-stop can be seen
+ * by its parent, and makes the kernel send SIGHUP to the whole process group
+ * if it is orphaned. Instead it is parked: it is made to call pause() with all
+ * signals blocked, by re-running the instruction that returned from fork(),
+ * and detached. The new owner attaches it with PTRACE_SEIZE, interrupts it and
+ * puts back its registers and signal mask.
+ */
+
+struct Handoff {
+    struct Process process;
+#ifdef X86_64
+    struct x86_64_regs regs;
+    uint64_t sigmask;
+#endif
+};
+
+/* Interrupts the wait of all the running shards */
+static void shards_wakeup(void)
+{
+    unsigned int i;
+    for(i = 0; i < shards_count; ++i)
+    {
+        pthread_mutex_lock(&shards[i].inbox_lock);
+        if(!shards[i].stopped)
+            workers_wakeup(shards[i].pool);
+        pthread_mutex_unlock(&shards[i].inbox_lock);
+    }
+}
+
+/* Makes all the shards leave trace() */
+static void shards_finish(int failed)
+{
+    if(failed)
+        __atomic_store_n(&shards_failed, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&shards_done, 1, __ATOMIC_RELEASE);
+    shards_wakeup();
 }
 
-static int get_worker_pipe_write(pid_t tid) {
-    int index = vector_find_tid(tid_worker_pipe_list, tid);
-    //printf("After vector_find_tid. Index is [%d]\n", index);
-    if (index == -1) {
-        return -1;
-    } else {
-        return vector_get(tid_worker_pipe_list, index).worker_pipe[3];
+static struct Shard *shard_pick(void)
+{
+    struct Shard *best = shard_self;
+    unsigned int best_load = __atomic_load_n(&best->load, __ATOMIC_RELAXED);
+    unsigned int i;
+    for(i = 0; i < shards_count; ++i)
+    {
+        unsigned int load = __atomic_load_n(&shards[i].load,
+                                            __ATOMIC_RELAXED);
+        if(load < best_load)
+        {
+            best = &shards[i];
+            best_load = load;
+        }
     }
+    return best;
 }
 
-static int delete_tid_worker_pip(pid_t tid) {
-    int index = vector_find_tid(tid_worker_pipe_list, tid);
-    if (index == -1) {
+/* Called in the stop following the creation of the process */
+static int shard_park(struct Handoff *handoff)
+{
+#if defined(X86_64) && defined(PTRACE_GETSIGMASK)
+    pid_t tid = handoff->process.tid;
+    struct x86_64_regs regs;
+    uint64_t blocked = ~(uint64_t)0;
+    long insn;
+
+    if(ptrace(PTRACE_GETREGS, tid, NULL, &handoff->regs) != 0
+     || ptrace(PTRACE_GETSIGMASK, tid, sizeof(handoff->sigmask),
+               &handoff->sigmask) != 0)
         return -1;
-    } else {
-        vector_delete(tid_worker_pipe_list, index);
-        return 1;
+    /* 32-bit processes might have come through the vDSO */
+    if(handoff->regs.cs != 0x33)
+        return -1;
+    errno = 0;
+    insn = ptrace(PTRACE_PEEKTEXT, tid, handoff->regs.rip - 2, NULL);
+    if(errno != 0 || (insn & 0xFFFF) != 0x050F) /* syscall */
+        return -1;
+
+    regs = handoff->regs;
+    regs.rip -= 2;
+    regs.rax = SYS_pause;
+    regs.orig_rax = -1;
+    if(ptrace(PTRACE_SETSIGMASK, tid, sizeof(blocked), &blocked) != 0)
+        return -1;
+    if(ptrace(PTRACE_SETREGS, tid, NULL, &regs) != 0)
+    {
+        /* LCOV_EXCL_START : We just read them */
+        ptrace(PTRACE_SETSIGMASK, tid, sizeof(handoff->sigmask),
+               &handoff->sigmask);
+        return -1;
+        /* LCOV_EXCL_END */
     }
+    return 0;
+#else
+    (void)handoff;
+    return -1;
+#endif
 }
 
-static int trace(pid_t first_proc, int *first_exit_code)
+/* Returns 1 if the process died while parked */
+static int shard_unpark(struct Handoff *handoff, int *status)
 {
-    //printf("Beginning of trace\n");
-    int num_workers = 0;
-
-    vpollfd pollfds;
-    vpollfd_init(&pollfds);
+#if defined(X86_64) && defined(PTRACE_GETSIGMASK)
+    pid_t tid = handoff->process.tid;
+    struct x86_64_regs regs;
 
+    ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
     for(;;)
     {
-        //printf("I am tracer. New iteration begins.\n");
-        int status;
-        pid_t tid;
-        int cpu_time;
-        struct Process *process;
+        if(waitpid(tid, status, __WALL) == -1)
+            return -1;
+        if(WIFEXITED(*status) || WIFSIGNALED(*status))
+            return 1;
+        if(*status >> 16 == PTRACE_EVENT_STOP)
+            break;
+        /* LCOV_EXCL_START : Only SIGSTOP gets through the mask */
+        ptrace(PTRACE_CONT, tid, NULL, WSTOPSIG(*status));
+        /* LCOV_EXCL_END */
+    }
 
-        /* Wait for a process */
-#if NO_WAIT3
-        tid = waitpid(-1, &status, __WALL | WNOHANG);
-        cpu_time = -1;
+    regs = handoff->regs;
+    regs.orig_rax = -1;
+    if(ptrace(PTRACE_SETREGS, tid, NULL, &regs) != 0
+     || ptrace(PTRACE_SETSIGMASK, tid, sizeof(handoff->sigmask),
+               &handoff->sigmask) != 0)
+        return -1;
+    return 0;
 #else
+    (void)handoff;
+    (void)status;
+    return -1;
+#endif
+}
+
+static int shard_handoff(struct Shard *target, struct Process *process)
+{
+    struct Handoff *handoff = malloc(sizeof(*handoff));
+    handoff->process = *process;
+
+    pthread_mutex_lock(&target->inbox_lock);
+    if(target->stopped || shard_park(handoff) != 0)
+    {
+        pthread_mutex_unlock(&target->inbox_lock);
+        free(handoff);
+        return -1;
+    }
+    if(ptrace(PTRACE_DETACH, process->tid, NULL, NULL) != 0)
+    {
+        /* LCOV_EXCL_START : It is stopped, detaching can't fail */
+        log_critical(process->tid, "couldn't detach process: %s",
+                     strerror(errno));
+        pthread_mutex_unlock(&target->inbox_lock);
+        free(handoff);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+
+    if(target->inbox_count == target->inbox_capacity)
+    {
+        target->inbox_capacity = (target->inbox_capacity == 0)?
+            16:target->inbox_capacity * 2;
+        target->inbox = realloc(target->inbox,
+                                target->inbox_capacity *
+                                sizeof(*target->inbox));
+    }
+    /* Not trace_free_process(): the process is still live. Its threadgroup
+     * has no other member, and the target can't link it before we unlock */
+    threadgroup_unlink(process);
+    table_remove(&shard_self->table, process);
+    process->threadgroup = NULL;
+    process->execve_info = NULL;
+    __atomic_sub_fetch(&shard_self->load, 1, __ATOMIC_RELAXED);
+
+    target->inbox[target->inbox_count++] = handoff;
+    __atomic_add_fetch(&target->load, 1, __ATOMIC_RELAXED);
+    workers_wakeup(target->pool);
+    pthread_mutex_unlock(&target->inbox_lock);
+
+    if(verbosity >= 3)
+        log_debug(process->tid, "handed over to tracer thread %u",
+                  target->index);
+    return 0;
+}
+
+/* Attaches and resumes the processes handed over to this shard */
+static int shard_adopt(void)
+{
+    struct Shard *shard = shard_self;
+    size_t i;
+    int ret = 0;
+
+    pthread_mutex_lock(&shard->inbox_lock);
+    for(i = 0; i < shard->inbox_count; ++i)
+    {
+        struct Handoff *handoff = shard->inbox[i];
+        pid_t tid = handoff->process.tid;
+        int status, r;
+        if(ptrace(PTRACE_SEIZE, tid, NULL, (void*)trace_options()) != 0)
         {
-            struct rusage res;
-            tid = wait3(&status, __WALL | WNOHANG, &res);
-            cpu_time = (res.ru_utime.tv_sec * 1000 +
-                        res.ru_utime.tv_usec / 1000);
+            /* LCOV_EXCL_START : We are allowed to trace its parent */
+            log_critical(tid, "couldn't attach handed-over process: %s",
+                         strerror(errno));
+            kill(tid, SIGKILL);
+            process_release(shard, &handoff->process);
+            ret = -1;
+            /* LCOV_EXCL_END */
         }
-#endif
-        if(tid == -1)
+        else if((r = shard_unpark(handoff, &status)) == 1)
         {
-            /* LCOV_EXCL_START : internal error: waitpid() won't fail unless we
-             * mistakingly call it while there is no child to wait for */
-            log_critical(0, "waitpid failed: %s", strerror(errno));
-            return -1;
+            /* LCOV_EXCL_START : Only SIGKILL gets through the mask */
+            int exitcode = WIFSIGNALED(status)?
+                (0x0100 | WTERMSIG(status)):WEXITSTATUS(status);
+            if(db_add_exit(handoff->process.identifier, exitcode, -1) != 0)
+                ret = -1;
+            process_release(shard, &handoff->process);
             /* LCOV_EXCL_END */
         }
+        else if(r != 0)
+        {
+            /* LCOV_EXCL_START : It is stopped, we are its tracer */
+            log_critical(tid, "couldn't resume handed-over process: %s",
+                         strerror(errno));
+            kill(tid, SIGKILL);
+            process_release(shard, &handoff->process);
+            ret = -1;
+            /* LCOV_EXCL_END */
+        }
+        else
+        {
+            struct Process *process = table_get_slot(&shard->table);
+            *process = handoff->process;
+            process->status = PROCSTAT_ATTACHED;
+            table_add(&shard->table, process);
+            threadgroup_link(process);
+            ptrace(trace_resume_request(process), tid, NULL, NULL);
+        }
+        free(handoff);
+    }
+    shard->inbox_count = 0;
+    pthread_mutex_unlock(&shard->inbox_lock);
 
-        if (tid == 0)
-            goto read;
+    if(__atomic_load_n(&trace_live, __ATOMIC_ACQUIRE) == 0)
+        shards_finish(0);
+    return ret;
+}
 
-        //printf("I am tracer. I found my child. His PID is [%d]\n", tid);
+void trace_start_process(struct Process *process)
+{
+    if(process->status == PROCSTAT_UNKNOWN)
+        shard_self->table.unknown--;
+    process->status = PROCSTAT_ATTACHED;
+    if(process->flags & PROCFLAG_MIGRATE)
+    {
+        struct Shard *target = shard_pick();
+        process->flags &= ~PROCFLAG_MIGRATE;
+        if(target != shard_self && shard_handoff(target, process) == 0)
+            return;
+    }
+    ptrace(trace_resume_request(process), process->tid, NULL, NULL);
+}
 
-        /*int index;
-        if ((index = vector_find(&workers, tid) != -1) {
-            vector_delete(&workers, index);
-            continue;
-        }*/
+/* Stops the shard's workers; must be called from its thread */
+static void shard_stop(struct Shard *shard)
+{
+    size_t i;
 
-        if(WIFEXITED(status) || WIFSIGNALED(status))
-        {
-            //printf("I am tracer. I am finalizing my child [%d]\n", tid);
-            int index = vector_find_tid(tid_worker_pipe_list, tid);
-            if (index == -1) {
-            //    printf("Invalid TID2\n");
-                exit(EXIT_FAILURE);
-            }
-            vpollfd_delete(&pollfds, index);
-            num_workers -= 1;
+    pthread_mutex_lock(&shard->inbox_lock);
+    shard->stopped = 1;
+    /* Only left over on error, they are not in any table */
+    for(i = 0; i < shard->inbox_count; ++i)
+    {
+        kill(shard->inbox[i]->process.tid, SIGKILL);
+        process_release(shard, &shard->inbox[i]->process);
+        free(shard->inbox[i]);
+    }
+    shard->inbox_count = 0;
+    pthread_mutex_unlock(&shard->inbox_lock);
 
+    workers_stop(shard->pool);
+    shard->pool = NULL;
+}
 
-            if (delete_tid_worker_pip(tid) == -1) {
-            //    printf("TID [%d] is invalid.\n", tid);
-                exit(EXIT_FAILURE);
-            }
 
-            unsigned int nprocs, unknown;
-            int exitcode;
-            if(WIFSIGNALED(status))
-                /* exit codes are 8 bits */
-                exitcode = 0x0100 | WTERMSIG(status);
-            else
-                exitcode = WEXITSTATUS(status);
+/* ********************
+ * Decoding syscall stops
+ *
+ * PTRACE_GET_SYSCALL_INFO (Linux 5.3) gives the arch, syscall number and
+ * arguments or return value in one small struct, and says whether this is the
+ * entry or the exit. Older kernels get the registers and rely on the
+ * in_syscall toggle.
+ *
+ * Both return 1 if the tracee was resumed already (entry of a syscall that only
+ * needs the exit), 0 if the stop goes to a worker.
+ */
+
+/* struct ptrace_syscall_info, not in older headers */
+struct syscall_info {
+    uint8_t op;
+    uint8_t pad[3];
+    uint32_t arch;
+    uint64_t instruction_pointer;
+    uint64_t stack_pointer;
+    union {
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+        } entry;
+        struct {
+            int64_t rval;
+            uint8_t is_error;
+        } exit;
+        struct {
+            uint64_t nr;
+            uint64_t args[6];
+            uint32_t ret_data;
+        } seccomp;
+    } u;
+};
 
-            if(tid == first_proc && first_exit_code != NULL)
-                *first_exit_code = exitcode;
-            process = trace_find_process(tid);
-            if(process != NULL)
-            {
-                int cpu_time_val = -1;
-                if(process->tid == process->threadgroup->tgid)
-                    cpu_time_val = cpu_time;
-                if(db_add_exit(process->identifier, exitcode,
-                               cpu_time_val) != 0)
-                    return -1;
-                trace_free_process(process);
-            }
-            trace_count_processes(&nprocs, &unknown);
-            if(verbosity >= 2)
-                log_info(tid, "process exited (%s %d), CPU time %.2f, "
-                         "%d processes remain",
-                         (exitcode & 0x0100)?"signal":"code", exitcode & 0xFF,
-                         cpu_time * 0.001f, (unsigned int)nprocs);
-            if(nprocs <= 0)
-                break;
-            if(unknown >= nprocs)
-            {
-                /* LCOV_EXCL_START : This can't happen because UNKNOWN
-                 * processes are the forked processes whose creator has not
-                 * returned yet. Therefore, if there is an UNKNOWN process, its
-                 * creator has to exist as well (and it is not UNKNOWN). */
-                log_critical(0, "only UNKNOWN processes remaining (%d)",
-                             (unsigned int)nprocs);
-                return -1;
-                /* LCOV_EXCL_END */
-            }
-            continue;
-        }
+#ifndef PTRACE_GET_SYSCALL_INFO
+#define PTRACE_GET_SYSCALL_INFO 0x420e
+#endif
+#define SYSCALL_INFO_ENTRY      1
+#define SYSCALL_INFO_EXIT       2
+#define SYSCALL_INFO_SECCOMP    3
 
-        process = trace_find_process(tid);
-        if(process == NULL)
+/* Cleared the first time the kernel rejects PTRACE_GET_SYSCALL_INFO */
+static int syscall_info_usable = 1;
+
+/* Returns -1 if the info is not available, use trace_syscall_regs() */
+static int trace_syscall_info(struct Process *process)
+{
+    pid_t tid = process->tid;
+    struct syscall_info info;
+    int i386;
+    size_t i;
+
+    if(!__atomic_load_n(&syscall_info_usable, __ATOMIC_RELAXED))
+        return -1;
+    if(ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void*)sizeof(info), &info) <= 0)
+    {
+        /* LCOV_EXCL_START : Linux < 5.3 */
+        if(errno == EIO)
+            __atomic_store_n(&syscall_info_usable, 0, __ATOMIC_RELAXED);
+        return -1;
+        /* LCOV_EXCL_END */
+    }
+
+#ifdef I386
+    i386 = 1;
+#else
+    i386 = (info.arch == AUDIT_ARCH_I386);
+#endif
+    /* Might still be either native x64 or Linux's x32 layer */
+    process->mode = i386?MODE_I386:MODE_X86_64;
+
+    if(info.op == SYSCALL_INFO_EXIT)
+    {
+        if(!process->in_syscall)
         {
-            if(verbosity >= 3)
-                log_debug(tid, "process appeared");
-            process = trace_get_empty_process();
-            process->status = PROCSTAT_UNKNOWN;
-            process->flags = 0;
-            process->tid = tid;
-            process->threadgroup = NULL;
-            process->in_syscall = 0;
-            trace_set_options(tid);
-            /* Don't resume, it will be set to ATTACHED and resumed when fork()
-             * returns */
-            continue;
+            /* LCOV_EXCL_START : Would have been an entry with the toggle */
+            log_error(tid, "syscall exit without an entry, ignoring");
+            ptrace(trace_resume_request(process), tid, NULL, NULL);
+            return 1;
+            /* LCOV_EXCL_END */
         }
-        else if(process->status == PROCSTAT_ALLOCATED)
-        {
-            process->status = PROCSTAT_ATTACHED;
+        if(i386)
+            get_i386_reg(&process->retvalue, (uint32_t)info.u.exit.rval);
+        else
+            get_x86_64_reg(&process->retvalue, (uint64_t)info.u.exit.rval);
+        return 0;
+    }
+    else if(info.op != SYSCALL_INFO_ENTRY && info.op != SYSCALL_INFO_SECCOMP)
+        return -1; /* LCOV_EXCL_LINE */
 
-            if(verbosity >= 3)
-                log_debug(tid, "process attached");
-            trace_set_options(tid);
-            ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
-            if(verbosity >= 2)
-            {
-                unsigned int nproc, unknown;
-                trace_count_processes(&nproc, &unknown);
-                log_info(0, "%d processes (inc. %d unattached)",
-                         nproc, unknown);
-            }
-            continue;
+    if(process->in_syscall)
+    {
+        /* LCOV_EXCL_START : Would have been an exit with the toggle */
+        log_error(tid, "syscall entry without an exit, ignoring syscall %d",
+                  process->current_syscall);
+        if(process->execve_info != NULL)
+        {
+            free_execve_info(process->execve_info);
+            process->execve_info = NULL;
         }
+        process->in_syscall = 0;
+        /* LCOV_EXCL_END */
+    }
 
-        if(WIFSTOPPED(status) && WSTOPSIG(status) & 0x80)
-        {
-            size_t len = 0;
+    /* Same layout for SYSCALL_INFO_SECCOMP */
+    process->current_syscall = (int)info.u.entry.nr;
+    for(i = 0; i < PROCESS_ARGS; ++i)
+    {
+        if(i386)
+            get_i386_reg(&process->params[i], (uint32_t)info.u.entry.args[i]);
+        else
+            get_x86_64_reg(&process->params[i], info.u.entry.args[i]);
+    }
+
+    if(info.op == SYSCALL_INFO_SECCOMP
+     && info.u.seccomp.ret_data == SYSCALL_FILTER_EXIT_ONLY)
+    {
+        /* Only the exit is handled, and we have the arguments already */
+        process->in_syscall = 1;
+        ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+        return 1;
+    }
+    return 0;
+}
+
+static int trace_syscall_regs(struct Process *process, int status)
+{
+    pid_t tid = process->tid;
+    size_t len = 0;
+    /* The arguments are still in the registers on exit */
+    const int entry = !process->in_syscall ||
+        (process->flags & PROCFLAG_EXIT_ONLY);
 #ifdef I386
-            struct i386_regs regs;
+    struct i386_regs regs;
 #else /* def X86_64 */
-            struct x86_64_regs regs;
+    struct x86_64_regs regs;
 #endif
-            /* Try to use GETREGSET first, since iov_len allows us to know if
-             * 32bit or 64bit mode was used */
+    /* Entry through the filter of a syscall that only needs the exit: skip
+     * it, the arguments are read on exit */
+    if(status >> 16 == PTRACE_EVENT_SECCOMP && !process->in_syscall)
+    {
+        unsigned long data = SYSCALL_FILTER_ENTRY;
+        ptrace(PTRACE_GETEVENTMSG, tid, NULL, &data);
+        if(data == SYSCALL_FILTER_EXIT_ONLY)
+        {
+            process->flags |= PROCFLAG_EXIT_ONLY;
+            process->in_syscall = 1;
+            ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+            return 1;
+        }
+    }
+
+    /* Try to use GETREGSET first, since iov_len allows us to know if
+     * 32bit or 64bit mode was used */
 #ifdef PTRACE_GETREGSET
 #ifndef NT_PRSTATUS
 #define NT_PRSTATUS  1
 #endif
-            {
-                struct iovec iov;
-                iov.iov_base = &regs;
-                iov.iov_len = sizeof(regs);
-                if(ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == 0)
-                    len = iov.iov_len;
-            }
-            if(len == 0)
+    {
+        struct iovec iov;
+        iov.iov_base = &regs;
+        iov.iov_len = sizeof(regs);
+        if(ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == 0)
+            len = iov.iov_len;
+    }
+    if(len == 0)
+#endif
+    /* GETREGSET undefined or call failed, fallback on GETREGS */
+    {
+        /* LCOV_EXCL_START : GETREGSET was added by Linux 2.6.34 in
+         * May 2010 (2225a122) */
+        ptrace(PTRACE_GETREGS, tid, NULL, &regs);
+        /* LCOV_EXCL_END */
+    }
+#if defined(I386)
+    if(entry)
+        process->current_syscall = regs.orig_eax;
+    if(process->in_syscall)
+        get_i386_reg(&process->retvalue, regs.eax);
+    if(entry)
+    {
+        get_i386_reg(&process->params[0], regs.ebx);
+        get_i386_reg(&process->params[1], regs.ecx);
+        get_i386_reg(&process->params[2], regs.edx);
+        get_i386_reg(&process->params[3], regs.esi);
+        get_i386_reg(&process->params[4], regs.edi);
+        get_i386_reg(&process->params[5], regs.ebp);
+    }
+    process->mode = MODE_I386;
+#elif defined(X86_64)
+    /* On x86_64, process might be 32 or 64 bits */
+    /* If len is known (not 0) and not that of x86_64 registers,
+     * or if len is not known (0) and CS is 0x23 (not as reliable) */
+    if( (len != 0 && len != sizeof(regs))
+     || (len == 0 && regs.cs == 0x23) )
+    {
+        /* 32 bit mode */
+        struct i386_regs *x86regs = (struct i386_regs*)&regs;
+        if(entry)
+            process->current_syscall = x86regs->orig_eax;
+        if(process->in_syscall)
+            get_i386_reg(&process->retvalue, x86regs->eax);
+        if(entry)
+        {
+            get_i386_reg(&process->params[0], x86regs->ebx);
+            get_i386_reg(&process->params[1], x86regs->ecx);
+            get_i386_reg(&process->params[2], x86regs->edx);
+            get_i386_reg(&process->params[3], x86regs->esi);
+            get_i386_reg(&process->params[4], x86regs->edi);
+            get_i386_reg(&process->params[5], x86regs->ebp);
+        }
+        process->mode = MODE_I386;
+    }
+    else
+    {
+        /* 64 bit mode */
+        if(entry)
+            process->current_syscall = regs.orig_rax;
+        if(process->in_syscall)
+            get_x86_64_reg(&process->retvalue, regs.rax);
+        if(entry)
+        {
+            get_x86_64_reg(&process->params[0], regs.rdi);
+            get_x86_64_reg(&process->params[1], regs.rsi);
+            get_x86_64_reg(&process->params[2], regs.rdx);
+            get_x86_64_reg(&process->params[3], regs.r10);
+            get_x86_64_reg(&process->params[4], regs.r8);
+            get_x86_64_reg(&process->params[5], regs.r9);
+        }
+        /* Might still be either native x64 or Linux's x32 layer */
+        process->mode = MODE_X86_64;
+    }
 #endif
-            /* GETREGSET undefined or call failed, fallback on GETREGS */
+    process->flags &= ~PROCFLAG_EXIT_ONLY;
+    return 0;
+}
+
+/* Handles one status returned by wait() */
+static int trace_handle(pid_t tid, int status, int cpu_time,
+                        pid_t first_proc, int *first_exit_code)
+{
+    struct Process *process;
+
+    if(WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        unsigned int nprocs, unknown, live;
+        int exitcode;
+        if(WIFSIGNALED(status))
+            /* exit codes are 8 bits */
+            exitcode = 0x0100 | WTERMSIG(status);
+        else
+            exitcode = WEXITSTATUS(status);
+
+        if(tid == first_proc && first_exit_code != NULL)
+            *first_exit_code = exitcode;
+        process = trace_find_process(tid);
+        if(process != NULL)
+        {
+            int cpu_time_val = -1;
+            if(process->tid == process->threadgroup->tgid)
+                cpu_time_val = cpu_time;
+            if(db_add_exit(process->identifier, exitcode,
+                           cpu_time_val) != 0)
+                return -1;
+            trace_free_process(process);
+        }
+        trace_count_processes(&nprocs, &unknown);
+        live = __atomic_load_n(&trace_live, __ATOMIC_ACQUIRE);
+        if(verbosity >= 2)
+            log_info(tid, "process exited (%s %d), CPU time %.2f, "
+                     "%d processes remain",
+                     (exitcode & 0x0100)?"signal":"code", exitcode & 0xFF,
+                     cpu_time * 0.001f, live);
+        if(live == 0)
+            shards_finish(0);
+        if(nprocs > 0 && unknown >= nprocs)
+        {
+            /* LCOV_EXCL_START : This can't happen because UNKNOWN
+             * processes are the forked processes whose creator has not
+             * returned yet. Therefore, if there is an UNKNOWN process, its
+             * creator has to exist as well (and it is not UNKNOWN). */
+            log_critical(0, "only UNKNOWN processes remaining (%d)",
+                         (unsigned int)nprocs);
+            return -1;
+            /* LCOV_EXCL_END */
+        }
+        return 0;
+    }
+
+    process = trace_find_process(tid);
+    if(process == NULL)
+    {
+        if(verbosity >= 3)
+            log_debug(tid, "process appeared");
+        process = trace_get_empty_process(tid, PROCSTAT_UNKNOWN);
+        trace_set_options(tid);
+        /* Don't resume, it will be set to ATTACHED and resumed when fork()
+         * returns */
+        return 0;
+    }
+    else if(process->status == PROCSTAT_ALLOCATED)
+    {
+        if(verbosity >= 3)
+            log_debug(tid, "process attached");
+        trace_set_options(tid);
+        trace_start_process(process);
+        if(verbosity >= 2)
+        {
+            unsigned int nproc, unknown;
+            trace_count_processes(&nproc, &unknown);
+            log_info(0, "%d processes (inc. %d unattached)",
+                     nproc, unknown);
+        }
+        return 0;
+    }
+
+    /* Syscall stop, or syscall entry that stopped because of the filter */
+    if( (WIFSTOPPED(status) && WSTOPSIG(status) & 0x80)
+     || (status >> 16 == PTRACE_EVENT_SECCOMP && !process->in_syscall) )
+    {
+        int r = trace_syscall_info(process);
+        if(r < 0)
+            r = trace_syscall_regs(process, status);
+        if(r == 0)
+            workers_dispatch(shard_self->pool, process);
+    }
+    /* Handle signals */
+    else if(WIFSTOPPED(status))
+    {
+        int signum = WSTOPSIG(status) & 0x7F;
+
+        /* Synthetic signal for ptrace event: resume */
+        if(signum == SIGTRAP && status & 0xFF0000)
+        {
+            int event = status >> 16;
+            if(event == PTRACE_EVENT_EXEC)
             {
-                /* LCOV_EXCL_START : GETREGSET was added by Linux 2.6.34 in
-                 * May 2010 (2225a122) */
-                ptrace(PTRACE_GETREGS, tid, NULL, &regs);
-                /* LCOV_EXCL_END */
+                log_debug(tid,
+                         "got EVENT_EXEC, an execve() was successful and "
+                         "will return soon");
+                //printf("Process has value [%p]\n", process);
+                if(syscall_execve_event(process) != 0)
+                    return -1;
             }
-#if defined(I386)
-            if(!process->in_syscall)
-                process->current_syscall = regs.orig_eax;
-            if(process->in_syscall)
-                get_i386_reg(&process->retvalue, regs.eax);
-            else
+            else if( (event == PTRACE_EVENT_FORK)
+                  || (event == PTRACE_EVENT_VFORK)
+                  || (event == PTRACE_EVENT_CLONE))
             {
-                get_i386_reg(&process->params[0], regs.ebx);
-                get_i386_reg(&process->params[1], regs.ecx);
-                get_i386_reg(&process->params[2], regs.edx);
-                get_i386_reg(&process->params[3], regs.esi);
-                get_i386_reg(&process->params[4], regs.edi);
-                get_i386_reg(&process->params[5], regs.ebp);
+                if(syscall_fork_event(process, event) != 0)
+                    return -1;
             }
-            process->mode = MODE_I386;
-#elif defined(X86_64)
-            /* On x86_64, process might be 32 or 64 bits */
-            /* If len is known (not 0) and not that of x86_64 registers,
-             * or if len is not known (0) and CS is 0x23 (not as reliable) */
-            if( (len != 0 && len != sizeof(regs))
-             || (len == 0 && regs.cs == 0x23) )
+            else if(event == PTRACE_EVENT_SECCOMP)
             {
-                /* 32 bit mode */
-                struct i386_regs *x86regs = (struct i386_regs*)&regs;
-                if(!process->in_syscall)
-                    process->current_syscall = x86regs->orig_eax;
-                if(process->in_syscall)
-                    get_i386_reg(&process->retvalue, x86regs->eax);
-                else
-                {
-                    get_i386_reg(&process->params[0], x86regs->ebx);
-                    get_i386_reg(&process->params[1], x86regs->ecx);
-                    get_i386_reg(&process->params[2], x86regs->edx);
-                    get_i386_reg(&process->params[3], x86regs->esi);
-                    get_i386_reg(&process->params[4], x86regs->edi);
-                    get_i386_reg(&process->params[5], x86regs->ebp);
-                }
-                process->mode = MODE_I386;
+                /* Right after the syscall-entry stop: the filter is in place,
+                 * from now on we only resume to the next syscall if needed */
+                if(!trace_seccomp && verbosity >= 2)
+                    log_info(tid, "seccomp filter installed");
+                trace_seccomp = 1;
             }
+            ptrace(trace_resume_request(process), tid, NULL, NULL);
+        }
+        else if(signum == SIGTRAP)
+        {
+            /* LCOV_EXCL_START : Processes shouldn't be getting SIGTRAPs */
+            log_error(0,
+                      "NOT delivering SIGTRAP to %d\n"
+                      "    waitstatus=0x%X", tid, status);
+            ptrace(trace_resume_request(process), tid, NULL, NULL);
+            /* LCOV_EXCL_END */
+        }
+        else if(status >> 16 == PTRACE_EVENT_STOP)
+        {
+            /* Group-stop of a process attached with PTRACE_SEIZE (handed
+             * over by another shard): keep it stopped until SIGCONT */
+            ptrace(PTRACE_LISTEN, tid, NULL, NULL);
+        }
+        /* Other signal, let the process handle it */
+        else
+        {
+            siginfo_t si;
+            if(verbosity >= 2)
+                log_info(tid, "caught signal %d", signum);
+            if(ptrace(PTRACE_GETSIGINFO, tid, 0, (long)&si) >= 0)
+                ptrace(trace_resume_request(process), tid, NULL, signum);
             else
             {
-                /* 64 bit mode */
-                if(!process->in_syscall)
-                    process->current_syscall = regs.orig_rax;
-                if(process->in_syscall)
-                    get_x86_64_reg(&process->retvalue, regs.rax);
-                else
-                {
-                    get_x86_64_reg(&process->params[0], regs.rdi);
-                    get_x86_64_reg(&process->params[1], regs.rsi);
-                    get_x86_64_reg(&process->params[2], regs.rdx);
-                    get_x86_64_reg(&process->params[3], regs.r10);
-                    get_x86_64_reg(&process->params[4], regs.r8);
-                    get_x86_64_reg(&process->params[5], regs.r9);
-                }
-                /* Might still be either native x64 or Linux's x32 layer */
-                process->mode = MODE_X86_64;
-            }
-#endif
-            //printf("I am tracer. I am before worker pipe write.\n");
-            int worker_pipe_write = get_worker_pipe_write(tid);
-            //printf("Wroker pipe write = [%d]\n", worker_pipe_write);
-            if (worker_pipe_write == -1) {
-                //printf("I am tracer. I am creating a worker for my child [%d]\n", tid);
-                pthread_t worker;
-                int worker_pipe[4];
-                if (pipe(&worker_pipe[0]) == -1) {
-                    perror("pipe1");
-                    exit(EXIT_FAILURE);
-                }
-                if (pipe(&worker_pipe[2]) == -1) {
-                    perror("pipe2");
-                    exit(EXIT_FAILURE);
-                }
-                worker_arg *argument = (worker_arg *)malloc(sizeof(worker_arg));
-                for (int i = 0; i < 4; i++) {
-                    argument->fd[i] = worker_pipe[i];
-                    //printf("worker_pipe[%d] = %d\n", i, worker_pipe[i]);
-                }
-                worker_pipe_write = worker_pipe[3];
-
-                add_tid_worker_pipe(tid, worker_pipe);
-
-                num_workers += 1;
-
-                struct pollfd cur_pollfd;
-                cur_pollfd.fd = worker_pipe[0];
-                cur_pollfd.events = POLLIN | POLLPRI;
-                vpollfd_add(&pollfds, cur_pollfd);
-
-                pthread_create(&worker, NULL, syscall_handle, argument);
-
-                //printf("I am tracer. I finished creating a worker for my child [%d]\n", tid);
-                //pthread_detach(worker);
+                /* LCOV_EXCL_START : Not sure what this is for... doesn't
+                 * seem to happen in practice */
+                log_error(tid, "    NOT delivering: %s", strerror(errno));
+                if(signum != SIGSTOP)
+                    ptrace(trace_resume_request(process), tid, NULL, NULL);
+                /* LCOV_EXCL_END */
             }
+        }
+    }
 
-            //printf("I am parent. I am writing to fd [%d]\n", worker_pipe_write);
-            //ssize_t len1 = write(worker_pipe_write, process, sizeof(struct Process));
-            ssize_t len1 = write(worker_pipe_write, &process, sizeof(struct Process *));
-            if (len1 == -1) {
-            //    printf("Parent write failed.\n");
-                exit(EXIT_FAILURE);
-            } else {
-            //    printf("I am parent. I have written [%d] bytes. The size of Process is [%d] bytes.\n", (int)len1, (int)sizeof(struct Process));
-            }
-            //if(syscall_handle(process) != 0)
-            //    return -1;
+    return 0;
+}
+
+/* Upper bound on the time spent asleep, in case a SIGCHLD doesn't reach the
+ * signalfd (e.g. it was delivered to a thread that doesn't block it) */
+#define TRACE_WAIT_TIMEOUT 100
+
+/* Reads all the pending SIGCHLD off the signalfd */
+static void trace_clear_sigchld(int sigfd)
+{
+    struct signalfd_siginfo si;
+    while(read(sigfd, &si, sizeof(si)) == sizeof(si))
+        continue;
+}
+
+static int trace(pid_t first_proc, int *first_exit_code)
+{
+    struct WorkerPool *pool = shard_self->pool;
+    int sigfd, epfd;
+    int ret = -1;
+
+    {
+        sigset_t sigchld;
+        struct epoll_event ev;
+        sigemptyset(&sigchld);
+        sigaddset(&sigchld, SIGCHLD);
+        sigfd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if(sigfd == -1 || epfd == -1)
+        {
+            /* LCOV_EXCL_START : Only fails on resource exhaustion */
+            log_critical(0, "couldn't set up the event loop: %s",
+                         strerror(errno));
+            goto done;
+            /* LCOV_EXCL_END */
         }
-        /* Handle signals */
-        else if(WIFSTOPPED(status))
+        ev.events = EPOLLIN;
+        ev.data.fd = sigfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+        ev.data.fd = workers_fd(pool);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    }
+
+    for(;;)
+    {
+        int handled = 0;
+        int served;
+
+        /* Handle all the pending statuses in a row */
+        while(!__atomic_load_n(&shards_done, __ATOMIC_ACQUIRE))
         {
-            int signum = WSTOPSIG(status) & 0x7F;
+            int status;
+            pid_t tid;
+            int cpu_time;
 
-            /* Synthetic signal for ptrace event: resume */
-            if(signum == SIGTRAP && status & 0xFF0000)
+#if NO_WAIT3
+            tid = waitpid(-1, &status, __WALL | __WNOTHREAD | WNOHANG);
+            cpu_time = -1;
+#else
             {
-                int event = status >> 16;
-                if(event == PTRACE_EVENT_EXEC)
-                {
-                    log_debug(tid,
-                             "got EVENT_EXEC, an execve() was successful and "
-                             "will return soon");
-                    //printf("Process has value [%p]\n", process);
-                    if(syscall_execve_event(process) != 0)
-                        return -1;
-                }
-                else if( (event == PTRACE_EVENT_FORK)
-                      || (event == PTRACE_EVENT_VFORK)
-                      || (event == PTRACE_EVENT_CLONE))
-                {
-                    if(syscall_fork_event(process, event) != 0)
-                        return -1;
-                }
-                ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+                struct rusage res;
+                tid = wait3(&status, __WALL | __WNOTHREAD | WNOHANG, &res);
+                cpu_time = (res.ru_utime.tv_sec * 1000 +
+                            res.ru_utime.tv_usec / 1000);
             }
-            else if(signum == SIGTRAP)
+#endif
+            if(tid == -1 && errno == ECHILD && shards_count > 1)
+                /* This shard has no tracee right now */
+                tid = 0;
+            if(tid == -1)
             {
-                /* LCOV_EXCL_START : Processes shouldn't be getting SIGTRAPs */
-                log_error(0,
-                          "NOT delivering SIGTRAP to %d\n"
-                          "    waitstatus=0x%X", tid, status);
-                ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
+                /* LCOV_EXCL_START : internal error: waitpid() won't fail
+                 * unless we mistakingly call it while there is no child to
+                 * wait for */
+                log_critical(0, "waitpid failed: %s", strerror(errno));
+                goto done;
                 /* LCOV_EXCL_END */
             }
-            /* Other signal, let the process handle it */
-            else
+            if(tid == 0)
+                break;
+
+            if(trace_handle(tid, status, cpu_time,
+                            first_proc, first_exit_code) != 0)
+                goto done;
+            ++handled;
+            /* Don't keep the workers waiting on a long batch */
+            if(workers_serve(pool) < 0)
+                goto done;
+        }
+
+        if(shard_adopt() != 0)
+            goto done;
+        if(__atomic_load_n(&shards_done, __ATOMIC_ACQUIRE))
+            break;
+        served = workers_serve(pool);
+        if(served < 0)
+            goto done;
+        if(handled > 0 || served > 0)
+            continue;
+
+        /* Nothing to do: sleep until a tracee changes state, a worker sends a
+         * request, or another shard wakes us up */
+        if(workers_prepare_wait(pool))
+        {
+            struct epoll_event events[2];
+            int n, i;
+            n = epoll_wait(epfd, events, 2, TRACE_WAIT_TIMEOUT);
+            workers_end_wait(pool);
+            if(n == -1 && errno != EINTR)
             {
-                siginfo_t si;
-                if(verbosity >= 2)
-                    log_info(tid, "caught signal %d", signum);
-                if(ptrace(PTRACE_GETSIGINFO, tid, 0, (long)&si) >= 0)
-                    ptrace(PTRACE_SYSCALL, tid, NULL, signum);
-                else
-                {
-                    /* LCOV_EXCL_START : Not sure what this is for... doesn't
-                     * seem to happen in practice */
-                    log_error(tid, "    NOT delivering: %s", strerror(errno));
-                    if(signum != SIGSTOP)
-                        ptrace(PTRACE_SYSCALL, tid, NULL, NULL);
-                    /* LCOV_EXCL_END */
-                }
+                /* LCOV_EXCL_START : epoll_wait() doesn't fail */
+                log_critical(0, "epoll_wait failed: %s", strerror(errno));
+                goto done;
+                /* LCOV_EXCL_END */
+            }
+            for(i = 0; i < n; ++i)
+            {
+                if(events[i].data.fd != sigfd)
+                    continue;
+                trace_clear_sigchld(sigfd);
+                /* SIGCHLD is sent to the process, not to the thread that is
+                 * the tracer, which might be asleep */
+                if(shards_count > 1)
+                    shards_wakeup();
             }
         }
+    }
+    ret = 0;
+
+done:
+    if(epfd != -1)
+        close(epfd);
+    if(sigfd != -1)
+        close(sigfd);
+    return ret;
+}
 
+static void *shard_main(void *arg)
+{
+    struct Shard *shard = arg;
+    shard_self = shard;
+    if(trace(0, NULL) != 0)
+        shards_finish(1);
+    shard_stop(shard);
+    return NULL;
+}
 
-read: ;
-        //printf("I am tracer. I am polling.\n");
-        struct pollfd *pollfds_items = vpollfd_items(&pollfds);
-        int num_ready = poll(pollfds_items, num_workers, 50);
-        //printf("I am tracer. I finished polling. Polling resul: [%d]\n", num_ready);
-        if (num_ready == 0)
-            continue;
-        if (num_ready == -1) {
-            perror("Poll");
-            exit(1);
+static void shards_init(void)
+{
+    unsigned int i;
+    shards_count = (trace_shards > 1)?trace_shards:1;
+    shards = malloc(shards_count * sizeof(*shards));
+    for(i = 0; i < shards_count; ++i)
+    {
+        struct Shard *shard = &shards[i];
+        shard->index = i;
+        shard->pool = NULL;
+        shard->load = 0;
+        table_init(&shard->table);
+        pthread_mutex_init(&shard->inbox_lock, NULL);
+        shard->inbox = NULL;
+        shard->inbox_count = 0;
+        shard->inbox_capacity = 0;
+        shard->stopped = 0;
+    }
+    shards_started = 1;
+    shard_self = &shards[0];
+    trace_live = 0;
+    shards_done = 0;
+    shards_failed = 0;
+}
+
+static void shards_join(void)
+{
+    unsigned int i;
+    for(i = 1; i < shards_started; ++i)
+        pthread_join(shards[i].thread, NULL);
+    shards_started = 1;
+}
+
+/* Starts the worker pools, and the threads of shards other than this one */
+static int shards_start(void)
+{
+    unsigned int nb_workers = trace_workers;
+    unsigned int i;
+
+    /* Split the workers between the shards */
+    if(shards_count > 1)
+    {
+        if(nb_workers == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            nb_workers = (cpus > 0)?(unsigned int)cpus:1;
         }
+        nb_workers /= shards_count;
+        if(nb_workers == 0)
+            nb_workers = 1;
+    }
 
-        for (int i = 0; i < num_workers; i++) {
-            if (pollfds_items[i].revents & POLLIN || pollfds_items[i].revents & POLLPRI) {
-                int num_bytes_ready;
-                if (ioctl(pollfds_items[i].fd, FIONREAD, &num_bytes_ready) < 0) {
-                    perror("ioctl");
-                    exit(1);
-                }
-                //printf("[%d] bytes are available.\n", num_bytes_ready);
-
-                int request;
-                pid_t tid;
-                void *addr;
-                void *data;
-
-                ssize_t len1 = read(pollfds_items[i].fd, &request, sizeof(request));
-                //printf("Request: [%d]\n", request);
-                ssize_t len2 = read(pollfds_items[i].fd, &tid, sizeof(tid));
-                //printf("TID: [%d]\n", tid);
-                ssize_t len3 = read(pollfds_items[i].fd, &addr, sizeof(addr));
-                //printf("ADDR: [%p]\n", addr);
-                ssize_t len4 = read(pollfds_items[i].fd, &data, sizeof(data));
-                //printf("DATA: [%p]\n", data);
-                //printf("Read length: [%d], [%d], [%d], [%d]\n", (int)len1, (int)len2, (int)len3, (int)len4);
-
-
-                //if (request == PTRACE_SYSCALL) {
-                    //printf("Before letting child go.\n");
-                //}
-
-                errno = 0;
-                long res = ptrace(request, tid, addr, data);
-
-                //if (request == PTRACE_SYSCALL) {
-                    //printf("After letting child go.\n");
-                //}
-
-                //printf("Ptrace result [%ld]\n", res);
-                if (res == -1) {
-                    perror("ptrace");
-                }
-
-
-                int writefd = get_worker_pipe_write(tid);
-                ssize_t len5 = write(writefd, &res, sizeof(res));
-                (void)len5;
-            }
+    for(i = 0; i < shards_count; ++i)
+    {
+        if((shards[i].pool = workers_start(nb_workers)) == NULL)
+        {
+            /* LCOV_EXCL_START : Only fails on resource exhaustion */
+            while(i > 0)
+                shard_stop(&shards[--i]);
+            return -1;
+            /* LCOV_EXCL_END */
         }
-        
+    }
 
+    for(i = 1; i < shards_count; ++i)
+    {
+        if((errno = pthread_create(&shards[i].thread, NULL,
+                                   shard_main, &shards[i])) != 0)
+        {
+            /* LCOV_EXCL_START : Only fails on resource exhaustion */
+            log_critical(0, "couldn't start tracer threads: %s",
+                         strerror(errno));
+            shards_finish(1);
+            shard_stop(&shards[0]);
+            for(; i < shards_count; ++i)
+                shard_stop(&shards[i]);
+            shards_join();
+            return -1;
+            /* LCOV_EXCL_END */
+        }
+        shards_started++;
     }
 
+    if(shards_count > 1 && verbosity >= 2)
+        log_info(0, "started %u tracer threads", shards_count);
     return 0;
 }
 
+static void shards_free(void)
+{
+    unsigned int i;
+    for(i = 0; i < shards_count; ++i)
+    {
+        table_free(&shards[i].table);
+        pthread_mutex_destroy(&shards[i].inbox_lock);
+        free(shards[i].inbox);
+    }
+    free(shards);
+    shards = NULL;
+    shards_count = 0;
+    shard_self = NULL;
+}
+
 static void (*python_sigchld_handler)(int) = NULL;
 static void (*python_sigint_handler)(int) = NULL;
+static sigset_t saved_sigmask;
+static int sigmask_saved = 0;
 
 static void restore_signals(void)
 {
+    if(sigmask_saved)
+    {
+        /* Discard the SIGCHLD of our tracees, Python's handler didn't get them
+         * before either */
+        sigset_t sigchld;
+        struct timespec zero = {0, 0};
+        sigemptyset(&sigchld);
+        sigaddset(&sigchld, SIGCHLD);
+        while(sigtimedwait(&sigchld, NULL, &zero) == SIGCHLD)
+            continue;
+        pthread_sigmask(SIG_SETMASK, &saved_sigmask, NULL);
+        sigmask_saved = 0;
+    }
     if(python_sigchld_handler != NULL)
     {
         signal(SIGCHLD, python_sigchld_handler);
@@ -785,22 +1520,29 @@ static void restore_signals(void)
 
 static void cleanup(void)
 {
+    unsigned int s;
     size_t i;
+    if(shards == NULL)
+        return;
     {
         size_t nb = 0;
-        for(i = 0; i < processes_size; ++i)
-            if(processes[i]->status != PROCSTAT_FREE)
-                ++nb;
+        for(s = 0; s < shards_count; ++s)
+            nb += shards[s].table.count;
         /* size_t size is implementation dependent; %u for size_t can trigger
          * a warning */
         log_error(0, "cleaning up, %u processes to kill...", (unsigned int)nb);
     }
-    for(i = 0; i < processes_size; ++i)
+    for(s = 0; s < shards_count; ++s)
     {
-        if(processes[i]->status != PROCSTAT_FREE)
+        /* The tables are freed afterwards, only release the processes */
+        for(i = 0; i < shards[s].table.size; ++i)
         {
-            kill(processes[i]->tid, SIGKILL);
-            trace_free_process(processes[i]);
+            struct Process *process = shards[s].table.slots[i];
+            if(process->status != PROCSTAT_FREE)
+            {
+                kill(process->tid, SIGKILL);
+                process_release(&shards[s], process);
+            }
         }
     }
 }
@@ -830,25 +1572,21 @@ static void trace_init(void)
     python_sigchld_handler = signal(SIGCHLD, SIG_DFL);
     python_sigint_handler = signal(SIGINT, sigint_handler);
 
-    if(processes == NULL)
+    trace_seccomp = 0;
+
+    /* SIGCHLD is read from a signalfd by trace(); the threads started from
+     * now on inherit the mask */
     {
-        size_t i;
-        struct Process *pool;
-        processes_size = 16;
-        processes = malloc(processes_size * sizeof(*processes));
-        pool = malloc(processes_size * sizeof(*pool));
-        for(i = 0; i < processes_size; ++i)
-        {
-            processes[i] = pool++;
-            processes[i]->status = PROCSTAT_FREE;
-            processes[i]->threadgroup = NULL;
-            processes[i]->execve_info = NULL;
-        }
+        sigset_t sigchld;
+        sigemptyset(&sigchld);
+        sigaddset(&sigchld, SIGCHLD);
+        pthread_sigmask(SIG_BLOCK, &sigchld, &saved_sigmask);
+        sigmask_saved = 1;
     }
 
+    shards_init();
+
     syscall_build_table();
-    tid_worker_pipe_list = (vector *)malloc(sizeof(vector));
-    vector_init(tid_worker_pipe_list);
 }
 
 int fork_and_trace(const char *binary, int argc, char **argv,
@@ -882,9 +1620,13 @@ int fork_and_trace(const char *binary, int argc, char **argv,
                 strerror(errno));
             exit(1);
         }
+        pthread_sigmask(SIG_SETMASK, &saved_sigmask, NULL);
         /* Stop this once so tracer can set options */
         //printf("Hey! I am tracee. I am right before kill.\n");
         kill(getpid(), SIGSTOP);
+        /* Options are set, only stop on the syscalls we handle. If this
+         * fails, we get all of them as usual */
+        syscall_install_filter();
         /* Execute the target */
         //printf("Hey! I am tracee. I am right before exec.\n");
         execvp(binary, args);
@@ -900,6 +1642,7 @@ int fork_and_trace(const char *binary, int argc, char **argv,
         strcat(logfilename, "/.reprozip/log");
         if(log_open_file(logfilename) != 0)
         {
+            shards_free();
             restore_signals();
             return 1;
         }
@@ -908,6 +1651,7 @@ int fork_and_trace(const char *binary, int argc, char **argv,
     if(db_init(database_path) != 0)
     {
         kill(child, SIGKILL);
+        shards_free();
         log_close_file();
         restore_signals();
         return 1;
@@ -915,24 +1659,23 @@ int fork_and_trace(const char *binary, int argc, char **argv,
 
     /* Creates entry for first process */
     {
-        struct Process *process = trace_get_empty_process();
-        process->status = PROCSTAT_ALLOCATED; /* Not yet attached... */
-        process->flags = 0;
-        /* We sent a SIGSTOP, but we resume on attach */
-        process->tid = child;
-        process->threadgroup = trace_new_threadgroup(child, get_wd());
-        process->in_syscall = 0;
+        /* Not yet attached... We sent a SIGSTOP, but we resume on attach */
+        struct Process *process = trace_get_empty_process(child,
+                                                          PROCSTAT_ALLOCATED);
+        trace_join_threadgroup(process, trace_new_threadgroup(child,
+                                                              get_wd()));
 
         if(verbosity >= 2)
             log_info(0, "process %d created by initial fork()", child);
         if( (db_add_first_process(&process->identifier,
                                   process->threadgroup->wd) != 0)
          || (db_add_file_open(process->identifier, process->threadgroup->wd,
-                              FILE_WDIR, 1) != 0) )
+                              FILE_WDIR, 1, db_timestamp()) != 0) )
         {
             /* LCOV_EXCL_START : Database insertion shouldn't fail */
             db_close(1);
             cleanup();
+            shards_free();
             log_close_file();
             restore_signals();
             return 1;
@@ -940,15 +1683,35 @@ int fork_and_trace(const char *binary, int argc, char **argv,
         }
     }
 
+    if(shards_start() != 0)
+    {
+        /* LCOV_EXCL_START : Only fails on resource exhaustion */
+        db_close(1);
+        cleanup();
+        shards_free();
+        log_close_file();
+        restore_signals();
+        return 1;
+        /* LCOV_EXCL_END */
+    }
+
     if(trace(child, exit_status) != 0)
+        shards_finish(1);
+    shard_stop(shard_self);
+    shards_join();
+
+    if(shards_failed)
     {
         cleanup();
+        shards_free();
         db_close(1);
         log_close_file();
         restore_signals();
         return 1;
     }
 
+    shards_free();
+
     if(db_close(0) != 0)
     {
         log_close_file();
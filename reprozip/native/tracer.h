@@ -3,16 +3,15 @@
 
 #include "config.h"
 
-typedef struct {
-    int fd[4];
-} worker_arg;
-
 
 int fork_and_trace(const char *binary, int argc, char **argv,
                    const char *database_path, int *exit_status);
 
 
 extern int trace_verbosity;
+extern int trace_negative_lookups;
+extern unsigned int trace_workers;
+extern unsigned int trace_shards;
 
 
 /* This is NOT a union because sign-extension rules depend on actual register
@@ -38,6 +37,7 @@ struct ThreadGroup {
     pid_t tgid;
     char *wd;
     unsigned int refs;
+    struct Process *members;    /* linked through tg_next */
 };
 
 struct Process {
@@ -52,6 +52,9 @@ struct Process {
     register_type retvalue;
     register_type params[PROCESS_ARGS];
     struct ExecveInfo *execve_info;
+
+    struct Process *tg_prev, *tg_next;  /* members of threadgroup */
+    struct Process *next_free;          /* free slots of the table */
 };
 
 #define PROCSTAT_FREE       0   /* unallocated entry in table */
@@ -67,20 +70,43 @@ struct Process {
 #define PROCFLAG_EXECD      1   /* Process is coming out of execve */
 #define PROCFLAG_FORKING    2   /* Process is spawning another with
                                  * fork/vfork/clone */
-
-/* FIXME : This is only exposed because of execve() workaround */
-extern struct Process **processes;
-extern size_t processes_size;
+#define PROCFLAG_MIGRATE    4   /* New process, might be handed over to
+                                 * another tracer thread once attached */
+#define PROCFLAG_EXIT_ONLY  8   /* In a syscall whose entry was skipped, the
+                                 * arguments are read on exit */
 
 
+/* Each tracer thread has its own process table, see trace_shards */
 struct Process *trace_find_process(pid_t tid);
 
-struct Process *trace_get_empty_process(void);
+/**
+ * Allocates a process in the table, with no threadgroup yet.
+ */
+struct Process *trace_get_empty_process(pid_t tid, int status);
 
 struct ThreadGroup *trace_new_threadgroup(pid_t tgid, char *wd);
 
+/**
+ * Makes the process a member of the threadgroup, taking a reference.
+ */
+void trace_join_threadgroup(struct Process *process,
+                            struct ThreadGroup *threadgroup);
+
 void trace_free_process(struct Process *process);
 
+/**
+ * Resumes a process that was just attached and whose creation was seen.
+ *
+ * It might instead be handed over to another tracer thread.
+ */
+void trace_start_process(struct Process *process);
+
+/**
+ * The ptrace() request that resumes a process: PTRACE_SYSCALL, or PTRACE_CONT
+ * if the seccomp filter stops it on the next syscall we handle.
+ */
+int trace_resume_request(const struct Process *process);
+
 void trace_count_processes(unsigned int *p_nproc, unsigned int *p_unknown);
 
 int trace_add_files_from_proc(unsigned int process, pid_t tid,
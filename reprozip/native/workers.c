@@ -0,0 +1,381 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "log.h"
+#include "ptrace_utils.h"
+#include "rpc.h"
+#include "syscalls.h"
+#include "tracer.h"
+#include "workers.h"
+
+
+#define verbosity trace_verbosity
+
+
+/* ********************
+ * Worker pool
+ *
+ * Syscall stops are handled by a fixed number of threads. Each worker has its
+ * own queue, and stops are dispatched by hashing the tid, so a given thread is
+ * usually handled by the same worker (which keeps its /proc/<tid>/mem open and
+ * its cached pages). A worker that runs out of work takes jobs from the other
+ * queues.
+ *
+ * There is no ordering to enforce between jobs: a tracee stays stopped until
+ * its job resumes it, so there is never more than one job per tid. A job
+ * writes its records after resuming the tracee, but those don't use the
+ * Process (see records_flush()).
+ *
+ * Each worker has a channel to send its ptrace() requests to the tracer
+ * thread, see tracee_ptrace() and rpc.c.
+ */
+
+/* The handlers use a lot of PATH_MAX buffers */
+#define WORKER_STACK_SIZE (16 * 1024 * 1024)
+
+struct WorkerPool;
+
+struct Worker {
+    struct RpcChannel channel;
+    pthread_t thread;
+    struct WorkerPool *pool;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct Process **jobs;  /* circular buffer */
+    size_t jobs_head;
+    size_t jobs_count;
+    size_t jobs_capacity;
+    int sleeping;   /* set under lock, peeked at by workers_dispatch() */
+};
+
+/* One pool per tracer thread: workers can only have their requests served by
+ * the thread that is the tracer of their tracees */
+struct WorkerPool {
+    struct Worker *workers;
+    unsigned int count;
+    struct RpcServer server;
+
+    /* Read and written with __atomic builtins */
+    int stopping;
+    int failed;
+
+    pthread_mutex_t running_lock;
+    unsigned int running;
+};
+
+/* Called with worker->lock held */
+static void queue_push(struct Worker *worker, struct Process *process)
+{
+    if(worker->jobs_count == worker->jobs_capacity)
+    {
+        size_t i;
+        size_t new_capacity = worker->jobs_capacity * 2;
+        struct Process **jobs = malloc(new_capacity * sizeof(*jobs));
+        for(i = 0; i < worker->jobs_count; ++i)
+            jobs[i] = worker->jobs[(worker->jobs_head + i) %
+                                   worker->jobs_capacity];
+        free(worker->jobs);
+        worker->jobs = jobs;
+        worker->jobs_head = 0;
+        worker->jobs_capacity = new_capacity;
+    }
+    worker->jobs[(worker->jobs_head + worker->jobs_count) %
+                 worker->jobs_capacity] = process;
+    worker->jobs_count++;
+}
+
+/* Called with worker->lock held */
+static struct Process *queue_pop(struct Worker *worker)
+{
+    struct Process *process;
+    if(worker->jobs_count == 0)
+        return NULL;
+    process = worker->jobs[worker->jobs_head];
+    worker->jobs_head = (worker->jobs_head + 1) % worker->jobs_capacity;
+    worker->jobs_count--;
+    return process;
+}
+
+static struct Process *worker_steal(struct Worker *thief)
+{
+    struct WorkerPool *pool = thief->pool;
+    size_t start = thief - pool->workers;
+    /* Workers are still being started, those counted are set up */
+    unsigned int count = __atomic_load_n(&pool->count, __ATOMIC_ACQUIRE);
+    unsigned int i;
+    for(i = 1; i < count; ++i)
+    {
+        struct Worker *victim = &pool->workers[(start + i) % count];
+        struct Process *process;
+        /* Don't wait on a busy queue, try the next one */
+        if(pthread_mutex_trylock(&victim->lock) != 0)
+            continue;
+        process = queue_pop(victim);
+        pthread_mutex_unlock(&victim->lock);
+        if(process != NULL)
+            return process;
+    }
+    return NULL;
+}
+
+/* Returns NULL once the pool is stopping */
+static struct Process *worker_next_job(struct Worker *worker)
+{
+    struct WorkerPool *pool = worker->pool;
+    for(;;)
+    {
+        struct Process *process;
+
+        pthread_mutex_lock(&worker->lock);
+        process = queue_pop(worker);
+        if(process != NULL
+         || __atomic_load_n(&pool->stopping, __ATOMIC_RELAXED))
+        {
+            pthread_mutex_unlock(&worker->lock);
+            return process;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        process = worker_steal(worker);
+        if(process != NULL)
+            return process;
+
+        pthread_mutex_lock(&worker->lock);
+        if(worker->jobs_count == 0
+         && !__atomic_load_n(&pool->stopping, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&worker->sleeping, 1, __ATOMIC_RELAXED);
+            pthread_cond_wait(&worker->cond, &worker->lock);
+            __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct Worker *worker = arg;
+    struct WorkerPool *pool = worker->pool;
+    struct Process *process;
+
+    tracee_channel = &worker->channel;
+
+    while((process = worker_next_job(worker)) != NULL)
+    {
+        if(syscall_handle(process) != 0)
+        {
+            /* The tracee is left stopped, the tracer will clean up */
+            __atomic_store_n(&pool->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pool->running_lock);
+    pool->running--;
+    pthread_mutex_unlock(&pool->running_lock);
+    return NULL;
+}
+
+struct WorkerPool *workers_start(unsigned int nb)
+{
+    struct WorkerPool *pool;
+    unsigned int i;
+    pthread_attr_t attr;
+
+    if(nb == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb = (cpus > 0)?(unsigned int)cpus:1;
+    }
+
+    pool = malloc(sizeof(*pool));
+    pool->workers = malloc(nb * sizeof(*pool->workers));
+    pool->count = 0;
+    pool->stopping = 0;
+    pool->failed = 0;
+    pthread_mutex_init(&pool->running_lock, NULL);
+    pool->running = 0;
+
+    if(rpc_server_init(&pool->server) != 0)
+    {
+        /* LCOV_EXCL_START : Only fails on resource exhaustion */
+        log_critical(0, "couldn't create eventfd: %s", strerror(errno));
+        pthread_mutex_destroy(&pool->running_lock);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+        /* LCOV_EXCL_END */
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+
+    for(i = 0; i < nb; ++i)
+    {
+        struct Worker *worker = &pool->workers[i];
+        rpc_channel_init(&worker->channel, &pool->server);
+        worker->pool = pool;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        worker->jobs_capacity = 16;
+        worker->jobs = malloc(worker->jobs_capacity * sizeof(*worker->jobs));
+        worker->jobs_head = 0;
+        worker->jobs_count = 0;
+        worker->sleeping = 0;
+
+        pthread_mutex_lock(&pool->running_lock);
+        pool->running++;
+        pthread_mutex_unlock(&pool->running_lock);
+        if((errno = pthread_create(&worker->thread, &attr,
+                                   worker_main, worker)) != 0)
+        {
+            /* LCOV_EXCL_START : Only fails on resource exhaustion */
+            pthread_mutex_lock(&pool->running_lock);
+            pool->running--;
+            pthread_mutex_unlock(&pool->running_lock);
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->cond);
+            free(worker->jobs);
+            goto error;
+            /* LCOV_EXCL_END */
+        }
+        __atomic_store_n(&pool->count, pool->count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+
+    if(verbosity >= 2)
+        log_info(0, "started %u workers", pool->count);
+    return pool;
+
+error:
+    /* LCOV_EXCL_START : Only fails on resource exhaustion */
+    log_critical(0, "couldn't start worker threads: %s", strerror(errno));
+    pthread_attr_destroy(&attr);
+    workers_stop(pool);
+    return NULL;
+    /* LCOV_EXCL_END */
+}
+
+void workers_stop(struct WorkerPool *pool)
+{
+    unsigned int i;
+
+    for(i = 0; i < pool->count; ++i)
+    {
+        pthread_mutex_lock(&pool->workers[i].lock);
+        __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&pool->workers[i].cond);
+        pthread_mutex_unlock(&pool->workers[i].lock);
+    }
+
+    /* Workers might be finishing a job, which needs requests served */
+    for(;;)
+    {
+        unsigned int running;
+        pthread_mutex_lock(&pool->running_lock);
+        running = pool->running;
+        pthread_mutex_unlock(&pool->running_lock);
+        if(running == 0)
+            break;
+        if(workers_serve(pool) == 0)
+            rpc_server_wait(&pool->server, 10);
+    }
+
+    for(i = 0; i < pool->count; ++i)
+    {
+        struct Worker *worker = &pool->workers[i];
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->cond);
+        free(worker->jobs);
+    }
+    rpc_server_close(&pool->server);
+    pthread_mutex_destroy(&pool->running_lock);
+    free(pool->workers);
+    free(pool);
+}
+
+void workers_dispatch(struct WorkerPool *pool, struct Process *process)
+{
+    struct Worker *worker = &pool->workers[(unsigned int)process->tid %
+                                           pool->count];
+    int sleeping;
+    unsigned int i;
+
+    pthread_mutex_lock(&worker->lock);
+    queue_push(worker, process);
+    sleeping = worker->sleeping;
+    if(sleeping)
+        pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    if(sleeping)
+        return;
+
+    /* That worker is busy, wake up an idle one to take the job. If we miss
+     * one, the job still gets run by its own worker */
+    for(i = 0; i < pool->count; ++i)
+    {
+        struct Worker *idle = &pool->workers[i];
+        if(idle == worker
+         || !__atomic_load_n(&idle->sleeping, __ATOMIC_RELAXED))
+            continue;
+        pthread_mutex_lock(&idle->lock);
+        sleeping = idle->sleeping;
+        if(sleeping)
+            pthread_cond_signal(&idle->cond);
+        pthread_mutex_unlock(&idle->lock);
+        if(sleeping)
+            break;
+    }
+}
+
+int workers_serve(struct WorkerPool *pool)
+{
+    int served = 0;
+    unsigned int i;
+    /* Called between every two wait statuses, don't look at each channel */
+    if(!rpc_server_pending(&pool->server))
+        return __atomic_load_n(&pool->failed, __ATOMIC_RELAXED)?-1:0;
+    for(i = 0; i < pool->count; ++i)
+    {
+        struct RpcChannel *channel = &pool->workers[i].channel;
+        struct RpcMessage msg;
+        while(rpc_receive(channel, &msg))
+        {
+            errno = 0;
+            msg.result = ptrace(msg.request, msg.tid, msg.addr, msg.data);
+            msg.error = errno;
+            rpc_reply(channel, &msg);
+            ++served;
+        }
+    }
+    return __atomic_load_n(&pool->failed, __ATOMIC_RELAXED)?-1:served;
+}
+
+int workers_fd(struct WorkerPool *pool)
+{
+    return pool->server.eventfd;
+}
+
+int workers_prepare_wait(struct WorkerPool *pool)
+{
+    return rpc_server_prepare_wait(&pool->server);
+}
+
+void workers_end_wait(struct WorkerPool *pool)
+{
+    rpc_server_end_wait(&pool->server);
+}
+
+void workers_wakeup(struct WorkerPool *pool)
+{
+    rpc_server_wakeup(&pool->server);
+}
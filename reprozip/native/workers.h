@@ -0,0 +1,62 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "tracer.h"
+
+
+struct WorkerPool;
+
+/**
+ * Starts a pool of worker threads that run the syscall handlers.
+ *
+ * If nb is 0, one worker is started per online CPU. The pool's requests are
+ * served by the thread that calls this, which must be the tracer of the
+ * processes dispatched to it.
+ */
+struct WorkerPool *workers_start(unsigned int nb);
+
+/**
+ * Stops the pool, waiting for the current jobs to finish.
+ *
+ * Must be called from the tracer thread, since the workers might still need
+ * their ptrace() requests served.
+ */
+void workers_stop(struct WorkerPool *pool);
+
+/**
+ * Queues a syscall stop to be handled by a worker.
+ *
+ * The worker resumes the tracee when done.
+ */
+void workers_dispatch(struct WorkerPool *pool, struct Process *process);
+
+/**
+ * Serves the pending ptrace() requests of the workers, without waiting.
+ *
+ * Returns the number of requests served, or -1 if a worker failed to handle a
+ * syscall.
+ */
+int workers_serve(struct WorkerPool *pool);
+
+/**
+ * File descriptor that becomes readable when a worker sends a request while
+ * the tracer is waiting, or on workers_wakeup().
+ */
+int workers_fd(struct WorkerPool *pool);
+
+/**
+ * Call before sleeping on workers_fd(), and workers_end_wait() after.
+ *
+ * Returns 0 if requests are already pending, in which case the caller
+ * shouldn't sleep (nor call workers_end_wait()).
+ */
+int workers_prepare_wait(struct WorkerPool *pool);
+
+void workers_end_wait(struct WorkerPool *pool);
+
+/**
+ * Interrupts the wait of the tracer owning that pool (any thread).
+ */
+void workers_wakeup(struct WorkerPool *pool);
+
+#endif
@@ -230,7 +230,13 @@ def trace(args):
                                 argv,
                                 Path(args.dir),
                                 append,
-                                args.verbosity)
+                                args.verbosity,
+                                args.negative_lookups,
+                                args.shards,
+                                args.binary_log,
+                                args.in_memory,
+                                args.checkpoint,
+                                args.drop_crashed)
     reprozip.tracer.trace.write_configuration(Path(args.dir),
                                               args.identify_packages,
                                               args.find_inputs_outputs,
@@ -362,6 +368,31 @@ def main():
     parser_trace.add_argument(
         '-w', '--overwrite', action='store_true', dest='overwrite',
         help="overwrite the previous trace, don't add to it")
+    parser_trace.add_argument(
+        '--record-failed-lookups', action='store_true',
+        dest='negative_lookups',
+        help="also record the paths of failed open() and stat() calls")
+    parser_trace.add_argument(
+        '--tracer-threads', action='store', type=int, default=0,
+        dest='shards',
+        help="split the traced processes between that many tracer threads "
+             "(experimental)")
+    parser_trace.add_argument(
+        '--binary-log', action='store_true', dest='binary_log',
+        help="only append the events to a binary log while tracing, and "
+             "build the database once the program is done")
+    parser_trace.add_argument(
+        '--in-memory', action='store_true', dest='in_memory',
+        help="record the trace in memory and write the database once the "
+             "program is done")
+    parser_trace.add_argument(
+        '--checkpoint', action='store_true', dest='checkpoint',
+        help="commit the trace regularly, so that it is kept if the tracer "
+             "crashes or is killed")
+    parser_trace.add_argument(
+        '--drop-crashed', action='store_true', dest='drop_crashed',
+        help="with --continue, delete the previous runs that didn't "
+             "complete instead of keeping what was recorded")
     parser_trace.add_argument('cmdline', nargs=argparse.REMAINDER,
                               help="command-line to run under trace")
     parser_trace.set_defaults(func=trace)
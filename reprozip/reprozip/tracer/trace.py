@@ -101,6 +101,51 @@ def run_filter_plugins(files, input_files):
         func(files=files, input_files=input_files)
 
 
+def read_environment(conn, environment, cache):
+    """Gets an environment from the trace, as a list of 'NAME=value' strings.
+
+    The tracer stores each distinct environment once, in the ``environments``
+    table, either in full (NUL-separated) or as a delta against another one:
+    '=N' copies the next N entries of the base, '-N' skips N entries, '+ENTRY'
+    adds an entry, and the rest of the base is dropped.
+
+    :param cache: Dictionary of the environments already read, updated.
+    """
+    # Follows the chain of bases up to a known or full environment
+    chain = []
+    while environment not in cache:
+        base, data = conn.execute(
+            '''
+            SELECT base, data FROM environments WHERE id=?;
+            ''',
+            (environment,)).fetchone()
+        items = data.split('\0')
+        if not items[-1]:
+            items = items[:-1]
+        chain.append((environment, items))
+        if base is None:
+            break
+        environment = base
+
+    envp = cache.get(environment)
+    for env_id, items in reversed(chain):
+        if envp is None:
+            envp = items
+        else:
+            new, pos = [], 0
+            for item in items:
+                if item[0] == '=':
+                    new.extend(envp[pos:pos + int(item[1:])])
+                    pos += int(item[1:])
+                elif item[0] == '-':
+                    pos += int(item[1:])
+                else:
+                    new.append(item[1:])
+            envp = new
+        cache[env_id] = envp
+    return envp
+
+
 def get_files(conn):
     """Find all the files used by the experiment by reading the trace.
     """
@@ -129,6 +174,21 @@ def get_files(conn):
                         f.read(None)
                         files[f.path] = f
 
+    # Newer traces store each path once, opened_files being a view; it is
+    # faster to read them first than to have SQLite join them in
+    if list(conn.execute(
+            '''
+            SELECT name FROM sqlite_master
+            WHERE type='table' AND name='file_opens';
+            ''')):
+        paths = dict(conn.execute('SELECT id, name FROM paths;'))
+        opened_files = ("SELECT 'open' AS event_type, path, mode, "
+                        "timestamp FROM file_opens")
+    else:
+        paths = None
+        opened_files = ("SELECT 'open' AS event_type, name, mode, "
+                        "timestamp FROM opened_files")
+
     # Loops on executed files, and opened files, at the same time
     cur = conn.cursor()
     rows = cur.execute(
@@ -136,15 +196,16 @@ def get_files(conn):
         SELECT 'exec' AS event_type, name, NULL AS mode, timestamp
         FROM executed_files
         UNION ALL
-        SELECT 'open' AS event_type, name, mode, timestamp
-        FROM opened_files
+        {0}
         ORDER BY timestamp;
-        ''')
+        '''.format(opened_files))
     executed = set()
     run = 0
     for event_type, r_name, r_mode, r_timestamp in rows:
         if event_type == 'exec':
             r_mode = FILE_READ
+        elif paths is not None:
+            r_name = paths[r_name]
         r_name = Path(normalize_path(r_name))
 
         # Stays on the current run
@@ -290,7 +351,9 @@ def tty_prompt(prompt, chars):
             stream.flush()
 
 
-def trace(binary, argv, directory, append, verbosity=1):
+def trace(binary, argv, directory, append, verbosity=1,
+          negative_lookups=False, shards=0, binary_log=False,
+          in_memory=False, checkpoint=False, drop_crashed=False):
     """Main function for the trace subcommand.
     """
     cwd = Path.cwd()
@@ -334,9 +397,26 @@ def trace(binary, argv, directory, append, verbosity=1):
 
     # Runs the trace
     database = directory / 'trace.sqlite3'
+    if binary_log:
+        # The tracer only appends to a log, loaded into the database after
+        output = directory / 'trace.log'
+        if output.exists():
+            output.remove()
+    else:
+        output = database
     logging.info("Running program")
     # Might raise _pytracer.Error
-    c = _pytracer.execute(binary, argv, database.path, verbosity)
+    c = _pytracer.execute(binary, argv, output.path, verbosity,
+                          negative_lookups=negative_lookups,
+                          shards=shards,
+                          binary_log=binary_log,
+                          in_memory=in_memory,
+                          checkpoint=checkpoint,
+                          drop_crashed=drop_crashed)
+    if binary_log:
+        logging.info("Loading trace log into database")
+        _pytracer.convert_log(output.path, database.path)
+        output.remove()
     if c != 0:
         if c & 0x0100:
             logging.warning("Program appears to have been terminated by "
@@ -359,6 +439,16 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
         conn = sqlite3.connect(database.path)
     conn.row_factory = sqlite3.Row
 
+    # With --checkpoint, runs are committed as they go and the tracer might
+    # have stopped before the end; traces from older versions have no status
+    tables = set(r[0] for r in conn.execute(
+                 "SELECT name FROM sqlite_master WHERE type='table';"))
+    if 'runs' in tables:
+        for r_id, in conn.execute(
+                "SELECT id FROM runs WHERE status != 'done';"):
+            logging.warning("Run %d didn't complete, its trace only has what "
+                            "was recorded before the tracer stopped", r_id)
+
     # Reads info from database
     files, inputs, outputs = get_files(conn)
 
@@ -371,6 +461,14 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
     # Writes configuration file
     config = directory / 'config.yml'
     distribution = platform.linux_distribution()[0:2]
+    # Traces from older versions have the full environment in envp
+    columns = [r[1] for r in conn.execute(
+               'PRAGMA table_info(executed_files);')]
+    if 'environment' in columns:
+        environment = 'e.environment'
+    else:
+        environment = 'NULL'
+    environments = {}
     cur = conn.cursor()
     if overwrite or not config.exists():
         runs = []
@@ -379,8 +477,8 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
         # chronological)
         executions = cur.execute(
             '''
-            SELECT e.name, e.argv, e.envp, e.workingdir,
-                   p.timestamp, p.exit_timestamp, p.exitcode
+            SELECT e.name, e.argv, e.envp, {0} AS environment,
+                   e.workingdir, p.timestamp, p.exit_timestamp, p.exitcode
             FROM processes p
             JOIN executed_files e ON e.id=(
                 SELECT id FROM executed_files e2
@@ -389,7 +487,7 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
                 LIMIT 1
             )
             WHERE p.parent ISNULL;
-            ''')
+            '''.format(environment))
     else:
         # Loads in previous config
         runs, oldpkgs, oldfiles = load_config(config,
@@ -399,8 +497,8 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
         # Same query as previous block but only gets last process
         executions = cur.execute(
             '''
-            SELECT e.name, e.argv, e.envp, e.workingdir,
-                   p.timestamp, p.exit_timestamp, p.exitcode
+            SELECT e.name, e.argv, e.envp, {0} AS environment,
+                   e.workingdir, p.timestamp, p.exit_timestamp, p.exitcode
             FROM processes p
             JOIN executed_files e ON e.id=(
                 SELECT id FROM executed_files e2
@@ -411,8 +509,8 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
             WHERE p.parent ISNULL
             ORDER BY p.id DESC
             LIMIT 1;
-            ''')
-    for (r_name, r_argv, r_envp, r_workingdir,
+            '''.format(environment))
+    for (r_name, r_argv, r_envp, r_environment, r_workingdir,
          r_start, r_end, r_exitcode) in executions:
         # Decodes command-line
         argv = r_argv.split('\0')
@@ -420,9 +518,12 @@ def write_configuration(directory, sort_packages, find_inputs_outputs,
             argv = argv[:-1]
 
         # Decodes environment
-        envp = r_envp.split('\0')
-        if not envp[-1]:
-            envp = envp[:-1]
+        if r_environment is not None:
+            envp = read_environment(conn, r_environment, environments)
+        else:
+            envp = r_envp.split('\0')
+            if not envp[-1]:
+                envp = envp[:-1]
         environ = dict(v.split('=', 1) for v in envp)
 
         run = {'id': "run%d" % len(runs),
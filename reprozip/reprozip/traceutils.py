@@ -38,10 +38,16 @@ def create_schema(conn):
         CREATE INDEX proc_parent_idx ON processes(parent);
         ''',
         '''
-        CREATE TABLE opened_files(
+        CREATE TABLE paths(
+            id INTEGER NOT NULL PRIMARY KEY,
+            name TEXT NOT NULL
+            );
+        ''',
+        '''
+        CREATE TABLE file_opens(
             id INTEGER NOT NULL PRIMARY KEY,
             run_id INTEGER NOT NULL,
-            name TEXT NOT NULL,
+            path INTEGER NOT NULL,
             timestamp INTEGER NOT NULL,
             mode INTEGER NOT NULL,
             is_directory BOOLEAN NOT NULL,
@@ -49,7 +55,14 @@ def create_schema(conn):
             );
         ''',
         '''
-        CREATE INDEX open_proc_idx ON opened_files(process);
+        CREATE INDEX open_proc_idx ON file_opens(process);
+        ''',
+        '''
+        CREATE VIEW opened_files AS
+        SELECT f.id AS id, f.run_id AS run_id, p.name AS name,
+            f.timestamp AS timestamp, f.mode AS mode,
+            f.is_directory AS is_directory, f.process AS process
+        FROM file_opens f JOIN paths p ON f.path = p.id;
         ''',
         '''
         CREATE TABLE executed_files(
@@ -60,12 +73,21 @@ def create_schema(conn):
             process INTEGER NOT NULL,
             argv TEXT NOT NULL,
             envp TEXT NOT NULL,
-            workingdir TEXT NOT NULL
+            workingdir TEXT NOT NULL,
+            environment INTEGER
             );
         ''',
         '''
         CREATE INDEX exec_proc_idx ON executed_files(process);
         ''',
+        '''
+        CREATE TABLE environments(
+            id INTEGER NOT NULL PRIMARY KEY,
+            hash BLOB NOT NULL,
+            base INTEGER,
+            data TEXT NOT NULL
+            );
+        ''',
     ]
     for stmt in sql:
         conn.execute(stmt)
@@ -140,6 +162,14 @@ def combine_traces(traces, target):
             new INTEGER NOT NULL PRIMARY KEY AUTOINCREMENT
             );
         ''')
+    conn.execute(
+        '''
+        CREATE TABLE maps.map_environments(
+            old INTEGER NOT NULL PRIMARY KEY,
+            new INTEGER NOT NULL
+            );
+        ''')
+    environments = {}
 
     # Do the merge
     for other in traces:
@@ -193,33 +223,88 @@ def combine_traces(traces, target):
             ORDER BY t.id;
             ''')
 
-        # opened_files
+        # opened_files, which is a view over file_opens and paths
+        # Works whether it is a table (older versions) or a view in the trace
         logging.info("Insert opened_files...")
         conn.execute(
             '''
-            INSERT INTO opened_files(run_id, name, timestamp,
-                                     mode, is_directory, process)
-            SELECT r.new AS run_id, name, timestamp,
+            INSERT INTO paths(name)
+            SELECT DISTINCT name
+            FROM trace.opened_files
+            WHERE name NOT IN (SELECT name FROM paths);
+            ''')
+        conn.execute(
+            '''
+            INSERT INTO file_opens(run_id, path, timestamp,
+                                   mode, is_directory, process)
+            SELECT r.new AS run_id, n.id AS path, timestamp,
                    mode, is_directory, p.new AS process
             FROM trace.opened_files t
             INNER JOIN maps.map_runs r ON t.run_id = r.old
             INNER JOIN maps.map_processes p ON t.process = p.old
+            INNER JOIN paths n ON t.name = n.name
             ORDER BY t.id;
             ''')
 
+        # environments, which are deduplicated using their hash
+        # Traces from older versions only have executed_files.envp
+        columns = [r[1] for r in conn.execute(
+                   'PRAGMA trace.table_info(executed_files);')]
+        if 'environment' in columns:
+            logging.info("Insert environments...")
+            # Bases come before the environments using them
+            rows = conn.execute(
+                '''
+                SELECT id, hash, base, data
+                FROM trace.environments
+                ORDER BY id;
+                ''').fetchall()
+            for r_id, r_hash, r_base, r_data in rows:
+                r_hash = bytes(r_hash)
+                new_id = environments.get(r_hash)
+                if new_id is None:
+                    if r_base is not None:
+                        r_base, = conn.execute(
+                            '''
+                            SELECT new FROM maps.map_environments
+                            WHERE old=?;
+                            ''',
+                            (r_base,)).fetchone()
+                    new_id = len(environments) + 1
+                    conn.execute(
+                        '''
+                        INSERT INTO environments(id, hash, base, data)
+                        VALUES(?, ?, ?, ?);
+                        ''',
+                        (new_id, sqlite3.Binary(r_hash), r_base, r_data))
+                    environments[r_hash] = new_id
+                conn.execute(
+                    '''
+                    INSERT INTO maps.map_environments(old, new)
+                    VALUES(?, ?);
+                    ''',
+                    (r_id, new_id))
+            environment = 'e.new'
+            join = ('LEFT OUTER JOIN maps.map_environments e '
+                    'ON t.environment = e.old')
+        else:
+            environment = 'NULL'
+            join = ''
+
         # executed_files
         logging.info("Insert executed_files...")
         conn.execute(
             '''
             INSERT INTO executed_files(name, run_id, timestamp, process,
-                                       argv, envp, workingdir)
+                                       argv, envp, workingdir, environment)
             SELECT name, r.new AS run_id, timestamp, p.new AS process,
-                   argv, envp, workingdir
+                   argv, envp, workingdir, {0} AS environment
             FROM trace.executed_files t
             INNER JOIN maps.map_runs r ON t.run_id = r.old
             INNER JOIN maps.map_processes p ON t.process = p.old
+            {1}
             ORDER BY t.id;
-            ''')
+            '''.format(environment, join))
 
         # Flush maps
         conn.execute(
@@ -230,6 +315,10 @@ def combine_traces(traces, target):
             '''
             DELETE FROM maps.map_processes;
             ''')
+        conn.execute(
+            '''
+            DELETE FROM maps.map_environments;
+            ''')
 
         # Detach
         conn.execute(
@@ -19,7 +19,8 @@ if platform.system().lower() != 'linux':
 
 # List the source files
 sources = ['pytracer.c', 'tracer.c', 'syscalls.c', 'database.c',
-           'ptrace_utils.c', 'utils.c', 'log.c', 'vector.c']
+           'ptrace_utils.c', 'utils.c', 'log.c', 'rpc.c', 'strscan.c',
+           'workers.c']
 # They can be found under native/
 sources = [os.path.join('native', n) for n in sources]
 
@@ -0,0 +1,240 @@
+/* db_bench.c
+ *
+ * Measures the throughput of opened_files insertions.
+ *
+ * "exec" is the previous code: each row is formatted into SQL with sprintf()
+ * and run through sqlite3_exec(), so it gets parsed and planned every time.
+ * "prepared" binds the values to a statement prepared once, like the writer
+ * thread in database.c does. "db_add" goes through db_add_file_open(): the
+ * first figure is what the caller sees (queueing the event), the second one
+ * includes db_close() writing everything out. It is run without batching
+ * (db_batch_size=1, one INSERT per row) and with the default batches. Every
+ * path is different, which is the worst case for the paths table.
+ * "in memory" records into SQLite's temporary database (db_in_memory) with the
+ * given budget, copied to the file by db_close(); the peak of SQLite's memory
+ * use is shown. "binary log" does the same with db_binary_log set, then loads
+ * the log with db_convert_log(). "checkpoint" commits as it goes, in WAL mode
+ * (db_checkpoint).
+ *
+ * build: cc -O2 -pthread -I../../reprozip/native -o db_bench db_bench.c \
+ *            ../../reprozip/native/database.c ../../reprozip/native/log.c \
+ *            -lsqlite3
+ * usage: ./db_bench [rows] [directory]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "database.h"
+
+
+int trace_verbosity = 0;
+
+static int rows;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0E-9;
+}
+
+static void make_path(char *buffer, int i)
+{
+    sprintf(buffer, "/usr/lib/python3/dist-packages/package%d/module%d.py",
+            i % 97, i);
+}
+
+static void check(int ret, sqlite3 *db)
+{
+    if(ret != SQLITE_OK && ret != SQLITE_DONE)
+    {
+        fprintf(stderr, "sqlite3 error: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+}
+
+static sqlite3 *open_db(const char *filename)
+{
+    sqlite3 *db;
+    unlink(filename);
+    check(sqlite3_open(filename, &db), db);
+    check(sqlite3_exec(db,
+                       "CREATE TABLE opened_files("
+                       "    id INTEGER NOT NULL PRIMARY KEY,"
+                       "    run_id INTEGER NOT NULL,"
+                       "    name TEXT NOT NULL,"
+                       "    timestamp INTEGER NOT NULL,"
+                       "    mode INTEGER NOT NULL,"
+                       "    is_directory BOOLEAN NOT NULL,"
+                       "    process INTEGER NOT NULL"
+                       "    );"
+                       "CREATE INDEX open_proc_idx ON opened_files(process);"
+                       "BEGIN IMMEDIATE;",
+                       NULL, NULL, NULL), db);
+    return db;
+}
+
+static void close_db(sqlite3 *db)
+{
+    check(sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL), db);
+    sqlite3_close(db);
+}
+
+static double bench_exec(const char *filename)
+{
+    sqlite3 *db = open_db(filename);
+    double start = now();
+    int i;
+    for(i = 0; i < rows; ++i)
+    {
+        char path[256];
+        char sql[1024];
+        make_path(path, i);
+        sprintf(sql, "INSERT INTO opened_files(run_id, name, timestamp, mode, "
+                "is_directory, process) VALUES(%d, '%s', %lld, %d, %d, %d)",
+                0, path, (long long)i, FILE_READ, 0, i % 50);
+        check(sqlite3_exec(db, sql, NULL, NULL, NULL), db);
+    }
+    close_db(db);
+    return now() - start;
+}
+
+static double bench_prepared(const char *filename)
+{
+    sqlite3 *db = open_db(filename);
+    sqlite3_stmt *stmt;
+    double start = now();
+    int i;
+    check(sqlite3_prepare_v2(db,
+                             "INSERT INTO opened_files(run_id, name, "
+                             "        timestamp, mode, is_directory, process) "
+                             "VALUES(?, ?, ?, ?, ?, ?)",
+                             -1, &stmt, NULL), db);
+    for(i = 0; i < rows; ++i)
+    {
+        char path[256];
+        make_path(path, i);
+        sqlite3_bind_int(stmt, 1, 0);
+        sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, i);
+        sqlite3_bind_int(stmt, 4, FILE_READ);
+        sqlite3_bind_int(stmt, 5, 0);
+        sqlite3_bind_int(stmt, 6, i % 50);
+        check(sqlite3_step(stmt), db);
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    close_db(db);
+    return now() - start;
+}
+
+static double bench_db_add(const char *filename, double *queued)
+{
+    unsigned int process;
+    double start;
+    int i;
+    /* The binary log would be appended to */
+    unlink(filename);
+    if(db_init(filename) != 0 || db_add_first_process(&process, "/") != 0)
+        exit(1);
+    start = now();
+    for(i = 0; i < rows; ++i)
+    {
+        char path[256];
+        make_path(path, i);
+        if(db_add_file_open(process, path, FILE_READ, 0,
+                            db_timestamp()) != 0)
+            exit(1);
+    }
+    *queued = now() - start;
+    if(db_close(0) != 0)
+        exit(1);
+    return now() - start;
+}
+
+
+int main(int argc, char **argv)
+{
+    char filename[4096];
+    char log_filename[4096];
+    double t_exec, t_prepared;
+    unsigned int batch_sizes[2];
+    int i;
+
+    rows = (argc > 1)?atoi(argv[1]):200000;
+    snprintf(filename, sizeof(filename), "%s/db_bench.sqlite3",
+             (argc > 2)?argv[2]:"/tmp");
+    snprintf(log_filename, sizeof(log_filename), "%s/db_bench.log",
+             (argc > 2)?argv[2]:"/tmp");
+
+    t_exec = bench_exec(filename);
+    t_prepared = bench_prepared(filename);
+
+    printf("%d rows, %ld CPUs\n", rows, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("exec              %9.0f rows/s\n", rows / t_exec);
+    printf("prepared          %9.0f rows/s (x%.1f)\n",
+           rows / t_prepared, t_exec / t_prepared);
+
+    batch_sizes[0] = 1;
+    batch_sizes[1] = DB_BATCH_SIZE;
+    for(i = 0; i < 2; ++i)
+    {
+        double t_queued, t_db_add;
+        db_batch_size = batch_sizes[i];
+        t_db_add = bench_db_add(filename, &t_queued);
+        printf("db_add batch=%-4u %9.0f rows/s queued, %9.0f rows/s written "
+               "(x%.1f)\n",
+               batch_sizes[i], rows / t_queued, rows / t_db_add,
+               t_exec / t_db_add);
+    }
+
+    for(i = 0; i < 2; ++i)
+    {
+        double t_queued, t_db_add;
+        db_in_memory = 1;
+        db_memory_budget = (i == 0)?DB_MEMORY_BUDGET:1;
+        sqlite3_memory_highwater(1);
+        t_db_add = bench_db_add(filename, &t_queued);
+        db_in_memory = 0;
+        printf("in memory %4uMiB %9.0f rows/s queued, %9.0f rows/s written "
+               "(x%.1f), peak %lld KiB\n",
+               db_memory_budget, rows / t_queued, rows / t_db_add,
+               t_exec / t_db_add,
+               (long long)sqlite3_memory_highwater(0) / 1024);
+    }
+
+    {
+        double t_queued, t_db_add;
+        db_checkpoint = 1;
+        t_db_add = bench_db_add(filename, &t_queued);
+        db_checkpoint = 0;
+        printf("checkpoint        %9.0f rows/s queued, %9.0f rows/s written "
+               "(x%.1f)\n",
+               rows / t_queued, rows / t_db_add, t_exec / t_db_add);
+    }
+
+    {
+        double t_queued, t_logged, t_converted;
+        db_binary_log = 1;
+        t_logged = bench_db_add(log_filename, &t_queued);
+        db_binary_log = 0;
+        unlink(filename);
+        t_converted = now();
+        if(db_convert_log(log_filename, filename) != 0)
+            exit(1);
+        t_converted = now() - t_converted;
+        printf("binary log        %9.0f rows/s queued, %9.0f rows/s written "
+               "(x%.1f)\n",
+               rows / t_queued, rows / t_logged, t_exec / t_logged);
+        printf("  then converted  %9.0f rows/s\n", rows / t_converted);
+        unlink(log_filename);
+    }
+    unlink(filename);
+    return 0;
+}
@@ -0,0 +1,280 @@
+/* rpc_bench.c
+ *
+ * Measures the throughput of the ptrace() requests sent by the worker threads
+ * to the tracer thread.
+ *
+ * "pipes" is the previous protocol: one write() per field of the request over
+ * a pipe, poll() on the tracer side, and a pipe back for the reply. "rings" is
+ * the current one, see rpc.c. The tracer either answers right away ("null"),
+ * or does an actual PTRACE_PEEKDATA on a stopped child ("peek").
+ *
+ * build: cc -O2 -pthread -I../../reprozip/native -o rpc_bench rpc_bench.c \
+ *            ../../reprozip/native/rpc.c
+ * usage: ./rpc_bench [requests per thread] [max threads]
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc.h"
+
+
+#define MAX_CLIENTS 64
+
+static long peek_target = 42;
+
+static pid_t child = 0;
+static int requests_per_client;
+static unsigned int nb_clients;
+static int finished;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0E-9;
+}
+
+static long do_request(int request, pid_t tid, void *addr, void *data)
+{
+    if(request == PTRACE_PEEKDATA)
+        return ptrace(request, tid, addr, data);
+    return *(long*)addr;
+}
+
+static int all_finished(void)
+{
+    return __atomic_load_n(&finished, __ATOMIC_ACQUIRE) == (int)nb_clients;
+}
+
+static void client_done(void)
+{
+    __atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+}
+
+
+/* ********************
+ * Pipes
+ */
+
+struct PipeClient {
+    int request_pipe[2];
+    int reply_pipe[2];
+    int request;
+};
+
+static void *pipe_client(void *arg)
+{
+    struct PipeClient *client = arg;
+    int i;
+    for(i = 0; i < requests_per_client; ++i)
+    {
+        int request = client->request;
+        pid_t tid = child;
+        void *addr = &peek_target;
+        void *data = NULL;
+        long res;
+        write(client->request_pipe[1], &request, sizeof(request));
+        write(client->request_pipe[1], &tid, sizeof(tid));
+        write(client->request_pipe[1], &addr, sizeof(addr));
+        write(client->request_pipe[1], &data, sizeof(data));
+        read(client->reply_pipe[0], &res, sizeof(res));
+        if(res != peek_target)
+        {
+            fprintf(stderr, "wrong reply %ld\n", res);
+            exit(1);
+        }
+    }
+    client_done();
+    return NULL;
+}
+
+static double bench_pipes(int request)
+{
+    struct PipeClient clients[MAX_CLIENTS];
+    struct pollfd pollfds[MAX_CLIENTS];
+    pthread_t threads[MAX_CLIENTS];
+    unsigned int i;
+    double start;
+
+    finished = 0;
+    for(i = 0; i < nb_clients; ++i)
+    {
+        if(pipe(clients[i].request_pipe) != 0
+         || pipe(clients[i].reply_pipe) != 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+        clients[i].request = request;
+        pollfds[i].fd = clients[i].request_pipe[0];
+        pollfds[i].events = POLLIN;
+    }
+
+    start = now();
+    for(i = 0; i < nb_clients; ++i)
+        pthread_create(&threads[i], NULL, pipe_client, &clients[i]);
+    while(!all_finished())
+    {
+        if(poll(pollfds, nb_clients, 50) <= 0)
+            continue;
+        for(i = 0; i < nb_clients; ++i)
+        {
+            int fd = clients[i].request_pipe[0];
+            int req;
+            pid_t tid;
+            void *addr;
+            void *data;
+            long res;
+            if(!(pollfds[i].revents & POLLIN))
+                continue;
+            read(fd, &req, sizeof(req));
+            read(fd, &tid, sizeof(tid));
+            read(fd, &addr, sizeof(addr));
+            read(fd, &data, sizeof(data));
+            res = do_request(req, tid, addr, data);
+            write(clients[i].reply_pipe[1], &res, sizeof(res));
+        }
+    }
+    for(i = 0; i < nb_clients; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        close(clients[i].request_pipe[0]);
+        close(clients[i].request_pipe[1]);
+        close(clients[i].reply_pipe[0]);
+        close(clients[i].reply_pipe[1]);
+    }
+    return now() - start;
+}
+
+
+/* ********************
+ * Rings
+ */
+
+struct RingClient {
+    struct RpcChannel channel;
+    int request;
+};
+
+static void *ring_client(void *arg)
+{
+    struct RingClient *client = arg;
+    int i;
+    for(i = 0; i < requests_per_client; ++i)
+    {
+        struct RpcMessage msg;
+        msg.request = client->request;
+        msg.tid = child;
+        msg.addr = &peek_target;
+        msg.data = NULL;
+        rpc_call(&client->channel, &msg);
+        if(msg.result != peek_target)
+        {
+            fprintf(stderr, "wrong reply %ld\n", msg.result);
+            exit(1);
+        }
+    }
+    client_done();
+    return NULL;
+}
+
+static double bench_rings(int request)
+{
+    struct RpcServer server;
+    struct RingClient *clients;
+    pthread_t threads[MAX_CLIENTS];
+    unsigned int i;
+    double start;
+
+    finished = 0;
+    rpc_server_init(&server);
+    clients = malloc(nb_clients * sizeof(*clients));
+    for(i = 0; i < nb_clients; ++i)
+    {
+        rpc_channel_init(&clients[i].channel, &server);
+        clients[i].request = request;
+    }
+
+    start = now();
+    for(i = 0; i < nb_clients; ++i)
+        pthread_create(&threads[i], NULL, ring_client, &clients[i]);
+    while(!all_finished())
+    {
+        unsigned int served = 0;
+        for(i = 0; i < nb_clients; ++i)
+        {
+            struct RpcMessage msg;
+            while(rpc_receive(&clients[i].channel, &msg))
+            {
+                errno = 0;
+                msg.result = do_request(msg.request, msg.tid,
+                                        msg.addr, msg.data);
+                msg.error = errno;
+                rpc_reply(&clients[i].channel, &msg);
+                ++served;
+            }
+        }
+        if(served == 0)
+            rpc_server_wait(&server, 50);
+    }
+    for(i = 0; i < nb_clients; ++i)
+        pthread_join(threads[i], NULL);
+    free(clients);
+    rpc_server_close(&server);
+    return now() - start;
+}
+
+
+int main(int argc, char **argv)
+{
+    unsigned int max_clients;
+    int r;
+
+    requests_per_client = (argc > 1)?atoi(argv[1]):100000;
+    max_clients = (argc > 2)?(unsigned int)atoi(argv[2]):4;
+    if(max_clients > MAX_CLIENTS)
+        max_clients = MAX_CLIENTS;
+
+    /* A stopped child to PTRACE_PEEKDATA from */
+    child = fork();
+    if(child == 0)
+    {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+
+    printf("%d requests per thread, %ld CPUs\n",
+           requests_per_client, sysconf(_SC_NPROCESSORS_ONLN));
+    for(r = 0; r < 2; ++r)
+    {
+        int request = (r == 0)?-1:PTRACE_PEEKDATA;
+        for(nb_clients = 1; nb_clients <= max_clients; nb_clients *= 2)
+        {
+            double total = (double)requests_per_client * nb_clients;
+            double t_pipes = bench_pipes(request);
+            double t_rings = bench_rings(request);
+            printf("%-4s %2u threads: pipes %9.0f req/s, rings %9.0f req/s "
+                   "(x%.1f)\n",
+                   (r == 0)?"null":"peek", nb_clients,
+                   total / t_pipes, total / t_rings, t_pipes / t_rings);
+        }
+    }
+
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,172 @@
+/* strscan_bench.c
+ *
+ * Compares the scalar and vectorized string scanning kernels used by the
+ * tracer to extract strings from tracee memory.
+ *
+ * Two corpora are used: the current environment (as captured on execve()) and
+ * file paths found under /usr (as captured on open() and stat()). The strings
+ * are packed one after the other as they would be in the tracee's memory.
+ *
+ * build: cc -O2 -I../../reprozip/native -o strscan_bench strscan_bench.c \
+ *            ../../reprozip/native/strscan.c
+ * usage: ./strscan_bench [iterations]
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "strscan.h"
+
+
+extern char **environ;
+
+
+struct Corpus {
+    const char *name;
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t count;
+};
+
+static void corpus_add(struct Corpus *corpus, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    if(corpus->size + len > corpus->capacity)
+    {
+        while(corpus->size + len > corpus->capacity)
+            corpus->capacity *= 2;
+        corpus->data = realloc(corpus->data, corpus->capacity);
+    }
+    memcpy(corpus->data + corpus->size, str, len);
+    corpus->size += len;
+    corpus->count++;
+}
+
+static struct Corpus paths;
+
+static int add_path(const char *fpath, const struct stat *sb, int typeflag,
+                    struct FTW *ftwbuf)
+{
+    (void)sb; (void)typeflag; (void)ftwbuf;
+    corpus_add(&paths, fpath);
+    return paths.count >= 20000;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0E-9;
+}
+
+typedef size_t (*nul_func)(const char*, size_t);
+typedef size_t (*copy_func)(char*, const char*, size_t, int*);
+
+static void bench(const struct Corpus *corpus, const char *name,
+                  nul_func nul, copy_func copy, int iterations)
+{
+    char *dst = malloc(corpus->size);
+    size_t check = 0;
+    double start, t_nul, t_copy;
+    int it;
+
+    start = now();
+    for(it = 0; it < iterations; ++it)
+    {
+        size_t pos = 0;
+        while(pos < corpus->size)
+        {
+            size_t len = nul(corpus->data + pos, corpus->size - pos);
+            check += len;
+            pos += len + 1;
+        }
+    }
+    t_nul = now() - start;
+
+    start = now();
+    for(it = 0; it < iterations; ++it)
+    {
+        size_t pos = 0;
+        while(pos < corpus->size)
+        {
+            int found;
+            size_t len = copy(dst + pos, corpus->data + pos,
+                              corpus->size - pos, &found);
+            check += len;
+            pos += len + 1;
+        }
+    }
+    t_copy = now() - start;
+
+    if(memcmp(dst, corpus->data, corpus->size) != 0)
+    {
+        fprintf(stderr, "%s: %s kernel copied wrong data\n",
+                corpus->name, name);
+        exit(1);
+    }
+
+    printf("  %-8s scan %7.1f ns/string %6.2f GB/s, "
+           "copy %7.1f ns/string %6.2f GB/s (%lu)\n",
+           name,
+           t_nul * 1.0E9 / (corpus->count * (double)iterations),
+           corpus->size * (double)iterations / t_nul * 1.0E-9,
+           t_copy * 1.0E9 / (corpus->count * (double)iterations),
+           corpus->size * (double)iterations / t_copy * 1.0E-9,
+           (unsigned long)(check % 1000));
+    free(dst);
+}
+
+static void bench_corpus(const struct Corpus *corpus, int iterations)
+{
+    printf("%s: %lu strings, %lu bytes, average %.1f bytes\n",
+           corpus->name, (unsigned long)corpus->count,
+           (unsigned long)corpus->size,
+           corpus->size / (double)corpus->count);
+    bench(corpus, "scalar", strscan_nul_scalar, strscan_copy_scalar,
+          iterations);
+#ifdef STRSCAN_HAVE_X86
+    bench(corpus, "sse2", strscan_nul_sse2, strscan_copy_sse2, iterations);
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        bench(corpus, "avx2", strscan_nul_avx2, strscan_copy_avx2,
+              iterations);
+#endif
+    bench(corpus, "default", strscan_nul, strscan_copy, iterations);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = (argc > 1)?atoi(argv[1]):200;
+    struct Corpus env;
+    char **e;
+
+    env.name = "environment";
+    env.capacity = 4096;
+    env.data = malloc(env.capacity);
+    env.size = env.count = 0;
+    /* A build environment is usually larger than an interactive one */
+    while(env.size < 16384)
+        for(e = environ; *e; ++e)
+            corpus_add(&env, *e);
+
+    paths.name = "paths";
+    paths.capacity = 4096;
+    paths.data = malloc(paths.capacity);
+    paths.size = paths.count = 0;
+    nftw("/usr", add_path, 16, FTW_PHYS);
+    if(paths.count == 0)
+    {
+        fprintf(stderr, "couldn't list /usr\n");
+        return 1;
+    }
+
+    bench_corpus(&env, iterations);
+    bench_corpus(&paths, iterations);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/* forks.c
+ *
+ * Creates a lot of short-lived processes, a batch at a time; the children of
+ * a batch are all alive at the same time, until their pipe is closed.
+ *
+ * usage: ./forks [total] [batch]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+int main(int argc, char **argv)
+{
+    int total = (argc > 1)?atoi(argv[1]):10000;
+    int batch = (argc > 2)?atoi(argv[2]):500;
+    int done = 0;
+    while(done < total)
+    {
+        int fds[2];
+        int i, n = (total - done < batch)?(total - done):batch;
+        if(pipe(fds) != 0)
+        {
+            perror("pipe");
+            return 2;
+        }
+        for(i = 0; i < n; ++i)
+        {
+            pid_t res = fork();
+            if(res == 0)
+            {
+                char c;
+                close(fds[1]);
+                /* Returns 0 once the parent closes its end */
+                _exit(read(fds[0], &c, 1) == 0?0:1);
+            }
+            else if(res < 0)
+            {
+                perror("fork");
+                return 2;
+            }
+        }
+        close(fds[0]);
+        close(fds[1]);
+        for(i = 0; i < n; ++i)
+        {
+            int status;
+            if(wait(&status) < 0 || !WIFEXITED(status)
+             || WEXITSTATUS(status) != 0)
+                return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
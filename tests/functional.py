@@ -644,6 +644,258 @@ def functional_tests(raise_warnings, interactive, run_vagrant, run_docker):
             raise AssertionError("Created file shouldn't be packed: %s" %
                                  Path(f))
 
+    # ########################################
+    # 'simple' program: trace with --record-failed-lookups
+    #
+
+    # Trace, with an input file that doesn't exist
+    check_call(rpz + ['trace', '--overwrite', '-d', 'negative-trace',
+                      '--dont-identify-packages', '--record-failed-lookups',
+                      './simple', 'missing_input.txt', 'simple_output.txt'])
+    # Check that the failed open() was logged, but not as an opened file
+    database = Path.cwd() / 'negative-trace/trace.sqlite3'
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.row_factory = sqlite3.Row
+    rows = conn.execute(
+        '''
+        SELECT name FROM negative_lookups
+        ''')
+    assert (Path.cwd() / 'missing_input.txt') in set(Path(r[0])
+                                                     for r in rows)
+    rows = conn.execute(
+        '''
+        SELECT name FROM opened_files
+        ''')
+    assert (Path.cwd() / 'missing_input.txt') not in set(Path(r[0])
+                                                         for r in rows)
+    conn.close()
+
+    # ########################################
+    # Several processes: trace with --tracer-threads
+    #
+
+    # Trace, the children get handed over to the other tracer threads
+    check_call(rpz + ['trace', '--overwrite', '-d', 'shards-trace',
+                      '--dont-identify-packages', '--tracer-threads', '3',
+                      'sh', '-c',
+                      './vfork & ./vfork & ./simple %s simple_output.txt; '
+                      'wait' % (tests / 'simple_input.txt').path])
+    # Check that all the processes were followed until they exited
+    database = Path.cwd() / 'shards-trace/trace.sqlite3'
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.row_factory = sqlite3.Row
+    rows = conn.execute(
+        '''
+        SELECT exitcode FROM processes
+        ''').fetchall()
+    assert len(rows) >= 6
+    assert all(r['exitcode'] == 0 for r in rows)
+    rows = conn.execute(
+        '''
+        SELECT name FROM executed_files
+        ''')
+    executed = set(Path(r[0]).name for r in rows)
+    assert set(['vfork', 'echo', 'simple']).issubset(executed)
+    conn.close()
+
+    # ########################################
+    # 'simple' program: trace with --binary-log
+    #
+
+    # Trace twice in the same directory, the second run is appended
+    for flag in ('--overwrite', '--continue'):
+        check_call(rpz + ['trace', flag, '-d', 'binlog-trace',
+                          '--dont-identify-packages', '--binary-log',
+                          './simple', (tests / 'simple_input.txt').path,
+                          'simple_output.txt'])
+    # Check that the log was loaded into the database, then removed
+    assert not (Path.cwd() / 'binlog-trace/trace.log').exists()
+    database = Path.cwd() / 'binlog-trace/trace.sqlite3'
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.row_factory = sqlite3.Row
+    rows = conn.execute(
+        '''
+        SELECT id, run_id, parent, exitcode FROM processes
+        ORDER BY id
+        ''').fetchall()
+    assert [(r['id'], r['run_id'], r['parent'], r['exitcode'])
+            for r in rows] == [(1, 0, None, 0), (2, 1, None, 0)]
+    rows = conn.execute(
+        '''
+        SELECT process, name FROM opened_files
+        ''')
+    opened = set((r['process'], Path(r['name'])) for r in rows)
+    for process in (1, 2):
+        assert (process, tests / 'simple_input.txt') in opened
+        assert (process, Path.cwd() / 'simple_output.txt') in opened
+    rows = conn.execute(
+        '''
+        SELECT name FROM sqlite_master WHERE type='index'
+        ''')
+    assert 'open_proc_idx' in set(r['name'] for r in rows)
+    conn.close()
+
+    # ########################################
+    # 'simple' program: trace with --in-memory
+    #
+
+    # The first run is written with the backup API, the second one appended
+    for flag in ('--overwrite', '--continue'):
+        check_call(rpz + ['trace', flag, '-d', 'memory-trace',
+                          '--dont-identify-packages', '--in-memory',
+                          './simple', (tests / 'simple_input.txt').path,
+                          'simple_output.txt'])
+    database = Path.cwd() / 'memory-trace/trace.sqlite3'
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.row_factory = sqlite3.Row
+    rows = conn.execute(
+        '''
+        SELECT id, run_id, exitcode FROM processes
+        ORDER BY id
+        ''').fetchall()
+    assert [(r['id'], r['run_id'], r['exitcode'])
+            for r in rows] == [(1, 0, 0), (2, 1, 0)]
+    rows = conn.execute(
+        '''
+        SELECT process, name FROM opened_files
+        ''')
+    opened = set((r['process'], Path(r['name'])) for r in rows)
+    for process in (1, 2):
+        assert (process, tests / 'simple_input.txt') in opened
+    conn.close()
+
+    # ########################################
+    # 'simple' program: trace with --checkpoint
+    #
+
+    check_call(rpz + ['trace', '--overwrite', '-d', 'checkpoint-trace',
+                      '--dont-identify-packages', '--checkpoint',
+                      './simple', (tests / 'simple_input.txt').path,
+                      'simple_output.txt'])
+    database = Path.cwd() / 'checkpoint-trace/trace.sqlite3'
+    # Left in rollback journal mode
+    assert not (Path.cwd() / 'checkpoint-trace/trace.sqlite3-wal').exists()
+
+    def check_runs(expected):
+        if PY3:
+            # On PY3, connect() only accepts unicode
+            conn = sqlite3.connect(str(database))
+        else:
+            conn = sqlite3.connect(database.path)
+        assert conn.execute('PRAGMA journal_mode;').fetchone()[0] == 'delete'
+        runs = conn.execute(
+            '''
+            SELECT r.id, r.status, count(p.id) FROM runs r
+            LEFT OUTER JOIN processes p ON p.run_id = r.id
+            GROUP BY r.id ORDER BY r.id
+            ''').fetchall()
+        assert runs == expected
+        conn.close()
+
+    check_runs([(0, 'done', 1)])
+
+    # Pretend the tracer was killed during the run; the next one keeps it
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.execute("UPDATE runs SET status='running';")
+    conn.commit()
+    conn.close()
+    check_call(rpz + ['trace', '--continue', '-d', 'checkpoint-trace',
+                      '--dont-identify-packages', '--checkpoint',
+                      './simple', (tests / 'simple_input.txt').path,
+                      'simple_output.txt'])
+    check_runs([(0, 'crashed', 1), (1, 'done', 1)])
+
+    # Or deletes it
+    check_call(rpz + ['trace', '--continue', '-d', 'checkpoint-trace',
+                      '--dont-identify-packages', '--drop-crashed',
+                      './simple', (tests / 'simple_input.txt').path,
+                      'simple_output.txt'])
+    check_runs([(1, 'done', 1), (2, 'done', 1)])
+
+    # Deleting the only run leaves paths and environments, that an in-memory
+    # capture refers to; it has to be appended, not copied over the file
+    check_call(rpz + ['trace', '--overwrite', '-d', 'checkpoint-trace',
+                      '--dont-identify-packages', '--checkpoint',
+                      './simple', (tests / 'simple_input.txt').path,
+                      'simple_output.txt'])
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.execute("UPDATE runs SET status='running';")
+    conn.commit()
+    conn.close()
+    check_call(rpz + ['trace', '--continue', '-d', 'checkpoint-trace',
+                      '--dont-identify-packages', '--in-memory',
+                      '--drop-crashed',
+                      './simple', (tests / 'simple_input.txt').path,
+                      'simple_output.txt'])
+    check_runs([(0, 'done', 1)])
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    rows = conn.execute(
+        '''
+        SELECT name FROM opened_files
+        ''')
+    assert tests / 'simple_input.txt' in set(Path(r[0]) for r in rows)
+    rows = conn.execute(
+        '''
+        SELECT e.environment FROM executed_files e
+        LEFT OUTER JOIN environments n ON e.environment = n.id
+        WHERE n.id IS NULL
+        ''').fetchall()
+    assert rows == []
+    conn.close()
+
+    # ########################################
+    # 'forks' program: trace 10k short-lived processes
+    #
+
+    # Build
+    build('forks', ['forks.c'])
+    # Trace
+    check_call(rpz + ['trace', '--overwrite', '-d', 'forks-trace',
+                      '--dont-identify-packages', './forks', '10000', '1000'])
+    # Check that every process was recorded, and seen exiting
+    database = Path.cwd() / 'forks-trace/trace.sqlite3'
+    if PY3:
+        # On PY3, connect() only accepts unicode
+        conn = sqlite3.connect(str(database))
+    else:
+        conn = sqlite3.connect(database.path)
+    conn.row_factory = sqlite3.Row
+    rows = conn.execute(
+        '''
+        SELECT exitcode FROM processes
+        ''').fetchall()
+    assert len(rows) == 10001
+    assert all(r['exitcode'] == 0 for r in rows)
+    conn.close()
+
     # ########################################
     # Test shebang corner-cases
     #
@@ -12,7 +12,8 @@ import sys
 import unittest
 
 from reprozip.common import FILE_READ, FILE_WRITE, FILE_WDIR, InputOutputFile
-from reprozip.tracer.trace import get_files, compile_inputs_outputs
+from reprozip.tracer.trace import get_files, compile_inputs_outputs, \
+    read_environment
 from reprozip import traceutils
 from reprozip.utils import PY3, unicode_, UniqueNames, make_dir_writable
 
@@ -342,9 +343,76 @@ INSERT INTO "executed_files" VALUES(1,'/bin/false',0,12345678903002,0,'false',
              (6, 4, '/home', 12345678903001, 4, 1, 6)],
 
             [(1, '/usr/bin/id', 1, 12345678901002, 1, 'id',
-              'RUN=first', '/home/vagrant'),
+              'RUN=first', '/home/vagrant', None),
              (2, '/usr/bin/id', 3, 12345678902006, 5, 'id',
-              'RUN=third', '/home/vagrant'),
+              'RUN=third', '/home/vagrant', None),
              (3, '/bin/false', 4, 12345678903002, 6, 'false',
-              'RUN=fourth', '/home')],
+              'RUN=fourth', '/home', None)],
         ])
+
+    def test_combine_environments(self):
+        traces = []
+        sql_data = [
+            [(1, b'h1', None, 'A=1\0B=2\0'),
+             (2, b'h2', 1, '=1\0+C=3\0')],
+            [(1, b'h2', None, 'A=1\0C=3\0'),
+             (2, b'h3', 1, '+D=4\0=1\0')],
+        ]
+        for i, environments in enumerate(sql_data):
+            trace = self.tmpdir / ('trace%d.sqlite3' % i)
+            if PY3:
+                conn = sqlite3.connect(str(trace))
+            else:
+                conn = sqlite3.connect(trace.path)
+            traceutils.create_schema(conn)
+            conn.execute(
+                '''
+                INSERT INTO processes(id, run_id, parent, timestamp,
+                                      is_thread, exitcode)
+                VALUES(1, 0, NULL, 12345678901001, 0, 0);
+                ''')
+            for env_id, env_hash, base, data in environments:
+                conn.execute(
+                    '''
+                    INSERT INTO environments(id, hash, base, data)
+                    VALUES(?, ?, ?, ?);
+                    ''',
+                    (env_id, sqlite3.Binary(env_hash), base, data))
+                conn.execute(
+                    '''
+                    INSERT INTO executed_files(name, run_id, timestamp,
+                                               process, argv, envp,
+                                               workingdir, environment)
+                    VALUES('/bin/true', 0, 12345678901002, 1, 'true', '',
+                           '/', ?);
+                    ''',
+                    (env_id,))
+            conn.commit()
+            conn.close()
+
+            traces.append(trace)
+
+        target = self.tmpdir / 'target'
+        traceutils.combine_traces(traces, target)
+        target = target / 'trace.sqlite3'
+
+        if PY3:
+            conn = sqlite3.connect(str(target))
+        else:
+            conn = sqlite3.connect(target.path)
+        environments = list(conn.execute(
+            '''
+            SELECT id, base FROM environments;
+            '''))
+        executions = [r[0] for r in conn.execute(
+            '''
+            SELECT environment FROM executed_files ORDER BY id;
+            ''')]
+        cache = {}
+        decoded = [read_environment(conn, e, cache) for e in executions]
+        conn.close()
+
+        self.assertEqual(environments, [(1, None), (2, 1), (3, 2)])
+        self.assertEqual(executions, [1, 2, 2, 3])
+        self.assertEqual(decoded, [['A=1', 'B=2'], ['A=1', 'C=3'],
+                                   ['A=1', 'C=3'], ['D=4', 'A=1']])